@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bufferless_str.h"
+
+#define BUF_LEN 4096
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// RFC 4648 section 10
+static const char* vectors[][2] = {
+    { "", "" },
+    { "f", "Zg==" },
+    { "fo", "Zm8=" },
+    { "foo", "Zm9v" },
+    { "foob", "Zm9vYg==" },
+    { "fooba", "Zm9vYmE=" },
+    { "foobar", "Zm9vYmFy" },
+};
+#define VECTORS_LEN ((int) (sizeof(vectors) / sizeof(vectors[0])))
+
+// What the old char at a time code did, to have something to compare to.
+static int ref_value(char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+static char ref_char(int v) {
+    if (v < 26) return 'A' + v;
+    if (v < 52) return 'a' + v - 26;
+    if (v < 62) return '0' + v - 52;
+    return v == 62 ? '+' : '/';
+}
+
+static int ref_encode(char* out, const unsigned char* in, int len) {
+    int o = 0;
+    for (int i = 0; i < len; i += 3) {
+        int rem = len - i;
+        int word = in[i] << 16 | (rem > 1 ? in[i + 1] << 8 : 0) | (rem > 2 ? in[i + 2] : 0);
+        out[o++] = ref_char(word >> 18);
+        out[o++] = ref_char((word >> 12) & 0x3F);
+        out[o++] = rem > 1 ? ref_char((word >> 6) & 0x3F) : '=';
+        out[o++] = rem > 2 ? ref_char(word & 0x3F) : '=';
+    }
+    return o;
+}
+
+static int ref_decode(unsigned char* out, const char* in, int len) {
+    int o = 0, bits = 0, n = 0;
+    for (int i = 0; i < len; i++) {
+        int v = ref_value(in[i]);
+        if (v < 0) continue;
+        bits = (bits << 6 | v) & 0xFFFF;
+        n += 6;
+        if (n >= 8) {
+            n -= 8;
+            out[o++] = bits >> n;
+        }
+    }
+    return o;
+}
+
+static int check() {
+    char enc[BUF_LEN * 2];
+    char dec[BUF_LEN * 2];
+
+    for (int v = 0; v < VECTORS_LEN; v++) {
+        int len = strlen(vectors[v][0]);
+        int enc_len = encode_base64(enc, vectors[v][0], len);
+        if (enc_len != (int) strlen(vectors[v][1]) || memcmp(enc, vectors[v][1], enc_len)) {
+            printf("FAIL encode \"%s\": %.*s\n", vectors[v][0], enc_len, enc);
+            return 1;
+        }
+        base64_ctx ctx = { 0 };
+        int dec_len = decode_base64(&ctx, (char*) vectors[v][1], dec, enc_len, 1);
+        if (dec_len != len || memcmp(dec, vectors[v][0], len)) {
+            printf("FAIL decode \"%s\"\n", vectors[v][1]);
+            return 1;
+        }
+    }
+
+    // Unpadded input needs end to flush, line breaks are skipped
+    base64_ctx ctx = { 0 };
+    int dec_len = decode_base64(&ctx, "Zm9v\r\nYmE", dec, 9, 1);
+    if (dec_len != 5 || memcmp(dec, "fooba", 5)) {
+        printf("FAIL decode unpadded\n");
+        return 1;
+    }
+
+    // Random data, every length, fed in every chunk size
+    unsigned char data[256];
+    srand(1);
+    for (int i = 0; i < (int) sizeof(data); i++) {
+        data[i] = rand();
+    }
+    for (int len = 0; len <= (int) sizeof(data); len++) {
+        char ref[BUF_LEN];
+        int ref_len = ref_encode(ref, data, len);
+
+        for (int chunk = 1; chunk <= 17; chunk++) {
+            base64_enc_ctx ectx = { 0 };
+            int enc_len = 0;
+            for (int i = 0; i < len; i += chunk) {
+                int n = len - i < chunk ? len - i : chunk;
+                enc_len += encode_base64_update(&ectx, enc + enc_len, (char*) data + i, n);
+            }
+            enc_len += encode_base64_final(&ectx, enc + enc_len);
+            if (enc_len != ref_len || memcmp(enc, ref, ref_len)) {
+                printf("FAIL encode len=%d chunk=%d\n", len, chunk);
+                return 1;
+            }
+
+            base64_ctx dctx = { 0 };
+            int dec_len = 0;
+            for (int i = 0; i < enc_len; i += chunk) {
+                int n = enc_len - i < chunk ? enc_len - i : chunk;
+                dec_len += decode_base64(&dctx, enc + i, dec + dec_len, n, i + n == enc_len);
+            }
+            if (dec_len != len || memcmp(dec, data, len)) {
+                printf("FAIL decode len=%d chunk=%d\n", len, chunk);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    double min_time = argc > 1 ? atof(argv[1]) : 0.1;
+
+    if (check()) {
+        return 1;
+    }
+
+    static unsigned char data[BUF_LEN];
+    static char enc[BUF_LEN * 2];
+    static char dec[BUF_LEN];
+    for (int i = 0; i < BUF_LEN; i++) {
+        data[i] = rand();
+    }
+    int enc_len = encode_base64(enc, (char*) data, BUF_LEN);
+
+    printf("variant,direction,mb_per_s\n");
+    for (int v = 0; v < 2; v++) {
+        for (int d = 0; d < 2; d++) {
+            long iters = 0;
+            volatile int sink = 0;
+            double start = now_s();
+            double elapsed;
+            do {
+                for (int b = 0; b < 100; b++) {
+                    if (d == 0) {
+                        sink += v ? encode_base64(enc, (char*) data, BUF_LEN) : ref_encode(enc, data, BUF_LEN);
+                    } else if (v) {
+                        base64_ctx ctx = { 0 };
+                        sink += decode_base64(&ctx, enc, dec, enc_len, 1);
+                    } else {
+                        sink += ref_decode((unsigned char*) dec, enc, enc_len);
+                    }
+                }
+                iters += 100;
+                elapsed = now_s() - start;
+            } while (elapsed < min_time);
+
+            // MB/s of the binary side in both directions
+            printf("%s,%s,%.1f\n", v ? "table" : "reference", d ? "decode" : "encode",
+                   (double) iters * BUF_LEN / elapsed / 1e6);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ws_deflate.h"
+
+#define MSG_MAX 1024
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// zlib -9 with a sync flush (tail taken off), a dynamic Huffman block.
+static const char dynamic_text[] =
+    "e etieeit eei  iaeeenaeeeetetiaaaoeteeeietatanat aetetet eetteeiieteaeetaaeeeat tneeteee eeatteettteaaona "
+    "entaetatnt teateaeetotttieeettottetettttaeeetneteteaee";
+static const uint8_t dynamic_deflated[] = {
+    0x24, 0x8d, 0xb1, 0x0d, 0x00, 0x31, 0x0c, 0x02, 0x57, 0x61, 0x35, 0x0a,
+    0x0a, 0x37, 0x76, 0xc3, 0xfe, 0x7a, 0xc8, 0xa7, 0xb0, 0x1c, 0x1d, 0x9c,
+    0x05, 0x79, 0xa4, 0x31, 0x32, 0x80, 0xa1, 0xa4, 0xed, 0x90, 0x03, 0x48,
+    0x5e, 0x96, 0x20, 0x99, 0xe6, 0xd2, 0x60, 0x81, 0x1a, 0x77, 0xc0, 0x04,
+    0x28, 0x71, 0xb3, 0x9d, 0x60, 0xaf, 0x5e, 0x01, 0xfd, 0xb9, 0xa1, 0x70,
+    0xde, 0x12, 0x5a, 0xb3, 0x96, 0x4d, 0x28, 0xec, 0xb5, 0x2e, 0x78, 0x7a,
+    0xab, 0x5b, 0xb5, 0x79, 0x15, 0xc5, 0xe2, 0x5f, 0xfc, 0x01,
+};
+
+// The kind of thing we send
+typedef struct sample_ {
+    const char* name;
+    uint8_t data[MSG_MAX];
+    size_t len;
+} sample;
+
+static sample samples[3];
+
+static void make_samples() {
+    srand(1);
+
+    // Telemetry as text, like a websocket_write() of a few readings
+    sample* s = &samples[0];
+    s->name = "telemetry";
+    for (int i = 0; s->len < 240; i++) {
+        s->len += sprintf((char*) s->data + s->len, "{\"t\":%d,\"led\":%d,\"adc\":%d}\n",
+                          120000 + i * 50, i & 1, 2040 + rand() % 16);
+    }
+
+    s = &samples[1];
+    s->name = "log";
+    static const char* lines[] = {
+        "Normal HTTP request recieved.\n",
+        "Header complete.\n",
+        "Header sent.\n",
+        "Keep-alive connection idle\n",
+    };
+    for (int i = 0; s->len < 200; i++) {
+        const char* line = lines[rand() % 4];
+        memcpy(s->data + s->len, line, strlen(line));
+        s->len += strlen(line);
+    }
+
+    // Binary sensor message (ws_push_sensor()), noisy ADC samples
+    s = &samples[2];
+    s->name = "sensor";
+    s->len = 8 + 2 * 4;
+    for (size_t i = 0; i < s->len; i++) {
+        s->data[i] = i < 8 ? (int) i : rand();
+    }
+}
+
+static int round_trip(ws_deflate* def, ws_inflate* inf, const uint8_t* data, size_t len) {
+    static uint8_t compressed[WS_DEFLATE_BOUND(MSG_MAX) + WS_DEFLATE_TAIL_LEN];
+    static uint8_t out[MSG_MAX];
+
+    int c = ws_deflate_compress(def, compressed, WS_DEFLATE_BOUND(len), data, len);
+    if (c < 0) {
+        return -1;
+    }
+    memcpy(compressed + c, ws_deflate_tail, WS_DEFLATE_TAIL_LEN);
+    int d = ws_inflate_message(inf, out, sizeof(out), compressed, c + WS_DEFLATE_TAIL_LEN);
+    if (d != (int) len || memcmp(out, data, len)) {
+        return -1;
+    }
+    return c;
+}
+
+static int check(ws_inflate* inf) {
+    static ws_deflate def;
+    uint8_t buf[sizeof(dynamic_deflated) + WS_DEFLATE_TAIL_LEN];
+    uint8_t out[MSG_MAX];
+
+    memcpy(buf, dynamic_deflated, sizeof(dynamic_deflated));
+    memcpy(buf + sizeof(dynamic_deflated), ws_deflate_tail, WS_DEFLATE_TAIL_LEN);
+    int d = ws_inflate_message(inf, out, sizeof(out), buf, sizeof(buf));
+    if (d != (int) sizeof(dynamic_text) - 1 || memcmp(out, dynamic_text, d)) {
+        printf("FAIL inflate dynamic block: %d\n", d);
+        return 1;
+    }
+    if (ws_inflate_message(inf, out, 10, buf, sizeof(buf)) != WS_INFLATE_ERR_FULL) {
+        printf("FAIL inflate into a small buffer\n");
+        return 1;
+    }
+
+    for (int bits = WS_DEFLATE_MIN_WINDOW_BITS; bits <= WS_DEFLATE_MAX_WINDOW_BITS; bits++) {
+        ws_deflate_init(&def, bits);
+        for (int s = 0; s < 3; s++) {
+            for (size_t len = 0; len <= samples[s].len; len++) {
+                if (round_trip(&def, inf, samples[s].data, len) < 0) {
+                    printf("FAIL round trip %s len=%zu bits=%d\n", samples[s].name, len, bits);
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    double min_time = argc > 1 ? atof(argv[1]) : 0.1;
+
+    static ws_inflate inf;
+    make_samples();
+    if (check(&inf)) {
+        return 1;
+    }
+
+    printf("sample,window_bits,len,compressed_len,deflate_mb_per_s,inflate_mb_per_s\n");
+    static const int window_bits[] = { 8, 10, 15 };
+    for (int s = 0; s < 3; s++) {
+        for (int w = 0; w < 3; w++) {
+            static ws_deflate def;
+            static uint8_t compressed[WS_DEFLATE_BOUND(MSG_MAX) + WS_DEFLATE_TAIL_LEN];
+            static uint8_t out[MSG_MAX];
+            ws_deflate_init(&def, window_bits[w]);
+
+            int c = 0;
+            double mb_per_s[2];
+            for (int dir = 0; dir < 2; dir++) {
+                long iters = 0;
+                volatile int sink = 0;
+                double start = now_s();
+                double elapsed;
+                do {
+                    for (int b = 0; b < 100; b++) {
+                        if (dir == 0) {
+                            c = ws_deflate_compress(&def, compressed, sizeof(compressed), samples[s].data, samples[s].len);
+                            memcpy(compressed + c, ws_deflate_tail, WS_DEFLATE_TAIL_LEN);
+                            sink += c;
+                        } else {
+                            sink += ws_inflate_message(&inf, out, sizeof(out), compressed, c + WS_DEFLATE_TAIL_LEN);
+                        }
+                    }
+                    iters += 100;
+                    elapsed = now_s() - start;
+                } while (elapsed < min_time);
+                // MB/s of the uncompressed side both ways
+                mb_per_s[dir] = (double) iters * samples[s].len / elapsed / 1e6;
+            }
+
+            printf("%s,%d,%zu,%d,%.1f,%.1f\n", samples[s].name, window_bits[w], samples[s].len, c,
+                   mb_per_s[0], mb_per_s[1]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,807 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "pico/stdlib.h"
+#include "lwip/err.h"
+#include "lwip/def.h"
+#include "sub_task.h"
+#include "ws_mask.h"
+#include "ws_stats.h"
+
+// websocket_write() for writes of different sizes, around WS_ITS_LARGE_ENOUGH_JUST_SEND_IT and
+// WS_MAX_PAYLOAD_LEN. The framinator is the real one (websocket_framinator.h), running in a sub_task
+// like on the pico. TCP is faked below: tcp_write() only does the send buffer accounting (lwIP does not
+// copy from the ring either), and acks come from one of two links:
+//   instant: everything is ack'ed as soon as it's output. Nothing is ever in flight, so every write
+//            that is left over is sent right away as it's own frame.
+//   stalled: nothing is ack'ed until the writer has to wait. Small writes pile up into frames.
+// A real link is somewhere in between. frames and wire_bytes are what the heuristics are about,
+// mb_per_s is what they cost on the host.
+
+#define DEBUG_printf(...)
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// ================ FAKE TCP ================
+
+#define TCP_MSS     1460
+#define TCP_SND_BUF (8 * TCP_MSS) // Same as lwipopts.h
+#define TCP_WRITE_FLAG_COPY 0x01
+#define TCP_WRITE_FLAG_MORE 0x02
+
+#define WS_T_YIELD_REASON_READ         ((size_t) 1 << 0)
+#define WS_T_YIELD_REASON_FLUSH        ((size_t) 1 << 1)
+#define WS_T_YIELD_REASON_WAIT_FOR_ACK ((size_t) 1 << 2)
+
+struct pbuf;
+
+struct tcp_pcb {
+    u16_t snd_buf;
+    bool instant_ack;
+    size_t unacked;   // Written, not output yet or not ack'ed
+    size_t wire_bytes;
+    // When set, everything written is copied here to check the frames
+    uint8_t* sink;
+    size_t sink_len;
+};
+
+#define tcp_sndbuf(pcb) ((pcb)->snd_buf)
+
+typedef struct ws_ack_callback_ {
+    err_t (*call)(void*, u16_t);
+    void* arg;
+} ws_ack_callback;
+
+typedef struct ws_cliant_con_ {
+    struct tcp_pcb* printed_circuit_board;
+    ws_ack_callback ack_callback;
+    struct pbuf* p_current;
+    bool p_pinned;
+    sub_task* task;
+    ws_con_stats stats;
+    // What the client sent, for the read checks. Reads past the end get ERR_CLSD.
+    const uint8_t* in;
+    size_t in_len;
+} ws_cliant_con;
+
+static ws_cliant_con* the_con;
+
+void set_ack_callback(ws_cliant_con* cli_con, err_t (*call)(void*, u16_t), void* arg) {
+    cli_con->ack_callback.call = call;
+    cli_con->ack_callback.arg = arg;
+}
+
+// Same as testing.c
+void* ws_t_yield(ws_cliant_con* cli_con, size_t reasons) {
+#if WS_STATS
+    cli_con->stats.yields_read += (reasons & WS_T_YIELD_REASON_READ) != 0;
+    cli_con->stats.yields_flush += (reasons & WS_T_YIELD_REASON_FLUSH) != 0;
+    if (reasons & WS_T_YIELD_REASON_WAIT_FOR_ACK) {
+        cli_con->stats.yields_ack++;
+        absolute_time_t start = get_absolute_time();
+        void* ret = sub_task_yield(reasons, cli_con->task);
+        cli_con->stats.ack_wait_us += (uint32_t) absolute_time_diff_us(start, get_absolute_time());
+        return ret;
+    }
+#endif
+    return sub_task_yield(reasons, cli_con->task);
+}
+
+/**
+ * @brief What tcp_sent does: hands the ack'ed bytes to the ack callback, at most a u16_t at a time.
+ */
+static void tcp_ack_all(ws_cliant_con* cli_con) {
+    struct tcp_pcb* pcb = cli_con->printed_circuit_board;
+    while (pcb->unacked) {
+        u16_t len = MIN(pcb->unacked, 0xFFFF);
+        pcb->unacked -= len;
+        pcb->snd_buf += len;
+        cli_con->ack_callback.call(cli_con->ack_callback.arg, len);
+    }
+}
+
+static err_t tcp_write(struct tcp_pcb* pcb, const void* dataptr, u16_t len, u8_t apiflags) {
+    if (len > pcb->snd_buf) {
+        return ERR_MEM;
+    }
+    if (pcb->sink) {
+        memcpy(pcb->sink + pcb->sink_len, dataptr, len);
+        pcb->sink_len += len;
+    }
+    pcb->snd_buf -= len;
+    pcb->unacked += len;
+    pcb->wire_bytes += len;
+    return ERR_OK;
+}
+
+static err_t tcp_output(struct tcp_pcb* pcb) {
+    if (pcb->instant_ack) {
+        tcp_ack_all(the_con);
+    }
+    return ERR_OK;
+}
+
+// ================ THE ws_t_* HELPERS IT USES ================
+
+// Same as testing.c, minus TLS.
+err_t ws_t_write(ws_cliant_con* cli_con, void* dataptr, size_t len, u8_t apiflags) {
+    err_t ret;
+
+    if (cli_con->printed_circuit_board == NULL) {
+        return ERR_CLSD;
+    }
+
+    while (tcp_sndbuf(cli_con->printed_circuit_board) == 0) {
+        tcp_output(cli_con->printed_circuit_board);
+        if (ret = (size_t) ws_t_yield(cli_con, WS_T_YIELD_REASON_WAIT_FOR_ACK)) {
+            return ret;
+        }
+    }
+
+    while (tcp_sndbuf(cli_con->printed_circuit_board) < len) {
+        u16_t space_available = tcp_sndbuf(cli_con->printed_circuit_board);
+        if (ret = tcp_write(cli_con->printed_circuit_board, dataptr, space_available,
+                apiflags | TCP_WRITE_FLAG_MORE)) {
+            return ret;
+        }
+        len -= space_available;
+        dataptr += space_available;
+
+        tcp_output(cli_con->printed_circuit_board);
+        if (ret = (size_t) ws_t_yield(cli_con, WS_T_YIELD_REASON_WAIT_FOR_ACK)) {
+            return ret;
+        }
+    }
+    return tcp_write(cli_con->printed_circuit_board, dataptr, len, apiflags);
+}
+
+int ws_t_wait_until(ws_cliant_con* cli_con, size_t reasons, absolute_time_t deadline) {
+    size_t err = (size_t) sub_task_yield(reasons, cli_con->task);
+    return err ? (int) err : (int) reasons;
+}
+
+void ws_cli_con_abort(ws_cliant_con* cli_con) {
+    cli_con->printed_circuit_board = NULL;
+}
+
+// Reads come out of in, all of it there from the start. p_current is only looked at for whether
+// anything is buffered, so it's set while some of in is left.
+int ws_consume(ws_cliant_con* cli_con, size_t size) {
+    if (size > cli_con->in_len) {
+        return ERR_CLSD;
+    }
+    cli_con->in += size;
+    cli_con->in_len -= size;
+    cli_con->p_current = cli_con->in_len ? (struct pbuf*) cli_con->in : NULL;
+    return ERR_OK;
+}
+
+int ws_t_read(ws_cliant_con* cli_con, char* buf, size_t size) {
+    if (size > cli_con->in_len) {
+        return ERR_CLSD;
+    }
+    memcpy(buf, cli_con->in, size);
+    ws_consume(cli_con, size);
+    return size;
+}
+
+int ws_t_read_masked(ws_cliant_con* cli_con, char* buf, size_t size, uint32_t* mask) {
+    if (size > cli_con->in_len) {
+        return ERR_CLSD;
+    }
+    *mask = ws_mask_copy(buf, cli_con->in, size, *mask);
+    ws_consume(cli_con, size);
+    return size;
+}
+
+int ws_t_peak(ws_cliant_con* cli_con, char** buf_ptr) {
+    if (!cli_con->in_len) {
+        return ERR_CLSD;
+    }
+    *buf_ptr = (char*) cli_con->in;
+    return cli_con->in_len;
+}
+
+int ws_t_skip(ws_cliant_con* cli_con, uint64_t size) {
+    return ws_consume(cli_con, size);
+}
+
+#include "websocket_framinator.h"
+
+// ================ BENCH ================
+
+#define STACK_SIZE (64 * 1024)
+static uint64_t stack[STACK_SIZE / 8] __attribute__((aligned(16)));
+
+// Payload of one timed run
+#define RUN_BYTES (1024 * 1024)
+
+typedef struct run_ {
+    bool instant_ack;
+    size_t write_len;
+    size_t total;
+    const char* data; // At least write_len
+
+    // Results
+    err_t err;
+    size_t frames;
+    size_t ack_waits;
+    double elapsed;
+} run;
+
+static ws_framinator framinator;
+
+static size_t writer_task(sub_task* task, void* args) {
+    run* r = args;
+    double start = now_s();
+    for (size_t written = 0; written < r->total; written += r->write_len) {
+        if ((r->err = websocket_write(&framinator, r->data, MIN(r->write_len, r->total - written)))) {
+            return 0;
+        }
+    }
+    r->err = websocket_flush(&framinator);
+    r->elapsed = now_s() - start;
+    return 0;
+}
+
+/**
+ * @brief Runs the writer like iol_run_ready() would. Whenever it waits for an ACK, everything is ack'ed.
+ */
+static void run_writer(run* r, uint8_t* sink) {
+    static struct tcp_pcb pcb;
+    static ws_cliant_con con;
+    pcb = (struct tcp_pcb) { .snd_buf = TCP_SND_BUF, .instant_ack = r->instant_ack, .sink = sink };
+    con = (ws_cliant_con) { .printed_circuit_board = &pcb };
+    the_con = &con;
+
+    sub_task* task = (sub_task*) stack;
+    sub_task_init(task, STACK_SIZE);
+    con.task = task;
+
+    if ((r->err = websocket_initialize_framinator(&framinator, &con))) {
+        return;
+    }
+
+    r->ack_waits = 0;
+    size_t reason = sub_task_run(task, writer_task, r);
+    while (!sub_task_done(task)) {
+        if (reason & WS_T_YIELD_REASON_WAIT_FOR_ACK) {
+            r->ack_waits++;
+        }
+        tcp_ack_all(&con);
+        reason = sub_task_continue(task, NULL);
+    }
+    r->frames = framinator.msg_frames_sent;
+    tcp_ack_all(&con);
+    websocket_deinit_framinator(&framinator);
+}
+
+/**
+ * @brief Parses the server frames in the sink and checks the payloads add up to the data written.
+ */
+static int check_frames(const uint8_t* wire, size_t wire_len, const run* r) {
+    size_t pos = 0, payload_total = 0, frames = 0;
+    while (pos < wire_len) {
+        if (wire_len - pos < 2 || wire[pos] != (WS_HEADER_FIN | WS_HEADER_OPCODE_TEXT) || (wire[pos + 1] & 0x80)) {
+            printf("FAIL bad header at %zu\n", pos);
+            return 1;
+        }
+        uint64_t len = wire[pos + 1];
+        pos += 2;
+        if (len == WS_HEADER_PAYLOAD_LEN_USE_16BIT) {
+            len = (wire[pos] << 8) | wire[pos + 1];
+            pos += 2;
+        } else if (len == WS_HEADER_PAYLOAD_LEN_USE_64BIT) {
+            len = 0;
+            for (int i = 0; i < 8; i++) {
+                len = (len << 8) | wire[pos + i];
+            }
+            pos += 8;
+        }
+        if (len > WS_MAX_PAYLOAD_LEN || pos + len > wire_len) {
+            printf("FAIL frame of %llu at %zu\n", (unsigned long long) len, pos);
+            return 1;
+        }
+        for (size_t i = 0; i < len; i++) {
+            if (wire[pos + i] != (uint8_t) r->data[(payload_total + i) % r->write_len]) {
+                printf("FAIL payload byte %zu\n", payload_total + i);
+                return 1;
+            }
+        }
+        pos += len;
+        payload_total += len;
+        frames++;
+    }
+    if (payload_total != r->total || frames != r->frames) {
+        printf("FAIL got %zu bytes in %zu frames, wrote %zu in %zu\n", payload_total, frames, r->total, r->frames);
+        return 1;
+    }
+    if (WS_STATS && the_con->stats.frames_out != frames) {
+        printf("FAIL frames_out %lu, sent %zu\n", (unsigned long) the_con->stats.frames_out, frames);
+        return 1;
+    }
+    if (WS_STATS && the_con->stats.ring_peak > WS_RING_MAX_IN_TCP) {
+        printf("FAIL %lu ring bytes in TCP\n", (unsigned long) the_con->stats.ring_peak);
+        return 1;
+    }
+    return 0;
+}
+
+static const size_t write_lens[] = {
+    1, 16, 64, 128,
+    WS_ITS_LARGE_ENOUGH_JUST_SEND_IT - 1, WS_ITS_LARGE_ENOUGH_JUST_SEND_IT, WS_ITS_LARGE_ENOUGH_JUST_SEND_IT + 1,
+    WS_MAX_PAYLOAD_LEN - 1, WS_MAX_PAYLOAD_LEN, WS_MAX_PAYLOAD_LEN + 1,
+    1024, 4096
+};
+#define WRITE_LENS_LEN (sizeof(write_lens) / sizeof(write_lens[0]))
+
+static char data[4096];
+
+static size_t ping_ring_before;
+
+static size_t ping_task(sub_task* task, void* args) {
+    run* r = args;
+    for (size_t written = 0; written < r->total; written += r->write_len) {
+        if ((r->err = websocket_write(&framinator, r->data, r->write_len))) {
+            return 0;
+        }
+    }
+    if ((r->err = websocket_ping(&framinator, "x", 1))) {
+        return 0;
+    }
+    ping_ring_before = framinator.ctrl[framinator.ctrl_len - 1].ring_before;
+    return 0;
+}
+
+/**
+ * @brief A ping after a burst on the stalled link. It can only be behind WS_RING_MAX_IN_TCP of frames.
+ */
+static int check_ping() {
+    static struct tcp_pcb pcb;
+    static ws_cliant_con con;
+    pcb = (struct tcp_pcb) { .snd_buf = TCP_SND_BUF };
+    con = (ws_cliant_con) { .printed_circuit_board = &pcb };
+    the_con = &con;
+
+    sub_task* task = (sub_task*) stack;
+    sub_task_init(task, STACK_SIZE);
+    con.task = task;
+    if (websocket_initialize_framinator(&framinator, &con)) {
+        printf("FAIL ping setup\n");
+        return 1;
+    }
+    run r = { .write_len = WS_MAX_PAYLOAD_LEN, .total = 64 * 1024, .data = data };
+    sub_task_run(task, ping_task, &r);
+    while (!sub_task_done(task)) {
+        tcp_ack_all(&con);
+        sub_task_continue(task, NULL);
+    }
+    tcp_ack_all(&con);
+    websocket_deinit_framinator(&framinator);
+
+    if (r.err || ping_ring_before > WS_RING_MAX_IN_TCP) {
+        printf("FAIL ping err %d behind %zu ring bytes\n", r.err, ping_ring_before);
+        return 1;
+    }
+    return 0;
+}
+
+static err_t stream_write_err;
+
+static size_t stream_task(sub_task* task, void* args) {
+    run* r = args;
+    if ((r->err = websocket_message_begin(&framinator, WS_HEADER_OPCODE_DATA))) {
+        return 0;
+    }
+    for (size_t written = 0; written < r->total; written += r->write_len) {
+        if ((r->err = websocket_message_append(&framinator, r->data, r->write_len))) {
+            return 0;
+        }
+        if (written == 0) {
+            // Not part of the message
+            stream_write_err = websocket_write(&framinator, "x", 1);
+        }
+    }
+    if ((r->err = websocket_message_end(&framinator))) {
+        return 0;
+    }
+    r->err = websocket_flush(&framinator);
+    return 0;
+}
+
+/**
+ * @brief A streamed message goes out as DATA, continuations and FIN on the last one, all payload in order.
+ * websocket_write() in the middle of it is turned down.
+ */
+static int check_stream() {
+    static struct tcp_pcb pcb;
+    static ws_cliant_con con;
+    static uint8_t sink[64 * 1024];
+    pcb = (struct tcp_pcb) { .snd_buf = TCP_SND_BUF, .sink = sink };
+    con = (ws_cliant_con) { .printed_circuit_board = &pcb };
+    the_con = &con;
+
+    sub_task* task = (sub_task*) stack;
+    sub_task_init(task, STACK_SIZE);
+    con.task = task;
+    if (websocket_initialize_framinator(&framinator, &con)) {
+        printf("FAIL stream setup\n");
+        return 1;
+    }
+    run r = { .write_len = 100, .total = 100 * 300, .data = data };
+    sub_task_run(task, stream_task, &r);
+    while (!sub_task_done(task)) {
+        tcp_ack_all(&con);
+        sub_task_continue(task, NULL);
+    }
+    tcp_ack_all(&con);
+    websocket_deinit_framinator(&framinator);
+
+    if (r.err || stream_write_err != ERR_INPROGRESS) {
+        printf("FAIL stream err %d, websocket_write() in it %d\n", r.err, stream_write_err);
+        return 1;
+    }
+    size_t pos = 0, payload_total = 0, frames = 0;
+    bool fin = false;
+    while (pos < pcb.sink_len && !fin) {
+        uint8_t opcode = sink[pos] & 0x0F;
+        fin = sink[pos] & 0x80;
+        uint64_t len = sink[pos + 1] & 0x7F;
+        pos += 2;
+        if (len == 126) {
+            len = (sink[pos] << 8) | sink[pos + 1];
+            pos += 2;
+        } else if (len == 127) {
+            printf("FAIL stream frame with a 64 bit length\n");
+            return 1;
+        }
+        if (opcode != (frames ? WS_HEADER_OPCODE_CONTINUATION : WS_HEADER_OPCODE_DATA)) {
+            printf("FAIL stream frame %zu opcode %d\n", frames, opcode);
+            return 1;
+        }
+        for (size_t i = 0; i < len; i++) {
+            if (sink[pos + i] != (uint8_t) data[(payload_total + i) % r.write_len]) {
+                printf("FAIL stream payload byte %zu\n", payload_total + i);
+                return 1;
+            }
+        }
+        pos += len;
+        payload_total += len;
+        frames++;
+    }
+    if (!fin || pos != pcb.sink_len || payload_total != r.total) {
+        printf("FAIL stream got %zu bytes in %zu frames, fin %d\n", payload_total, frames, fin);
+        return 1;
+    }
+    return 0;
+}
+
+static bool idle_released;
+
+static size_t push_task(sub_task* task, void* args) {
+    run* r = args;
+    // Like the dashboard: a small push, the ACK, the ring goes. Again.
+    for (int i = 0; i < 3; i++) {
+        if ((r->err = websocket_write(&framinator, r->data, r->write_len)) || (r->err = websocket_flush(&framinator))) {
+            return 0;
+        }
+        while (framinator.ring_in_flight) {
+            sub_task_yield(WS_T_YIELD_REASON_WAIT_FOR_ACK, task);
+        }
+        if ((r->err = websocket_poll(&framinator))) {
+            return 0;
+        }
+        idle_released = !framinator.buf;
+        if (!idle_released) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Pushes now and then. The ring is freed as soon as nothing is queued or in flight, however soon
+ * the next write comes, and the next write gets a new one.
+ */
+static int check_idle() {
+    static struct tcp_pcb pcb;
+    static ws_cliant_con con;
+    static uint8_t sink[1024];
+    pcb = (struct tcp_pcb) { .snd_buf = TCP_SND_BUF, .sink = sink };
+    con = (ws_cliant_con) { .printed_circuit_board = &pcb };
+    the_con = &con;
+
+    sub_task* task = (sub_task*) stack;
+    sub_task_init(task, STACK_SIZE);
+    con.task = task;
+    if (websocket_initialize_framinator(&framinator, &con)) {
+        printf("FAIL idle setup\n");
+        return 1;
+    }
+    run r = { .write_len = 100, .data = data };
+    sub_task_run(task, push_task, &r);
+    while (!sub_task_done(task)) {
+        tcp_ack_all(&con);
+        sub_task_continue(task, NULL);
+    }
+    websocket_deinit_framinator(&framinator);
+
+    if (r.err || !idle_released || pcb.sink_len != 3 * (2 + r.write_len)) {
+        printf("FAIL idle err %d, released %d, %zu bytes sent\n", r.err, idle_released, pcb.sink_len);
+        return 1;
+    }
+    return 0;
+}
+
+static err_t stream_begin_again_err;
+
+static size_t failing_stream_task(sub_task* task, void* args) {
+    run* r = args;
+    if ((r->err = websocket_message_begin(&framinator, WS_HEADER_OPCODE_DATA))) {
+        return 0;
+    }
+    for (size_t written = 0; written < r->total && !r->err; written += r->write_len) {
+        r->err = websocket_message_append(&framinator, r->data, r->write_len);
+    }
+    stream_begin_again_err = websocket_message_begin(&framinator, WS_HEADER_OPCODE_DATA);
+    return 0;
+}
+
+/**
+ * @brief The connection fails halfway through a streamed message (an ACK wait comes back with an error).
+ * The message is given up on, with a 1011 close as some of it went out, and the next one can begin.
+ */
+static int check_stream_error() {
+    static struct tcp_pcb pcb;
+    static ws_cliant_con con;
+    static uint8_t sink[64 * 1024];
+    pcb = (struct tcp_pcb) { .snd_buf = TCP_SND_BUF, .sink = sink };
+    con = (ws_cliant_con) { .printed_circuit_board = &pcb };
+    the_con = &con;
+
+    sub_task* task = (sub_task*) stack;
+    sub_task_init(task, STACK_SIZE);
+    con.task = task;
+    if (websocket_initialize_framinator(&framinator, &con)) {
+        printf("FAIL stream error setup\n");
+        return 1;
+    }
+    run r = { .write_len = 100, .total = 100 * 300, .data = data };
+    sub_task_run(task, failing_stream_task, &r);
+    for (int waits = 0; !sub_task_done(task); waits++) {
+        tcp_ack_all(&con);
+        sub_task_continue(task, waits == 2 ? (void*) (intptr_t) ERR_ABRT : NULL);
+    }
+    tcp_ack_all(&con);
+    websocket_deinit_framinator(&framinator);
+
+    static const uint8_t close_1011[] = { 0x88, 0x02, 0x03, 0xF3 };
+    if (r.err != ERR_ABRT || stream_begin_again_err != ERR_OK || pcb.sink_len < sizeof(close_1011)
+            || memcmp(sink + pcb.sink_len - sizeof(close_1011), close_1011, sizeof(close_1011))) {
+        printf("FAIL stream error %d, begin after it %d, no 1011 close\n", r.err, stream_begin_again_err);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief A masked client frame, payload under 126 bytes.
+ */
+static size_t client_frame(uint8_t* out, uint8_t first, const uint8_t* payload, size_t len) {
+    static const uint8_t mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+    uint32_t mask32;
+    memcpy(&mask32, mask, 4);
+    out[0] = first;
+    out[1] = 0x80 | len;
+    memcpy(out + 2, mask, 4);
+    ws_mask_copy(out + 6, payload, len, mask32);
+    return 6 + len;
+}
+
+typedef struct read_run_ {
+    char* buf;
+    size_t len;
+    err_t err[2];
+} read_run;
+
+static size_t reader_task(sub_task* task, void* args) {
+    read_run* r = args;
+    // Two messages, the second is expected to fail
+    r->err[0] = websocket_read(&framinator, r->buf, r->len);
+    r->err[1] = websocket_read(&framinator, r->buf, 1);
+    return 0;
+}
+
+/**
+ * @brief A compressed message that inflates, then one that is not DEFLATE at all. The second has to get the
+ * connection closed with 1002, not be taken for running out of memory.
+ */
+static int check_inflate() {
+    static struct tcp_pcb pcb;
+    static ws_cliant_con con;
+    static uint8_t sink[256];
+    static uint8_t wire[256];
+    uint8_t compressed[WS_DEFLATE_BOUND(sizeof(data))];
+    char text[100];
+    size_t wire_len = 0;
+
+    ws_deflate def;
+    ws_deflate_init(&def, 15);
+    int compressed_len = ws_deflate_compress(&def, compressed, sizeof(compressed), (const uint8_t*) data, sizeof(text));
+    assert(compressed_len > 0 && compressed_len < 126);
+    // FIN | RSV1 | text
+    wire_len += client_frame(wire + wire_len, 0xC1, compressed, compressed_len);
+    // BTYPE 11 is reserved
+    static const uint8_t corrupt[] = { 0xFF, 0xFF, 0xFF };
+    wire_len += client_frame(wire + wire_len, 0xC1, corrupt, sizeof(corrupt));
+
+    pcb = (struct tcp_pcb) { .snd_buf = TCP_SND_BUF, .instant_ack = true, .sink = sink };
+    con = (ws_cliant_con) { .printed_circuit_board = &pcb, .in = wire, .in_len = wire_len };
+    the_con = &con;
+
+    sub_task* task = (sub_task*) stack;
+    sub_task_init(task, STACK_SIZE);
+    con.task = task;
+
+    ws_deflate_params params = { .enabled = true, .server_window_bits = 15, .client_window_bits = 15 };
+    if (websocket_initialize_framinator(&framinator, &con) || websocket_enable_deflate(&framinator, &params)) {
+        printf("FAIL inflate setup\n");
+        return 1;
+    }
+    read_run r = { .buf = text, .len = sizeof(text) };
+    sub_task_run(task, reader_task, &r);
+    while (!sub_task_done(task)) {
+        tcp_ack_all(&con);
+        sub_task_continue(task, NULL);
+    }
+    tcp_ack_all(&con);
+    websocket_deinit_framinator(&framinator);
+
+    if (r.err[0] || memcmp(text, data, sizeof(text))) {
+        printf("FAIL inflate: good message err %d\n", r.err[0]);
+        return 1;
+    }
+    static const uint8_t close_1002[] = { 0x88, 0x02, 0x03, 0xEA };
+    if (r.err[1] != ERR_VAL || pcb.sink_len < sizeof(close_1002)
+            || memcmp(sink + pcb.sink_len - sizeof(close_1002), close_1002, sizeof(close_1002))) {
+        printf("FAIL inflate: corrupt message err %d, no 1002 close\n", r.err[1]);
+        return 1;
+    }
+    return 0;
+}
+
+typedef struct peek_run_ {
+    int len[2];
+    char first;
+} peek_run;
+
+static size_t peeker_task(sub_task* task, void* args) {
+    peek_run* r = args;
+    char* slice = NULL;
+    // A ping with nothing behind it, then a ping and a one byte command
+    r->len[0] = websocket_peek(&framinator, &slice);
+    // What ws_websocket_loop() does with nothing buffered: wait for more
+    sub_task_yield(WS_T_YIELD_REASON_READ, task);
+    r->len[1] = websocket_peek(&framinator, &slice);
+    if (r->len[1] > 0) {
+        r->first = slice[0];
+        websocket_consume(&framinator, r->len[1]);
+    }
+    websocket_flush(&framinator);
+    return 0;
+}
+
+/**
+ * @brief websocket_peek() answers a ping that came in alone and comes back with nothing, instead of
+ * waiting for a data frame. The loop calling it has sensor values to push in the mean time.
+ */
+static int check_ping_alone() {
+    static struct tcp_pcb pcb;
+    static ws_cliant_con con;
+    static uint8_t sink[256];
+    static uint8_t wire[64];
+    size_t wire_len = 0;
+
+    wire_len += client_frame(wire + wire_len, 0x89, (const uint8_t*) "hi", 2);
+    size_t second = wire_len;
+    wire_len += client_frame(wire + wire_len, 0x89, (const uint8_t*) "yo", 2);
+    wire_len += client_frame(wire + wire_len, 0x82, (const uint8_t*) "1", 1);
+
+    pcb = (struct tcp_pcb) { .snd_buf = TCP_SND_BUF, .instant_ack = true, .sink = sink };
+    // Only the first ping is in, the rest comes after the first peek
+    con = (ws_cliant_con) { .printed_circuit_board = &pcb, .in = wire, .in_len = second,
+                            .p_current = (struct pbuf*) wire };
+    the_con = &con;
+
+    sub_task* task = (sub_task*) stack;
+    sub_task_init(task, STACK_SIZE);
+    con.task = task;
+    if (websocket_initialize_framinator(&framinator, &con)) {
+        printf("FAIL ping alone setup\n");
+        return 1;
+    }
+    peek_run r = { { -1, -1 }, 0 };
+    sub_task_run(task, peeker_task, &r);
+    // Yielded for READ, here comes the rest
+    con.in_len = wire_len - second;
+    con.p_current = (struct pbuf*) con.in;
+    while (!sub_task_done(task)) {
+        tcp_ack_all(&con);
+        sub_task_continue(task, NULL);
+    }
+    tcp_ack_all(&con);
+    websocket_deinit_framinator(&framinator);
+
+    static const uint8_t pongs[] = { 0x8A, 0x02, 'h', 'i', 0x8A, 0x02, 'y', 'o' };
+    if (r.len[0] != 0 || r.len[1] != 1 || r.first != '1'
+            || pcb.sink_len != sizeof(pongs) || memcmp(sink, pongs, sizeof(pongs))) {
+        printf("FAIL ping alone: peeked %d then %d, %zu bytes sent\n", r.len[0], r.len[1], pcb.sink_len);
+        return 1;
+    }
+    return 0;
+}
+
+static int check() {
+    size_t total = 100000;
+    uint8_t* sink = malloc(total * 3); // 1 byte writes on the instant link: 2 bytes of header each
+    for (int link = 0; link < 2; link++) {
+        for (int w = 0; w < WRITE_LENS_LEN; w++) {
+            run r = { .instant_ack = link, .write_len = write_lens[w], .total = total, .data = data };
+            run_writer(&r, sink);
+            if (r.err) {
+                printf("FAIL write_len %zu err %d\n", r.write_len, r.err);
+                return 1;
+            }
+            if (check_frames(sink, the_con->printed_circuit_board->sink_len, &r)) {
+                printf("  write_len %zu link %s\n", r.write_len, link ? "instant" : "stalled");
+                return 1;
+            }
+        }
+    }
+    free(sink);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    double min_time = argc > 1 ? atof(argv[1]) : 0.1;
+
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = 'a' + (i * 7) % 26;
+    }
+
+    if (check() || check_inflate() || check_ping_alone() || check_ping() || check_stream() || check_stream_error() || check_idle()) {
+        return 1;
+    }
+
+    // Each run pushes the same bytes so the counts stay comparable, the runs repeat until min_time is up.
+    printf("link,write_len,payload_bytes,frames,wire_bytes,ack_waits,ns_per_write,mb_per_s\n");
+    for (int link = 0; link < 2; link++) {
+        for (int w = 0; w < WRITE_LENS_LEN; w++) {
+            // Tiny writes take a while, less of them
+            size_t bytes = write_lens[w] < 64 ? RUN_BYTES / 8 : RUN_BYTES;
+            run r;
+            int runs = 0;
+            double elapsed = 0;
+            do {
+                r = (run) { .instant_ack = link, .write_len = write_lens[w], .total = bytes, .data = data };
+                run_writer(&r, NULL);
+                elapsed += r.elapsed;
+                runs++;
+            } while (elapsed < min_time);
+            size_t writes = (bytes + r.write_len - 1) / r.write_len;
+            printf("%s,%zu,%zu,%zu,%zu,%zu,%.1f,%.1f\n", link ? "instant" : "stalled", r.write_len, bytes,
+                r.frames, the_con->printed_circuit_board->wire_bytes, r.ack_waits,
+                elapsed / ((double) writes * runs) * 1e9, (double) bytes * runs / elapsed / 1e6);
+        }
+    }
+    return 0;
+}
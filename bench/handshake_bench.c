@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ws_handshake.h"
+#include "mbedtls/version.h"
+
+#if MBEDTLS_VERSION_MAJOR >= 3
+#define mbedtls_sha1_ret mbedtls_sha1
+#endif
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// RFC 6455 section 1.3
+#define SAMPLE_KEY    "dGhlIHNhbXBsZSBub25jZQ=="
+#define SAMPLE_ACCEPT "s3pPLMBiTxaQ9kYGzzhZRbK+xOo="
+
+static const char uuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+// What do_ws_header() used to do: copy the key next to the uuid and hash it in one go.
+static void copy_accept(const char* key, char* accept) {
+    char buf[WS_HANDSHAKE_KEY_LEN + sizeof(uuid)];
+    unsigned char hash[20];
+    memcpy(buf, key, WS_HANDSHAKE_KEY_LEN);
+    memcpy(buf + WS_HANDSHAKE_KEY_LEN, uuid, sizeof(uuid));
+    mbedtls_sha1_ret((unsigned char*) buf, WS_HANDSHAKE_KEY_LEN + sizeof(uuid) - 1, hash);
+    encode_base64(accept, (char*) hash, sizeof(hash));
+}
+
+// The key comes in split pieces, like it would across pbufs.
+static int streamed_accept(const char* key, int key_len, int split, ws_handshake* hs) {
+    int ret = 0;
+    ws_handshake_init(hs);
+    for (int i = 0; i < key_len && !ret; i += split) {
+        int n = key_len - i < split ? key_len - i : split;
+        ret = ws_handshake_key_update(hs, key + i, n);
+    }
+    if (!ret) {
+        ret = ws_handshake_key_finish(hs);
+    }
+    ws_handshake_free(hs);
+    return ret;
+}
+
+static int check() {
+    ws_handshake hs;
+    char accept[WS_HANDSHAKE_ACCEPT_LEN];
+
+    copy_accept(SAMPLE_KEY, accept);
+    if (memcmp(accept, SAMPLE_ACCEPT, WS_HANDSHAKE_ACCEPT_LEN)) {
+        printf("FAIL copy accept %.28s\n", accept);
+        return 1;
+    }
+    for (int split = 1; split <= WS_HANDSHAKE_KEY_LEN; split++) {
+        if (streamed_accept(SAMPLE_KEY, WS_HANDSHAKE_KEY_LEN, split, &hs)
+                || memcmp(hs.accept, SAMPLE_ACCEPT, WS_HANDSHAKE_ACCEPT_LEN)) {
+            printf("FAIL streamed accept split=%d\n", split);
+            return 1;
+        }
+    }
+
+    static const char* bad_keys[] = {
+        "",
+        "dGhlIHNhbXBsZSBub25jZQ=",    // short
+        "dGhlIHNhbXBsZSBub25jZQ===",  // long
+        "dGhlIHNhbXBsZSBub25jZQAA",   // 18 bytes, not 16
+        "dGhlIHNhbXBsZSBub2!jZQ==",   // not base64
+    };
+    for (int k = 0; k < (int) (sizeof(bad_keys) / sizeof(bad_keys[0])); k++) {
+        if (streamed_accept(bad_keys[k], strlen(bad_keys[k]), 5, &hs) != WS_HANDSHAKE_ERR_KEY) {
+            printf("FAIL bad key \"%s\" accepted\n", bad_keys[k]);
+            return 1;
+        }
+    }
+
+    static const struct { const char* list; const char* token; bool found; } tokens[] = {
+        { "Upgrade", "upgrade", true },
+        { "keep-alive, Upgrade", "upgrade", true },
+        { "upgrade,keep-alive", "upgrade", true },
+        { "keep-alive", "upgrade", false },
+        { "Close", "close", true },
+        { "keep-alive, CLOSE", "close", true },
+        { "closed", "close", false },
+        { "upgraded", "upgrade", false },
+        { "chat, superchat", "chat", true },
+        { "superchat", "chat", false },
+        { "", "chat", false },
+    };
+    for (int t = 0; t < (int) (sizeof(tokens) / sizeof(tokens[0])); t++) {
+        if (ws_handshake_has_token(tokens[t].list, tokens[t].token) != tokens[t].found) {
+            printf("FAIL has_token(\"%s\", \"%s\")\n", tokens[t].list, tokens[t].token);
+            return 1;
+        }
+    }
+
+    static const struct { const char* list; bool gzip; } encodings[] = {
+        { "gzip, deflate, br", true },
+        { "GZip", true },
+        { "deflate;q=1, gzip ;q=0.5", true },
+        { "gzip;q=0", false },
+        { "gzip; q=0.000, *", false },
+        { "*", true },
+        { "*;q=0", false },
+        { "br, *;q=0", false },
+        { "x-gzip", false },
+        { "", false },
+    };
+    for (int t = 0; t < (int) (sizeof(encodings) / sizeof(encodings[0])); t++) {
+        if (ws_handshake_accepts(encodings[t].list, "gzip") != encodings[t].gzip) {
+            printf("FAIL accepts(\"%s\", \"gzip\")\n", encodings[t].list);
+            return 1;
+        }
+    }
+
+    static const struct { const char* list; bool match; } etags[] = {
+        { "\"abc\"", true },
+        { "\"x\", W/\"abc\"", true },
+        { "*", true },
+        { "\"a,b\", \"abc\"", true },
+        { "\"abc-gz\"", false },
+        { "\"ab", false },
+        { "", false },
+    };
+    for (int t = 0; t < (int) (sizeof(etags) / sizeof(etags[0])); t++) {
+        if (ws_handshake_etag_match(etags[t].list, "\"abc\"") != etags[t].match) {
+            printf("FAIL etag_match(%s)\n", etags[t].list);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    double min_time = argc > 1 ? atof(argv[1]) : 0.1;
+
+    if (check()) {
+        return 1;
+    }
+
+    printf("variant,split,handshakes_per_s\n");
+    // 24: the whole key in one pbuf. 5: chopped up.
+    static const int splits[] = { 24, 5 };
+    for (int v = 0; v < 2; v++) {
+        for (int s = 0; s < (v ? 2 : 1); s++) {
+            long iters = 0;
+            volatile int sink = 0;
+            double start = now_s();
+            double elapsed;
+            do {
+                for (int b = 0; b < 1000; b++) {
+                    ws_handshake hs;
+                    char accept[WS_HANDSHAKE_ACCEPT_LEN];
+                    // The other header checks are part of every handshake too
+                    sink += ws_handshake_has_token("keep-alive, Upgrade", "upgrade");
+                    sink += ws_handshake_has_token("chat, superchat", "chat");
+                    if (v) {
+                        sink += streamed_accept(SAMPLE_KEY, WS_HANDSHAKE_KEY_LEN, splits[s], &hs);
+                        sink += hs.accept[0];
+                    } else {
+                        copy_accept(SAMPLE_KEY, accept);
+                        sink += accept[0];
+                    }
+                }
+                iters += 1000;
+                elapsed = now_s() - start;
+            } while (elapsed < min_time);
+
+            printf("%s,%d,%.0f\n", v ? "streamed" : "copy", v ? splits[s] : WS_HANDSHAKE_KEY_LEN, iters / elapsed);
+        }
+    }
+    return 0;
+}
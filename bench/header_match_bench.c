@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bufferless_str.h"
+#include "http_headers.h"
+
+#define MIN_(a, b) ((a) < (b) ? (a) : (b))
+
+// The table bl_str_select() gets, in the same order as http_headers.txt so the ids line up.
+static const char* fields[] = {
+    "Upgrade",
+    "Sec-WebSocket-Key",
+    "Accept-Encoding",
+    "If-None-Match",
+    "Connection",
+    "Sec-WebSocket-Version",
+    "Sec-WebSocket-Protocol",
+    "Sec-WebSocket-Extensions",
+    "Host",
+    "Origin",
+    "Content-Length",
+};
+#define FIELDS_LEN ((int) (sizeof(fields) / sizeof(fields[0])))
+
+// What a browser sends with a websocket upgrade (Chrome-ish), known and unknown.
+static const char* request[] = {
+    "Host",
+    "Connection",
+    "Pragma",
+    "Cache-Control",
+    "User-Agent",
+    "Upgrade",
+    "Origin",
+    "Sec-WebSocket-Version",
+    "Accept-Encoding",
+    "Accept-Language",
+    "Sec-WebSocket-Key",
+    "Sec-WebSocket-Extensions",
+    "Sec-WebSocket-Protocol",
+    "If-None-Match",
+};
+#define REQUEST_LEN ((int) (sizeof(request) / sizeof(request[0])))
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int str_select(const char* name, int split) {
+    bl_str_selecter sel;
+    bl_str_reset(&sel, fields, FIELDS_LEN);
+    int len = strlen(name);
+    int ret = bl_str_select(&sel, (char*) name, MIN_(split, len));
+    if (split < len && ret != BL_STR_NO_MATCH) {
+        ret = bl_str_select(&sel, (char*) name + split, len - split);
+    }
+    return ret;
+}
+
+static int trie_select(const char* name, int split) {
+    bl_trie_selecter sel;
+    bl_trie_reset(&sel, &http_headers);
+    int len = strlen(name);
+    int ret = bl_trie_select(&sel, name, MIN_(split, len));
+    if (split < len && ret != BL_STR_NO_MATCH) {
+        ret = bl_trie_select(&sel, name + split, len - split);
+    }
+    return ret;
+}
+
+static void lower(char* dst, const char* src) {
+    for (; *src; src++, dst++) {
+        *dst = (*src >= 'A' && *src <= 'Z') ? *src + ('a' - 'A') : *src;
+    }
+    *dst = '\0';
+}
+
+int main(int argc, char** argv) {
+    double min_time = argc > 1 ? atof(argv[1]) : 0.1;
+
+    // Both have to agree (on the canonical spelling), the trie also when it's lower case.
+    for (int r = 0; r < REQUEST_LEN; r++) {
+        char low[64];
+        lower(low, request[r]);
+        for (int split = 1; split <= 32; split++) {
+            int a = str_select(request[r], split);
+            int b = trie_select(request[r], split);
+            int c = trie_select(low, split);
+            // bl_str_select() may still say NO_MATCH_YET for a prefix of a known string.
+            if (a == BL_STR_NO_MATCH_YET) {
+                a = BL_STR_NO_MATCH;
+            }
+            if (b == BL_STR_NO_MATCH_YET) {
+                b = BL_STR_NO_MATCH;
+            }
+            if (c == BL_STR_NO_MATCH_YET) {
+                c = BL_STR_NO_MATCH;
+            }
+            if (a != b || b != c) {
+                printf("FAIL %s split=%d: %d %d %d\n", request[r], split, a, b, c);
+                return 1;
+            }
+        }
+    }
+
+    printf("variant,split,ns_per_request\n");
+    for (int v = 0; v < 2; v++) {
+        // 64: whole names. 3: names chopped across "pbufs".
+        static const int splits[] = { 64, 3 };
+        for (int s = 0; s < 2; s++) {
+            long iters = 0;
+            volatile int sink = 0;
+            double start = now_s();
+            double elapsed;
+            do {
+                for (int b = 0; b < 1000; b++) {
+                    for (int r = 0; r < REQUEST_LEN; r++) {
+                        sink += v ? trie_select(request[r], splits[s]) : str_select(request[r], splits[s]);
+                    }
+                }
+                iters += 1000;
+                elapsed = now_s() - start;
+            } while (elapsed < min_time);
+
+            printf("%s,%d,%.1f\n", v ? "bl_trie_select" : "bl_str_select", splits[s], elapsed * 1e9 / iters);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef BENCH_HARDWARE_SYNC_H
+#define BENCH_HARDWARE_SYNC_H
+
+// Nobody is waiting for an event on the host.
+static inline void __sev(void) {
+}
+
+static inline void __wfe(void) {
+}
+
+#endif
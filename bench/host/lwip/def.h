@@ -0,0 +1,12 @@
+#ifndef BENCH_LWIP_DEF_H
+#define BENCH_LWIP_DEF_H
+
+#include "lwip/arch.h"
+
+// Little endian hosts only, same as the pico.
+#define lwip_htons(x) ((u16_t) __builtin_bswap16(x))
+#define lwip_ntohs(x) lwip_htons(x)
+#define lwip_htonl(x) ((u32_t) __builtin_bswap32(x))
+#define lwip_ntohl(x) lwip_htonl(x)
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef BENCH_PICO_CRITICAL_SECTION_H
+#define BENCH_PICO_CRITICAL_SECTION_H
+
+// No interrupts on the host, see pico/mutex.h.
+
+#include <stdbool.h>
+
+typedef struct critical_section {
+    volatile bool entered;
+} critical_section_t;
+
+static inline void critical_section_init(critical_section_t* crit_sec) {
+    crit_sec->entered = false;
+}
+
+static inline void critical_section_enter_blocking(critical_section_t* crit_sec) {
+    crit_sec->entered = true;
+}
+
+static inline void critical_section_exit(critical_section_t* crit_sec) {
+    crit_sec->entered = false;
+}
+
+#endif
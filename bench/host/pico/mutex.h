@@ -0,0 +1,34 @@
+#ifndef BENCH_PICO_MUTEX_H
+#define BENCH_PICO_MUTEX_H
+
+// The benchmarks are single threaded, a flag stands in for the pico's spin lock + owner.
+// On the pico these cost more (interrupts are disabled around the spin lock).
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct mutex {
+    volatile bool owned;
+} mutex_t;
+
+static inline void mutex_init(mutex_t* mtx) {
+    mtx->owned = false;
+}
+
+static inline bool mutex_try_enter(mutex_t* mtx, uint32_t* owner_out) {
+    if (mtx->owned) {
+        return false;
+    }
+    mtx->owned = true;
+    return true;
+}
+
+static inline void mutex_enter_blocking(mutex_t* mtx) {
+    mtx->owned = true;
+}
+
+static inline void mutex_exit(mutex_t* mtx) {
+    mtx->owned = false;
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef BENCH_PICO_TIME_H
+#define BENCH_PICO_TIME_H
+
+// Just enough of the pico's time API for the host benchmarks. Microseconds of CLOCK_MONOTONIC
+// instead of the timer peripheral.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+typedef uint64_t absolute_time_t;
+
+static const absolute_time_t nil_time = 0;
+static const absolute_time_t at_the_end_of_time = INT64_MAX;
+
+static inline uint64_t to_us_since_boot(absolute_time_t t) {
+    return t;
+}
+
+static inline uint32_t to_ms_since_boot(absolute_time_t t) {
+    return (uint32_t) (t / 1000);
+}
+
+static inline absolute_time_t get_absolute_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static inline absolute_time_t delayed_by_us(absolute_time_t t, uint64_t us) {
+    uint64_t delayed = t + us;
+    return delayed > at_the_end_of_time || delayed < t ? at_the_end_of_time : delayed;
+}
+
+static inline absolute_time_t delayed_by_ms(absolute_time_t t, uint32_t ms) {
+    return delayed_by_us(t, (uint64_t) ms * 1000);
+}
+
+static inline absolute_time_t make_timeout_time_us(uint64_t us) {
+    return delayed_by_us(get_absolute_time(), us);
+}
+
+static inline absolute_time_t make_timeout_time_ms(uint32_t ms) {
+    return delayed_by_ms(get_absolute_time(), ms);
+}
+
+static inline int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) {
+    return (int64_t) (to - from);
+}
+
+static inline absolute_time_t absolute_time_min(absolute_time_t a, absolute_time_t b) {
+    return a < b ? a : b;
+}
+
+static inline bool time_reached(absolute_time_t t) {
+    return get_absolute_time() >= t;
+}
+
+static inline bool is_nil_time(absolute_time_t t) {
+    return t == nil_time;
+}
+
+#endif
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "iol_lock.h"
+
+// iol_notify() -> iol_run_ready() -> the task is back from its yield. What a tcp callback costs us
+// before the connection's task gets to do anything. iol_lock.c is built against the host shims in
+// host/, the mutex and critical section are plain flags there (the pico disables interrupts too).
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define REASON_EVENT IOL_REASON(0)
+#define REASON_OTHER IOL_REASON(5)
+
+#define MAX_TASKS 64
+#define STACK_SIZE (16 * 1024)
+static uint64_t stacks[MAX_TASKS][STACK_SIZE / 8] __attribute__((aligned(16)));
+static iol_lock_obj locks[MAX_TASKS];
+static size_t resumes[MAX_TASKS];
+
+// Only ever an event, like WAIT_FOR_ACK. Nothing to check.
+static size_t check_reason(void* user_obj, size_t reasons, size_t err) {
+    return 0;
+}
+
+static size_t waiting_task(sub_task* task, void* args) {
+    size_t* resumed = args;
+    for (;;) {
+        sub_task_yield(REASON_EVENT, task);
+        (*resumed)++;
+    }
+    return 0;
+}
+
+// Waits for REASON_EVENT, then REASON_OTHER. The first time around, REASON_OTHER comes in while it runs,
+// like an ACK that shows up between tcp_output() and the yield for it.
+static size_t alternating_task(sub_task* task, void* args) {
+    size_t* resumed = args;
+    for (int i = 0;; i++) {
+        sub_task_yield(REASON_EVENT, task);
+        (*resumed)++;
+        if (i == 0) {
+            iol_notify(&locks[0], REASON_OTHER, 0);
+        }
+        sub_task_yield(REASON_OTHER, task);
+        (*resumed)++;
+    }
+    return 0;
+}
+
+static void start_tasks(int n) {
+    iol_init();
+    for (int i = 0; i < n; i++) {
+        sub_task* task = (sub_task*) stacks[i];
+        sub_task_init(task, STACK_SIZE);
+        locks[i] = (iol_lock_obj) {0};
+        resumes[i] = 0;
+        iol_task_run(&locks[i], check_reason, NULL, task, waiting_task, &resumes[i]);
+    }
+    iol_run_ready(); // Up to the first yield
+}
+
+static int check() {
+    start_tasks(3);
+
+    // Only the notified task runs, once, however many times it was notified.
+    iol_notify(&locks[1], REASON_EVENT, 0);
+    iol_notify(&locks[1], REASON_EVENT, 0);
+    if (iol_run_ready() != 1 || resumes[0] || resumes[1] != 1 || resumes[2]) {
+        printf("FAIL notify ran %zu %zu %zu\n", resumes[0], resumes[1], resumes[2]);
+        return 1;
+    }
+    // Nothing left
+    if (iol_has_ready() || iol_run_ready()) {
+        printf("FAIL spurious run\n");
+        return 1;
+    }
+    // Not waiting for it, not queued
+    if (!iol_notify(&locks[0], IOL_REASON(5), 0) || iol_has_ready()) {
+        printf("FAIL queued for a reason the task is not waiting for\n");
+        return 1;
+    }
+
+    iol_init();
+    sub_task_init((sub_task*) stacks[0], STACK_SIZE);
+    locks[0] = (iol_lock_obj) {0};
+    resumes[0] = 0;
+    iol_task_run(&locks[0], check_reason, NULL, (sub_task*) stacks[0], alternating_task, &resumes[0]);
+    iol_run_ready();
+    // Sent while the task was running, kept for the wait right after
+    iol_notify(&locks[0], REASON_EVENT, 0);
+    iol_run_ready();
+    iol_run_ready();
+    if (resumes[0] != 2) {
+        printf("FAIL notified while running, resumed %zu\n", resumes[0]);
+        return 1;
+    }
+    // Sent while it waits for REASON_EVENT. Not remembered for the next REASON_OTHER wait.
+    iol_notify(&locks[0], REASON_OTHER, 0);
+    iol_notify(&locks[0], REASON_EVENT, 0);
+    iol_run_ready();
+    if (resumes[0] != 3 || iol_has_ready() || iol_run_ready() || resumes[0] != 3) {
+        printf("FAIL stale notification resumed the task, resumed %zu\n", resumes[0]);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Every one of n tasks gets notified, then one iol_run_ready() resumes them all.
+ */
+static void bench_notify_resume(int n, double min_time) {
+    start_tasks(n);
+    long iterations = 0;
+    double start = now_s();
+    double elapsed;
+    do {
+        for (int b = 0; b < 100; b++) {
+            for (int i = 0; i < n; i++) {
+                iol_notify(&locks[i], REASON_EVENT, 0);
+            }
+            iol_run_ready();
+        }
+        iterations += 100;
+        elapsed = now_s() - start;
+    } while (elapsed < min_time);
+
+    size_t total = 0;
+    for (int i = 0; i < n; i++) {
+        total += resumes[i];
+    }
+    if (total != (size_t) n * iterations) {
+        printf("FAIL notify_resume tasks=%d resumed %zu\n", n, total);
+        exit(1);
+    }
+    printf("notify_resume,%d,%ld,%.2f\n", n, iterations * n, elapsed / (iterations * n) * 1e9);
+}
+
+/**
+ * @brief Notifying a task that is already on the run queue. What every extra tcp callback costs
+ * before the task gets to run.
+ */
+static void bench_notify_queued(double min_time) {
+    start_tasks(1);
+    iol_notify(&locks[0], REASON_EVENT, 0);
+    long iterations = 0;
+    double start = now_s();
+    double elapsed;
+    do {
+        for (int b = 0; b < 1000; b++) {
+            iol_notify(&locks[0], REASON_EVENT, 0);
+        }
+        iterations += 1000;
+        elapsed = now_s() - start;
+    } while (elapsed < min_time);
+    iol_run_ready();
+    printf("notify_queued,1,%ld,%.2f\n", iterations, elapsed / iterations * 1e9);
+}
+
+int main(int argc, char** argv) {
+    double min_time = argc > 1 ? atof(argv[1]) : 0.1;
+
+    if (check()) {
+        return 1;
+    }
+
+    printf("case,tasks,iterations,ns_per_op\n");
+    static const int tasks[] = { 1, 8, MAX_TASKS };
+    for (int t = 0; t < sizeof(tasks) / sizeof(tasks[0]); t++) {
+        bench_notify_resume(tasks[t], min_time);
+    }
+    bench_notify_queued(min_time);
+    return 0;
+}
@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+"""Runs the host benchmarks and collects their CSV into one JSON file, or compares two of those.
+
+    run_benches.py <build dir> <out.json> [bench ...]
+    run_benches.py --compare <old.json> <new.json> [min % change]
+
+Every *_bench in the build dir is run (or just the ones named). Each one checks itself first
+and prints a CSV table, the first line being the header. The only argument a bench takes is
+the minimum time in seconds to spend on each case. The ones CMake could not build (listed in
+skipped_benches.txt) get a "skipped" entry with the reason.
+
+Columns are either keys (what was measured: variant, size, ...) or results. Timings
+(*per_s, ns_per_*, us_per_*) are compared in %, counts (frames, wire_bytes, ...) as they are,
+they only change when the code decides differently.
+"""
+import datetime
+import json
+import os
+import platform
+import subprocess
+import sys
+
+# Results that are not timings. Everything else that is not a timing is a key.
+COUNT_COLUMNS = {'iterations', 'compressed_len', 'payload_bytes', 'frames', 'wire_bytes',
+                 'ack_waits', 'server_bytes'}
+
+
+def is_timing(column):
+    return column.endswith('per_s') or column.startswith('ns_per') or column.startswith('us_per')
+
+
+def higher_is_better(column):
+    return column.endswith('per_s')
+
+
+def is_key(column):
+    return not is_timing(column) and column not in COUNT_COLUMNS
+
+
+def number(value):
+    try:
+        return int(value)
+    except ValueError:
+        try:
+            return float(value)
+        except ValueError:
+            return value
+
+
+def git_rev(repo_dir):
+    try:
+        rev = subprocess.run(['git', 'describe', '--always', '--dirty'], cwd=repo_dir,
+                             capture_output=True, text=True, check=True).stdout.strip()
+        return rev
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def run_bench(path):
+    proc = subprocess.run([path], capture_output=True, text=True)
+    lines = [line for line in proc.stdout.splitlines() if line.strip()]
+    if proc.returncode != 0:
+        return {'error': '\n'.join(lines[-5:] + proc.stderr.splitlines()[-5:])}
+
+    columns = lines[0].split(',')
+    rows = []
+    for line in lines[1:]:
+        values = line.split(',')
+        if len(values) != len(columns):
+            return {'error': 'bad row: ' + line}
+        rows.append({c: number(v) for c, v in zip(columns, values)})
+    return {'columns': columns, 'rows': rows}
+
+
+def skipped_benches(build_dir):
+    """What the CMake configure step wrote down as not built: {name: why}."""
+    skipped = {}
+    try:
+        with open(os.path.join(build_dir, 'skipped_benches.txt')) as f:
+            for line in f:
+                name, _, why = line.partition(':')
+                if name.strip():
+                    skipped[name.strip()] = why.strip()
+    except OSError:
+        pass
+    return skipped
+
+
+def run(build_dir, out, names):
+    skipped = skipped_benches(build_dir)
+    if not names:
+        names = sorted(set(f for f in os.listdir(build_dir)
+                           if f.endswith('_bench') and os.access(os.path.join(build_dir, f), os.X_OK))
+                       | set(skipped))
+
+    repo_dir = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+    result = {
+        'git': git_rev(repo_dir),
+        'date': datetime.datetime.now().isoformat(timespec='seconds'),
+        'host': platform.node(),
+        'machine': platform.machine(),
+        'benches': {},
+    }
+
+    failed = False
+    for name in names:
+        if name in skipped:
+            print('skipping', name + ':', skipped[name], file=sys.stderr)
+            result['benches'][name] = {'skipped': skipped[name]}
+            continue
+        print('running', name, file=sys.stderr)
+        bench = run_bench(os.path.join(build_dir, name))
+        if 'error' in bench:
+            print(name, 'FAILED:', bench['error'], file=sys.stderr)
+            failed = True
+        result['benches'][name] = bench
+
+    with open(out, 'w') as f:
+        json.dump(result, f, indent=1)
+    return 1 if failed else 0
+
+
+def row_key(row, columns):
+    return tuple((c, row[c]) for c in columns if is_key(c))
+
+
+def compare(old_path, new_path, min_change):
+    with open(old_path) as f:
+        old = json.load(f)
+    with open(new_path) as f:
+        new = json.load(f)
+
+    print('old: %s %s' % (old.get('git'), old.get('date')))
+    print('new: %s %s' % (new.get('git'), new.get('date')))
+
+    for name, new_bench in sorted(new['benches'].items()):
+        old_bench = old['benches'].get(name)
+        if 'skipped' in new_bench:
+            print('%s skipped: %s' % (name, new_bench['skipped']))
+            continue
+        if not old_bench or 'rows' not in old_bench or 'rows' not in new_bench:
+            continue
+        columns = new_bench['columns']
+        old_rows = {row_key(r, old_bench['columns']): r for r in old_bench['rows']}
+
+        lines = []
+        for row in new_bench['rows']:
+            key = row_key(row, columns)
+            old_row = old_rows.get(key)
+            if not old_row:
+                continue
+            label = ' '.join(str(v) for _, v in key)
+            for c in columns:
+                if is_key(c) or c == 'iterations' or c not in old_row:
+                    continue
+                a, b = old_row[c], row[c]
+                if is_timing(c):
+                    if not a:
+                        continue
+                    change = (b - a) * 100.0 / a
+                    if abs(change) < min_change:
+                        continue
+                    better = (change > 0) == higher_is_better(c)
+                    lines.append('  %-40s %-20s %12.2f -> %12.2f %+7.1f%% %s'
+                                 % (label, c, a, b, change, 'better' if better else 'WORSE'))
+                elif a != b:
+                    lines.append('  %-40s %-20s %12s -> %12s' % (label, c, a, b))
+        if lines:
+            print(name)
+            print('\n'.join(lines))
+    return 0
+
+
+def main():
+    if len(sys.argv) >= 4 and sys.argv[1] == '--compare':
+        min_change = float(sys.argv[4]) if len(sys.argv) > 4 else 5.0
+        return compare(sys.argv[2], sys.argv[3], min_change)
+    if len(sys.argv) < 3 or sys.argv[1].startswith('-'):
+        sys.exit(__doc__)
+    return run(sys.argv[1], sys.argv[2], sys.argv[3:])
+
+
+if __name__ == '__main__':
+    sys.exit(main())
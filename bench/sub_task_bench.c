@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "sub_task.h"
+
+// Checks the host sub_task_run (sub_task_x86_64.S / sub_task_aarch64.S) keeps the run/yield/trap
+// semantics of the Cortex M0+ one, then times the switches.
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// + 8: the top of the stack is only 8 byte aligned, like a pool block can be.
+#define STACK_SIZE (16 * 1024 + 8)
+static uint64_t stack_a[STACK_SIZE / 8 + 1] __attribute__((aligned(16)));
+static uint64_t stack_b[STACK_SIZE / 8 + 1] __attribute__((aligned(16)));
+
+static sub_task* new_task(uint64_t* mem) {
+    sub_task* task = (sub_task*) mem;
+    sub_task_init(task, STACK_SIZE);
+    return task;
+}
+
+// Yields 1..n, each time checking it got back what was sent in. Returns 1000 + the sum.
+static size_t counting_task(sub_task* task, void* args) {
+    size_t n = (size_t) args;
+    size_t sum = 0;
+    for (size_t i = 1; i <= n; i++) {
+        size_t in = (size_t) sub_task_yield(i, task);
+        if (in != i * 10) {
+            return 0;
+        }
+        sum += in;
+    }
+    return 1000 + sum;
+}
+
+// Keeps a pile of values (and doubles) alive across yields, so they end up in callee saved registers.
+static size_t register_task(sub_task* task, void* args) {
+    volatile uint64_t seed = (uint64_t) args;
+    uint64_t a = seed * 3, b = seed * 5, c = seed * 7, d = seed * 11, e = seed * 13, f = seed * 17;
+    double x = seed * 0.5, y = seed * 0.25, z = seed * 0.125;
+    for (int i = 0; i < 100; i++) {
+        sub_task_yield(i, task);
+        a += 1; b += 2; c += 3; d += 4; e += 5; f += 6;
+        x += 1.0; y += 2.0; z += 3.0;
+    }
+    uint64_t s = (uint64_t) seed;
+    int ok = a == s * 3 + 100 && b == s * 5 + 200 && c == s * 7 + 300 && d == s * 11 + 400
+        && e == s * 13 + 500 && f == s * 17 + 600
+        && x == s * 0.5 + 100.0 && y == s * 0.25 + 200.0 && z == s * 0.125 + 300.0;
+    return ok ? 1 : 2;
+}
+
+// Runs a task of it's own, like main would. Yields what the inner one yields.
+static size_t nesting_task(sub_task* task, void* args) {
+    sub_task* inner = new_task(stack_b);
+    size_t got = sub_task_run(inner, counting_task, (void*) 3);
+    while (!sub_task_done(inner)) {
+        sub_task_yield(got, task);
+        got = sub_task_continue(inner, (void*) (got * 10));
+    }
+    return got;
+}
+
+static size_t pingpong_task(sub_task* task, void* args) {
+    for (;;) {
+        sub_task_yield(0, task);
+    }
+    return 0;
+}
+
+static size_t empty_task(sub_task* task, void* args) {
+    return (size_t) args;
+}
+
+static int check() {
+    sub_task* task = new_task(stack_a);
+
+    // First run goes until the first yield
+    size_t got = sub_task_run(task, counting_task, (void*) 5);
+    for (size_t i = 1; i <= 5; i++) {
+        if (got != i || sub_task_done(task)) {
+            printf("FAIL yield %zu got %zu\n", i, got);
+            return 1;
+        }
+        got = sub_task_continue(task, (void*) (i * 10));
+    }
+    if (got != 1150 || !sub_task_done(task)) {
+        printf("FAIL return got %zu done %d\n", got, sub_task_done(task));
+        return 1;
+    }
+
+    // The stack is re-usable once it's done
+    if (!sub_task_reset(task, STACK_SIZE)) {
+        printf("FAIL reset\n");
+        return 1;
+    }
+    if (sub_task_run(task, empty_task, (void*) 42) != 42 || !sub_task_done(task)) {
+        printf("FAIL one shot task\n");
+        return 1;
+    }
+
+    // Callee saved registers on both sides survive the switches
+    volatile uint64_t seed = 12345;
+    uint64_t a = seed + 1, b = seed + 2, c = seed + 3, d = seed + 4, e = seed + 5, f = seed + 6;
+    double x = seed * 2.0, y = seed * 3.0;
+    sub_task_reset(task, STACK_SIZE);
+    got = sub_task_run(task, register_task, (void*) 7);
+    int yields = 0;
+    while (!sub_task_done(task)) {
+        a += 1; b += 2; c += 3; d += 4; e += 5; f += 6;
+        x += 1.0; y += 2.0;
+        yields++;
+        got = sub_task_continue(task, NULL);
+    }
+    if (got != 1 || yields != 100) {
+        printf("FAIL task registers\n");
+        return 1;
+    }
+    uint64_t s = seed;
+    if (a != s + 101 || b != s + 202 || c != s + 303 || d != s + 404 || e != s + 505 || f != s + 606
+            || x != s * 2.0 + 100.0 || y != s * 3.0 + 200.0) {
+        printf("FAIL caller registers\n");
+        return 1;
+    }
+
+    // A task running a task
+    sub_task_reset(task, STACK_SIZE);
+    got = sub_task_run(task, nesting_task, NULL);
+    for (size_t i = 1; i <= 3; i++) {
+        if (got != i) {
+            printf("FAIL nested yield %zu got %zu\n", i, got);
+            return 1;
+        }
+        got = sub_task_continue(task, NULL);
+    }
+    if (got != 1060 || !sub_task_done(task)) {
+        printf("FAIL nested return %zu\n", got);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    double min_time = argc > 1 ? atof(argv[1]) : 0.1;
+
+    if (check()) {
+        return 1;
+    }
+
+    printf("case,iterations,ns_per_op\n");
+
+    // continue + yield: two switches
+    sub_task* task = new_task(stack_a);
+    sub_task_run(task, pingpong_task, NULL);
+    long iterations = 0;
+    double start = now_s();
+    double elapsed;
+    do {
+        for (int b = 0; b < 1000; b++) {
+            sub_task_continue(task, NULL);
+        }
+        iterations += 1000;
+        elapsed = now_s() - start;
+    } while (elapsed < min_time);
+    printf("continue_yield,%ld,%.2f\n", iterations, elapsed / iterations * 1e9);
+    printf("switch,%ld,%.2f\n", iterations * 2, elapsed / iterations / 2 * 1e9);
+
+    // run a task that returns right away, then reset the stack
+    task = new_task(stack_b);
+    iterations = 0;
+    start = now_s();
+    do {
+        for (int b = 0; b < 1000; b++) {
+            sub_task_run(task, empty_task, NULL);
+            sub_task_reset(task, STACK_SIZE);
+        }
+        iterations += 1000;
+        elapsed = now_s() - start;
+    } while (elapsed < min_time);
+    printf("run_to_completion,%ld,%.2f\n", iterations, elapsed / iterations * 1e9);
+
+    return 0;
+}
@@ -0,0 +1,610 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "bufferless_str.h"
+
+#define MIN_(a, b) ((a) < (b) ? (a) : (b))
+
+// Load generator for the websocket server. Opens a bunch of connections and keeps them busy:
+//   page mode (-s 0, default): what index.html does, times the connections. A 'b' poll every 1/rate s
+//              and a '0'/'1'/'2' command now and then.
+//   sized mode (-s N): an N byte binary message every 1/rate s, or back to back with -r 0.
+// Every message is followed by a ping carrying the time it was sent. The server answers pings from
+// the same task that reads the messages (and after writing whatever 'b' made it write), so the pong
+// is the round trip through the read path, the task and the framinator.
+//
+// Pushes the server sends on it's own are counted in recv_*, they don't have anything to do with latency.
+// When the socket can't take the next message (backpressure all the way from the pico's ring),
+// it's skipped and counted in send_stalls.
+//
+// Prints one CSV line (with a header), like the benches:
+//   ws_load -h 192.168.12.147 -c 8 -d 30 -s 1024 -r 50
+
+static void usage() {
+    fprintf(stderr,
+        "ws_load [-h host] [-p port] [-c connections] [-d seconds] [-w warmup seconds]\n"
+        "        [-s message size, 0 = index.html pattern] [-r messages/s per connection, 0 = back to back]\n"
+        "defaults: -h 127.0.0.1 -p 8080 -c 4 -d 10 -w 1 -s 0 -r 20\n");
+    exit(2);
+}
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#define HANDSHAKE_TIMEOUT_US (5 * 1000000)
+// '0'/'1'/'2' commands in page mode, somewhere in between these
+#define COMMAND_MIN_INTERVAL_US (500 * 1000)
+#define COMMAND_MAX_INTERVAL_US (3000 * 1000)
+#define IN_BUF_LEN (16 * 1024)
+#define FRAME_HEADER_MAX_LEN 14 // 2 + 8 + mask
+
+#define WS_FIN          0x80
+#define WS_OP_CONT      0x0
+#define WS_OP_TEXT      0x1
+#define WS_OP_BINARY    0x2
+#define WS_OP_CLOSE     0x8
+#define WS_OP_PING      0x9
+#define WS_OP_PONG      0xA
+
+typedef enum con_state_ {
+    CON_CONNECTING,
+    CON_HANDSHAKE,
+    CON_OPEN,
+    CON_FAILED,  // Never got to CON_OPEN
+    CON_DROPPED, // Was open, then closed by the other end
+} con_state;
+
+typedef struct con_ {
+    int fd;
+    con_state state;
+    uint64_t started_us;
+
+    uint8_t* out;
+    size_t out_len;
+    size_t out_cap;
+
+    uint8_t in[IN_BUF_LEN];
+    size_t in_len;
+    // Payload of a data frame that is still coming, it's not kept
+    uint64_t skip;
+
+    uint64_t next_send_us;
+    uint64_t next_command_us;
+    int pings_in_flight;
+} con;
+
+typedef struct stats_ {
+    size_t sent_msgs, sent_bytes;
+    size_t recv_msgs, recv_bytes;
+    size_t pings, pongs;
+    size_t send_stalls;
+
+    uint32_t* rtt_us;
+    size_t rtt_len, rtt_cap;
+
+    uint32_t* handshake_us;
+    size_t handshake_len;
+} stats;
+
+static const char* host = "127.0.0.1";
+static const char* port = "8080";
+static int connections = 4;
+static double duration_s = 10;
+static double warmup_s = 1;
+static size_t msg_size = 0;
+static double rate = 20;
+
+static stats st;
+static bool measuring;
+// Pongs are only counted for pings sent after the warmup
+static uint64_t measure_start_us;
+// What the sized messages carry
+static uint8_t* payload;
+
+static void rtt_add(uint32_t us) {
+    if (st.rtt_len == st.rtt_cap) {
+        st.rtt_cap = st.rtt_cap ? st.rtt_cap * 2 : 4096;
+        if (!(st.rtt_us = realloc(st.rtt_us, st.rtt_cap * sizeof(uint32_t)))) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    st.rtt_us[st.rtt_len++] = us;
+}
+
+static int cmp_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Nearest rank percentile of sorted samples. 0 if there are none.
+ */
+static uint32_t percentile(const uint32_t* sorted, size_t len, double p) {
+    if (!len) {
+        return 0;
+    }
+    size_t rank = (size_t) (p / 100.0 * len + 0.999999);
+    return sorted[rank ? rank - 1 : 0];
+}
+
+/**
+ * @brief Frames a client message (masked, like the RFC wants) onto the output buffer.
+ *
+ * @return int 0 or -1 if it does not fit right now
+ */
+static int con_queue_frame(con* c, uint8_t opcode, const void* payload, size_t len) {
+    if (c->out_cap - c->out_len < FRAME_HEADER_MAX_LEN + len) {
+        return -1;
+    }
+    uint8_t* p = c->out + c->out_len;
+    *p++ = WS_FIN | opcode;
+    if (len < 126) {
+        *p++ = 0x80 | len;
+    } else if (len <= 0xFFFF) {
+        *p++ = 0x80 | 126;
+        *p++ = len >> 8;
+        *p++ = len;
+    } else {
+        *p++ = 0x80 | 127;
+        for (int i = 0; i < 8; i++) {
+            *p++ = (uint64_t) len >> (56 - i * 8);
+        }
+    }
+    uint8_t mask[4];
+    uint32_t r = rand();
+    memcpy(mask, &r, 4);
+    memcpy(p, mask, 4);
+    p += 4;
+    const uint8_t* src = payload;
+    for (size_t i = 0; i < len; i++) {
+        p[i] = src[i] ^ mask[i % 4];
+    }
+    c->out_len = p + len - c->out;
+    return 0;
+}
+
+static int con_queue_ping(con* c) {
+    uint64_t t = now_us();
+    if (con_queue_frame(c, WS_OP_PING, &t, sizeof(t))) {
+        return -1;
+    }
+    c->pings_in_flight++;
+    if (measuring) {
+        st.pings++;
+    }
+    return 0;
+}
+
+/**
+ * @brief Queues a message and the ping behind it, or neither if there is no room.
+ */
+static void con_send(con* c, uint8_t opcode, const void* payload, size_t len) {
+    if (c->out_cap - c->out_len < 2 * FRAME_HEADER_MAX_LEN + len + sizeof(uint64_t)) {
+        if (measuring) {
+            st.send_stalls++;
+        }
+        return;
+    }
+    con_queue_frame(c, opcode, payload, len);
+    con_queue_ping(c);
+    if (measuring) {
+        st.sent_msgs++;
+        st.sent_bytes += len;
+    }
+}
+
+static void con_close(con* c, con_state state) {
+    if (c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    c->state = state;
+}
+
+static int con_connect(con* c, const struct addrinfo* addr) {
+    c->fd = socket(addr->ai_family, SOCK_STREAM, 0);
+    if (c->fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    c->state = CON_CONNECTING;
+    c->started_us = now_us();
+    c->in_len = 0;
+    c->skip = 0;
+    c->pings_in_flight = 0;
+    c->out_cap = 2 * (FRAME_HEADER_MAX_LEN + msg_size) + 2 * FRAME_HEADER_MAX_LEN + 4096;
+    c->out_len = 0;
+    if (!(c->out = malloc(c->out_cap))) {
+        perror("malloc");
+        exit(1);
+    }
+
+    if (connect(c->fd, addr->ai_addr, addr->ai_addrlen) && errno != EINPROGRESS) {
+        con_close(c, CON_FAILED);
+        return 0;
+    }
+
+    unsigned char nonce[16];
+    for (int i = 0; i < sizeof(nonce); i++) {
+        nonce[i] = rand();
+    }
+    char key[32];
+    key[encode_base64(key, (char*) nonce, sizeof(nonce))] = '\0';
+
+    c->out_len = snprintf((char*) c->out, c->out_cap,
+        "GET / HTTP/1.1\r\n"
+        "Host: %s:%s\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: %s\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "Sec-WebSocket-Protocol: chat\r\n"
+        "\r\n", host, port, key);
+    return 0;
+}
+
+/**
+ * @brief Looks for the end of the response header. Anything after it is already websocket frames.
+ *
+ * @return int 1 when upgraded, 0 if the header is not all there yet, -1 if the server said no
+ */
+static int con_handshake(con* c) {
+    uint8_t* end = memmem(c->in, c->in_len, "\r\n\r\n", 4);
+    if (!end) {
+        return c->in_len == IN_BUF_LEN ? -1 : 0;
+    }
+    if (c->in_len < 12 || memcmp(c->in, "HTTP/1.1 101", 12)) {
+        return -1;
+    }
+    size_t header_len = end + 4 - c->in;
+    memmove(c->in, end + 4, c->in_len - header_len);
+    c->in_len -= header_len;
+    return 1;
+}
+
+/**
+ * @brief Handles the server frames in the input buffer.
+ *
+ * @return int 0 or -1 when the server closed
+ */
+static int con_read_frames(con* c) {
+    size_t pos = 0;
+    int ret = 0;
+
+    while (pos < c->in_len) {
+        if (c->skip) {
+            size_t n = MIN_(c->skip, c->in_len - pos);
+            c->skip -= n;
+            pos += n;
+            if (measuring) {
+                st.recv_bytes += n;
+            }
+            continue;
+        }
+
+        uint8_t* f = c->in + pos;
+        size_t avail = c->in_len - pos;
+        if (avail < 2) {
+            break;
+        }
+        uint8_t opcode = f[0] & 0x0F;
+        uint64_t len = f[1] & 0x7F;
+        size_t header_len = 2;
+        if (len == 126) {
+            header_len += 2;
+        } else if (len == 127) {
+            header_len += 8;
+        }
+        if (avail < header_len) {
+            break;
+        }
+        if (len == 126) {
+            len = (f[2] << 8) | f[3];
+        } else if (len == 127) {
+            len = 0;
+            for (int i = 0; i < 8; i++) {
+                len = (len << 8) | f[2 + i];
+            }
+        }
+
+        if (opcode & 0x8) {
+            // Control frames are short, wait for all of it
+            if (avail < header_len + len) {
+                break;
+            }
+            if (opcode == WS_OP_PONG && len == sizeof(uint64_t)) {
+                uint64_t sent;
+                memcpy(&sent, f + header_len, sizeof(sent));
+                c->pings_in_flight--;
+                if (measuring && sent >= measure_start_us) {
+                    st.pongs++;
+                    rtt_add(now_us() - sent);
+                }
+            } else if (opcode == WS_OP_PING) {
+                con_queue_frame(c, WS_OP_PONG, f + header_len, len);
+            } else if (opcode == WS_OP_CLOSE) {
+                ret = -1;
+            }
+            pos += header_len + len;
+        } else {
+            if ((f[0] & WS_FIN) && measuring) {
+                st.recv_msgs++;
+            }
+            pos += header_len;
+            c->skip = len;
+        }
+    }
+
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+    return ret;
+}
+
+/**
+ * @brief Queues whatever is due.
+ *
+ * @return uint64_t When it's time to call this again
+ */
+static uint64_t con_tick(con* c, uint64_t now) {
+    uint64_t interval = rate > 0 ? (uint64_t) (1e6 / rate) : 0;
+
+    if (rate <= 0) {
+        // Back to back: the next one as soon as the last one came back
+        if (c->pings_in_flight == 0) {
+            con_send(c, WS_OP_BINARY, payload, msg_size);
+        }
+        return UINT64_MAX;
+    }
+
+    if (now >= c->next_send_us) {
+        if (msg_size) {
+            con_send(c, WS_OP_BINARY, payload, msg_size);
+        } else {
+            con_send(c, WS_OP_TEXT, "b", 1);
+        }
+        c->next_send_us += interval;
+        if (c->next_send_us < now) {
+            c->next_send_us = now + interval; // Fell behind, don't burst
+        }
+    }
+    if (!msg_size && now >= c->next_command_us) {
+        char command = '0' + rand() % 3;
+        con_send(c, WS_OP_TEXT, &command, 1);
+        c->next_command_us = now + COMMAND_MIN_INTERVAL_US + rand() % (COMMAND_MAX_INTERVAL_US - COMMAND_MIN_INTERVAL_US);
+    }
+    return msg_size ? c->next_send_us : MIN_(c->next_send_us, c->next_command_us);
+}
+
+static void con_opened(con* c, uint64_t now) {
+    c->state = CON_OPEN;
+    if (st.handshake_len < connections) {
+        st.handshake_us[st.handshake_len++] = now - c->started_us;
+    }
+    // Spread the connections over the interval so they don't all send at once
+    uint64_t interval = rate > 0 ? (uint64_t) (1e6 / rate) : 0;
+    c->next_send_us = now + (interval ? rand() % interval : 0);
+    c->next_command_us = now + COMMAND_MIN_INTERVAL_US + rand() % (COMMAND_MAX_INTERVAL_US - COMMAND_MIN_INTERVAL_US);
+}
+
+static void con_io(con* c, short revents, uint64_t now) {
+    if (revents & (POLLERR | POLLHUP | POLLNVAL) && !(revents & POLLIN)) {
+        con_close(c, c->state == CON_OPEN ? CON_DROPPED : CON_FAILED);
+        return;
+    }
+    if (c->state == CON_CONNECTING && (revents & (POLLOUT | POLLIN))) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            con_close(c, CON_FAILED);
+            return;
+        }
+        c->state = CON_HANDSHAKE;
+    }
+
+    if ((revents & POLLOUT) && c->out_len) {
+        ssize_t n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            con_close(c, c->state == CON_OPEN ? CON_DROPPED : CON_FAILED);
+            return;
+        }
+        if (n > 0) {
+            memmove(c->out, c->out + n, c->out_len - n);
+            c->out_len -= n;
+        }
+    }
+
+    if (revents & POLLIN) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, IN_BUF_LEN - c->in_len, 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            con_close(c, c->state == CON_OPEN ? CON_DROPPED : CON_FAILED);
+            return;
+        }
+        if (n > 0) {
+            c->in_len += n;
+        }
+
+        if (c->state == CON_HANDSHAKE) {
+            int ret = con_handshake(c);
+            if (ret < 0) {
+                con_close(c, CON_FAILED);
+                return;
+            }
+            if (ret > 0) {
+                con_opened(c, now);
+            }
+        }
+        if (c->state == CON_OPEN && con_read_frames(c)) {
+            con_close(c, CON_DROPPED);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:d:w:s:r:")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 'c': connections = atoi(optarg); break;
+            case 'd': duration_s = atof(optarg); break;
+            case 'w': warmup_s = atof(optarg); break;
+            case 's': msg_size = strtoul(optarg, NULL, 0); break;
+            case 'r': rate = atof(optarg); break;
+            default: usage();
+        }
+    }
+    if (connections <= 0 || duration_s <= 0) {
+        usage();
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* addr;
+    int err;
+    if ((err = getaddrinfo(host, port, &hints, &addr))) {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+        return 1;
+    }
+
+    // One fd per connection
+    struct rlimit lim;
+    if (!getrlimit(RLIMIT_NOFILE, &lim) && lim.rlim_cur < connections + 16) {
+        lim.rlim_cur = MIN_(lim.rlim_max, (rlim_t) connections + 16);
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+
+    srand(now_us());
+    con* cons = calloc(connections, sizeof(con));
+    struct pollfd* fds = calloc(connections, sizeof(struct pollfd));
+    st.handshake_us = calloc(connections, sizeof(uint32_t));
+    if (!cons || !fds || !st.handshake_us) {
+        perror("calloc");
+        return 1;
+    }
+
+    if (msg_size && !(payload = malloc(msg_size))) {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t i = 0; i < msg_size; i++) {
+        payload[i] = 'a' + i % 26;
+    }
+
+    for (int i = 0; i < connections; i++) {
+        con_connect(&cons[i], addr);
+    }
+    freeaddrinfo(addr);
+
+    measure_start_us = now_us() + (uint64_t) (warmup_s * 1e6);
+    uint64_t end = measure_start_us + (uint64_t) (duration_s * 1e6);
+
+    uint64_t now;
+    while ((now = now_us()) < end) {
+        measuring = now >= measure_start_us;
+
+        uint64_t next = end;
+        int nfds = 0;
+        for (int i = 0; i < connections; i++) {
+            con* c = &cons[i];
+            if (c->fd < 0) {
+                continue;
+            }
+            if (c->state != CON_OPEN && now - c->started_us > HANDSHAKE_TIMEOUT_US) {
+                con_close(c, CON_FAILED);
+                continue;
+            }
+            if (c->state == CON_OPEN) {
+                next = MIN_(next, con_tick(c, now));
+            }
+            fds[nfds].fd = c->fd;
+            fds[nfds].events = POLLIN | (c->out_len || c->state == CON_CONNECTING ? POLLOUT : 0);
+            fds[nfds].revents = 0;
+            nfds++;
+        }
+
+        if (nfds == 0) {
+            fprintf(stderr, "all connections closed\n");
+            break;
+        }
+
+        uint64_t wait = next > now ? next - now : 0;
+        struct timespec timeout = { .tv_sec = wait / 1000000, .tv_nsec = (wait % 1000000) * 1000 };
+        if (ppoll(fds, nfds, &timeout, NULL) < 0 && errno != EINTR) {
+            perror("ppoll");
+            return 1;
+        }
+
+        now = now_us();
+        for (int i = 0, f = 0; i < connections && f < nfds; i++) {
+            if (cons[i].fd != fds[f].fd) {
+                continue;
+            }
+            if (fds[f].revents) {
+                con_io(&cons[i], fds[f].revents, now);
+            }
+            f++;
+        }
+    }
+    uint64_t stop = MIN_(now_us(), end);
+    double elapsed = stop > measure_start_us ? (stop - measure_start_us) / 1e6 : 0;
+
+    int established = 0, failed = 0, dropped = 0;
+    for (int i = 0; i < connections; i++) {
+        con* c = &cons[i];
+        established += c->state == CON_OPEN || c->state == CON_DROPPED;
+        failed += c->state == CON_FAILED || c->state == CON_CONNECTING || c->state == CON_HANDSHAKE;
+        dropped += c->state == CON_DROPPED;
+        if (c->state == CON_OPEN) {
+            // Say goodbye, don't wait for the answer
+            uint16_t code = htons(1000);
+            c->out_len = 0;
+            con_queue_frame(c, WS_OP_CLOSE, &code, sizeof(code));
+            send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+        }
+        con_close(c, c->state);
+        free(c->out);
+    }
+
+    qsort(st.rtt_us, st.rtt_len, sizeof(uint32_t), cmp_u32);
+    qsort(st.handshake_us, st.handshake_len, sizeof(uint32_t), cmp_u32);
+
+    printf("connections,established,failed,dropped,msg_size,rate,seconds,sent_msgs,recv_msgs,"
+           "sent_mb_per_s,recv_mb_per_s,pings,pongs,send_stalls,"
+           "rtt_p50_us,rtt_p99_us,rtt_p999_us,rtt_max_us,handshake_p50_us,handshake_max_us\n");
+    printf("%d,%d,%d,%d,%zu,%.1f,%.1f,%zu,%zu,%.3f,%.3f,%zu,%zu,%zu,%u,%u,%u,%u,%u,%u\n",
+        connections, established, failed, dropped, msg_size, rate, elapsed, st.sent_msgs, st.recv_msgs,
+        elapsed ? st.sent_bytes / elapsed / 1e6 : 0, elapsed ? st.recv_bytes / elapsed / 1e6 : 0, st.pings, st.pongs, st.send_stalls,
+        percentile(st.rtt_us, st.rtt_len, 50), percentile(st.rtt_us, st.rtt_len, 99),
+        percentile(st.rtt_us, st.rtt_len, 99.9), st.rtt_len ? st.rtt_us[st.rtt_len - 1] : 0,
+        percentile(st.handshake_us, st.handshake_len, 50),
+        st.handshake_len ? st.handshake_us[st.handshake_len - 1] : 0);
+
+    free(payload);
+    free(st.rtt_us);
+    free(st.handshake_us);
+    free(cons);
+    free(fds);
+    return failed || dropped ? 3 : 0;
+}
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ws_mask.h"
+
+typedef uint32_t (*mask_fn)(void* dst, const void* src, size_t len, uint32_t mask);
+
+typedef struct variant_ {
+    const char* name;
+    mask_fn fn;
+} variant;
+
+static variant variants[8];
+static int variants_len;
+
+static void add_variant(const char* name, mask_fn fn) {
+    variants[variants_len].name = name;
+    variants[variants_len].fn = fn;
+    variants_len++;
+}
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint8_t src_buf[64 * 1024 + 64] __attribute__((aligned(64)));
+static uint8_t dst_buf[64 * 1024 + 64] __attribute__((aligned(64)));
+static uint8_t ref_buf[64 * 1024 + 64] __attribute__((aligned(64)));
+
+/**
+ * @brief Every variant has to match the byte loop, including the returned mask,
+ * for every length and alignment. Also when a payload is split in two calls (like across pbufs).
+ */
+static int check() {
+    const uint32_t mask = 0xA1B2C3D4;
+    int bad = 0;
+
+    for (int v = 0; v < variants_len; v++) {
+        for (size_t len = 0; len < 300; len++) {
+            for (int s_off = 0; s_off < 4; s_off++) {
+                for (int d_off = 0; d_off < 4; d_off++) {
+                    size_t split = len / 3;
+                    uint32_t ref_mask = ws_mask_copy_bytes(ref_buf + d_off, src_buf + s_off, len, mask);
+                    memset(dst_buf, 0, len + 8);
+                    uint32_t m = variants[v].fn(dst_buf + d_off, src_buf + s_off, split, mask);
+                    m = variants[v].fn(dst_buf + d_off + split, src_buf + s_off + split, len - split, m);
+
+                    if (m != ref_mask || memcmp(dst_buf + d_off, ref_buf + d_off, len)) {
+                        printf("FAIL %s len=%zu src+%d dst+%d\n", variants[v].name, len, s_off, d_off);
+                        bad = 1;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return bad;
+}
+
+int main(int argc, char** argv) {
+    static const size_t sizes[] = { 8, 32, 125, 256, 1460, 4096, 65536 };
+    double min_time = argc > 1 ? atof(argv[1]) : 0.05;
+
+    add_variant("bytes", ws_mask_copy_bytes);
+    add_variant("words", ws_mask_copy_words);
+#if WS_MASK_HAVE_SSE2
+    add_variant("sse2", ws_mask_copy_sse2);
+#if WS_MASK_HAVE_AVX2
+    if (ws_mask_cpu_has_avx2()) {
+        add_variant("avx2", ws_mask_copy_avx2);
+    }
+#endif
+#endif
+    add_variant("dispatch", ws_mask_copy);
+
+    for (size_t i = 0; i < sizeof(src_buf); i++) {
+        src_buf[i] = rand();
+    }
+
+    if (check()) {
+        return 1;
+    }
+
+    // One line per variant/size/alignment. Easy to grep or load into a spreadsheet.
+    printf("variant,size,src_align,dst_align,ns_per_call,mb_per_s\n");
+    for (int v = 0; v < variants_len; v++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            for (int align = 0; align < 2; align++) {
+                // aligned/aligned and the worst case, both off and not lined up with each other.
+                int s_off = align ? 1 : 0;
+                int d_off = align ? 3 : 0;
+                size_t len = sizes[s];
+                uint32_t mask = 0x12345678;
+
+                long iters = 0;
+                long batch = 1 + (1 << 20) / (len + 1);
+                double start = now_s();
+                double elapsed;
+                do {
+                    for (long b = 0; b < batch; b++) {
+                        mask = variants[v].fn(dst_buf + d_off, src_buf + s_off, len, mask);
+                    }
+                    iters += batch;
+                    elapsed = now_s() - start;
+                } while (elapsed < min_time);
+
+                printf("%s,%zu,%d,%d,%.1f,%.0f\n", variants[v].name, len, s_off, d_off,
+                    elapsed * 1e9 / iters, (double) len * iters / elapsed / 1e6);
+                // Keep the compiler from dropping the work
+                if (mask == 0 && dst_buf[d_off] == 42) {
+                    printf("!\n");
+                }
+            }
+        }
+    }
+
+    return 0;
+}
@@ -42,106 +42,200 @@ void bl_str_reset(bl_str_selecter* selecter, const char** strs, int strs_len) {
     selecter->str_index = 0;
 }
 
-char base64bits(char base64) {
-    if (base64 >= 'A' && base64 <= 'Z') {
-        return base64 - 'A';
-    } else if (base64 >= 'a' && base64 <= 'z') {
-        return base64 - ('a' - ('Z' - 'A' + 1));
-    } else if (base64 >= '0' && base64 <= '9') {
-        return base64 - ('0' - ('Z' - 'A' + 1) - ('z' - 'a' + 1));
-    } else if (base64 == '+') {
-        return (('Z' - 'A' + 1) + ('z' - 'a' + 1) + ('9' - '0' + 1));
-    } else if (base64 == '+') { // ???
-        return (('Z' - 'A' + 1) + ('z' - 'a' + 1) + ('9' - '0' + 1) + 1);
+int bl_trie_select(bl_trie_selecter* selecter, const char* buf, int buf_len) {
+    const bl_trie* trie = selecter->trie;
+    uint8_t state = selecter->state;
+
+    if (state == BL_TRIE_DEAD) {
+        return BL_STR_NO_MATCH;
+    }
+
+    for (int i = 0; i < buf_len; i++) {
+        char c = buf[i];
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+
+        const char* chars = trie->edge_chars + trie->first_edge[state];
+        int count = trie->edge_count[state];
+        int e;
+        for (e = 0; e < count && chars[e] != c; e++);
+
+        if (e == count) {
+            selecter->state = BL_TRIE_DEAD;
+            return BL_STR_NO_MATCH;
+        }
+        state = trie->edge_next[trie->first_edge[state] + e];
     }
-    return -1;
+
+    selecter->state = state;
+    return trie->accept[state] >= 0 ? trie->accept[state] : BL_STR_NO_MATCH_YET;
 }
 
-char bitsToBase64(char bits) {
-    if (bits < 26) {
-        return 'A' + bits;
-    } else if (bits < 52) {
-        return 'a' + bits - 26;
-    } else if (bits < 62) {
-        return '0' + bits - 52;
-    } else if (bits == 62) {
-        return '+';
-    } else if (bits == 63) {
-        return '/';
+// ============ base64 ============
+
+static const char base64_chars[64] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// 6 bit value of each base64 char. Everything else is BASE64_INVALID (high bit set,
+// so OR'ing four lookups togeather tells if any of them was bad).
+#define BASE64_INVALID 0x80
+#define X BASE64_INVALID
+static const uint8_t base64_values[256] = {
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X,62, X, X, X,63, // '+' '/'
+   52,53,54,55,56,57,58,59,60,61, X, X, X, X, X, X, // '0'-'9'
+    X, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14, // 'A'-
+   15,16,17,18,19,20,21,22,23,24,25, X, X, X, X, X, //    -'Z'
+    X,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40, // 'a'-
+   41,42,43,44,45,46,47,48,49,50,51, X, X, X, X, X, //    -'z'
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+    X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
+#undef X
+
+/**
+ * @brief Writes the bytes of the sub_i chars in bits (a group cut short by padding or the end).
+ */
+static int base64_flush_partial(uint32_t bits, int sub_i, uint8_t* out) {
+    switch (sub_i) {
+        case 3:
+            // bits be like: [ ------AA AAAABBBB BBCCCCCC]
+            // wanted:               ^^ ^^^^^^^^ ^^^^^^
+            out[0] = bits >> 10;
+            out[1] = bits >> 2;
+            return 2;
+        case 2:
+            // bits be like: [ -------- ----AAAA AABBBBBB]
+            // wanted:                      ^^^^ ^^^^
+            out[0] = bits >> 4;
+            return 1;
+        // 0 and 1 previous base64 chars do not have enough bits for a byte
     }
-    return -1;
+    return 0;
 }
 
 int decode_base64(base64_ctx* ctx, char* base64_buf, char* output_buf, int base64_len, char end) {
     // end is just used when we have a base64 input that does not use padding.
+    const uint8_t* in = (const uint8_t*) base64_buf;
+    uint8_t* out = (uint8_t*) output_buf;
 
-    uint32_t bytes = ctx->partial;
-    int sub_i = bytes >> 30;
-    int byte_index;
-    int i;
-
-    for (i = 0; i <= base64_len; i++) {
-        if (i >= base64_len || base64_buf[i] == '=') {
-            if (end || i < base64_len) {
-                switch (sub_i) {
-                    case 3:
-                        // bytes be like: [ ------AA AAAABBBB BBCCCCCC]
-                        // wanted:                ^^ ^^^^^^^^ ^^^^^^
-                        output_buf[++byte_index] = (bytes >> 2) & 0xFF;
-
-                        bytes >>= 6; // make bytes be like what case 2 expects
-
-                    case 2:
-                        // bytes be like: [ -------- ----AAAA AABBBBBB]
-                        // wanted:                       ^^^^ ^^^^
-
-                        output_buf[++byte_index] = (bytes >> 4) & 0xFF;
+    uint32_t bits = ctx->partial & 0x00FFFFFF;
+    int sub_i = ctx->partial >> 30;
+    int i = 0;
 
-                    // 0 and 1 previous base64 chars do not have enough bits for a byte
+    while (i < base64_len) {
+        if (sub_i == 0) {
+            // Lined up on a group. Do whole groups at once while they are clean.
+            while (i + 4 <= base64_len) {
+                uint32_t a = base64_values[in[i]], b = base64_values[in[i + 1]],
+                         c = base64_values[in[i + 2]], d = base64_values[in[i + 3]];
+                if ((a | b | c | d) & BASE64_INVALID) {
+                    break; // '=' or junk, the slow path sorts it out
                 }
+                uint32_t word = a << 18 | b << 12 | c << 6 | d;
+                out[0] = word >> 16;
+                out[1] = word >> 8;
+                out[2] = word;
+                out += 3;
+                i += 4;
+            }
+            if (i >= base64_len) {
+                break;
+            }
+        }
+
+        uint8_t value = base64_values[in[i++]];
+        if (value & BASE64_INVALID) {
+            if (in[i - 1] == '=') {
+                // Padding ends the group
+                out += base64_flush_partial(bits, sub_i, out);
                 sub_i = 0;
+                bits = 0;
             }
+            // Anything else (line breaks and such) is skipped.
             continue;
         }
 
-        bytes <<= 6;
-        bytes |= base64bits(base64_buf[i]);
-
-        sub_i = (sub_i + 1) & 0x03;
-        if (!sub_i) {
-            output_buf[++byte_index] = (bytes >> 16) & 0xFF;
-            output_buf[++byte_index] = (bytes >>  8) & 0xFF;
-            output_buf[++byte_index] = (bytes >>  0) & 0xFF;
+        bits = (bits << 6 | value) & 0x00FFFFFF;
+        if (++sub_i == 4) {
+            out[0] = bits >> 16;
+            out[1] = bits >> 8;
+            out[2] = bits;
+            out += 3;
+            sub_i = 0;
         }
     }
-    ctx->partial = (sub_i << 30) | (bytes & 0x3FFFFFFF);
 
-    return byte_index; // return number of bytes decoded
+    if (end) {
+        out += base64_flush_partial(bits, sub_i, out);
+        sub_i = 0;
+        bits = 0;
+    }
+    ctx->partial = (uint32_t) sub_i << 30 | bits;
+
+    return (char*) out - output_buf; // return number of bytes decoded
 }
 
-// TODO: pause/resume?
-int encode_base64(char* base64_buf, char* input_buf, int input_len) {
+int encode_base64_update(base64_enc_ctx* ctx, char* base64_buf, const char* input_buf, int input_len) {
+    const uint8_t* in = (const uint8_t*) input_buf;
+    char* out = base64_buf;
+
+    // Top up a group left over from last time
+    while (ctx->partial_len && input_len) {
+        ctx->partial[ctx->partial_len++] = *in++;
+        input_len--;
+        if (ctx->partial_len == 3) {
+            uint32_t word = ctx->partial[0] << 16 | ctx->partial[1] << 8 | ctx->partial[2];
+            out[0] = base64_chars[word >> 18];
+            out[1] = base64_chars[(word >> 12) & 0x3F];
+            out[2] = base64_chars[(word >> 6) & 0x3F];
+            out[3] = base64_chars[word & 0x3F];
+            out += 4;
+            ctx->partial_len = 0;
+        }
+    }
 
-    int i;
-    int j;
+    // A group (3 bytes -> 4 chars) at a time
+    for (; input_len >= 3; input_len -= 3, in += 3, out += 4) {
+        uint32_t word = in[0] << 16 | in[1] << 8 | in[2];
+        out[0] = base64_chars[word >> 18];
+        out[1] = base64_chars[(word >> 12) & 0x3F];
+        out[2] = base64_chars[(word >> 6) & 0x3F];
+        out[3] = base64_chars[word & 0x3F];
+    }
 
-    for (i = j = 0; i < input_len; i += 3) {
+    // Keep the rest for next time
+    while (input_len--) {
+        ctx->partial[ctx->partial_len++] = *in++;
+    }
 
-        base64_buf[j++] = bitsToBase64(input_buf[i] >> 2);
-        if (i < input_len - 1) {
-            base64_buf[j++] = bitsToBase64((input_buf[i] << 4 | input_buf[i + 1] >> 4) & 0x3F);
-            if (i < input_len - 2) {
-                base64_buf[j++] = bitsToBase64((input_buf[i + 1] << 2 | input_buf[i + 2] >> 6) & 0x3F);
-                base64_buf[j++] = bitsToBase64(input_buf[i + 2]  & 0x3F);
+    return out - base64_buf;
+}
 
-            } else {
-                base64_buf[j++] = bitsToBase64((input_buf[i + 1] << 2) & 0x3F);
-                base64_buf[j++] = '=';
-            }
-        } else {
-            base64_buf[j++] = bitsToBase64((input_buf[i] << 4) & 0x3F);
-            base64_buf[j++] = '=';
-            base64_buf[j++] = '=';
-        }
+int encode_base64_final(base64_enc_ctx* ctx, char* base64_buf) {
+    if (!ctx->partial_len) {
+        return 0;
     }
-}
\ No newline at end of file
+
+    uint32_t word = ctx->partial[0] << 16 | (ctx->partial_len > 1 ? ctx->partial[1] << 8 : 0);
+    base64_buf[0] = base64_chars[word >> 18];
+    base64_buf[1] = base64_chars[(word >> 12) & 0x3F];
+    base64_buf[2] = ctx->partial_len > 1 ? base64_chars[(word >> 6) & 0x3F] : '=';
+    base64_buf[3] = '=';
+    ctx->partial_len = 0;
+    return 4;
+}
+
+int encode_base64(char* base64_buf, const char* input_buf, int input_len) {
+    base64_enc_ctx ctx = { 0 };
+    int len = encode_base64_update(&ctx, base64_buf, input_buf, input_len);
+    return len + encode_base64_final(&ctx, base64_buf + len);
+}
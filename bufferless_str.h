@@ -31,12 +31,95 @@ int bl_str_select (bl_str_selecter* selecter, char* buf, int buf_len);
 
 void bl_str_reset (bl_str_selecter* selecter, const char** strs, int strs_len);
 
+// State of a bl_trie_selecter that fell off the trie.
+#define BL_TRIE_DEAD 0xFF
+
+/**
+ * @brief A trie of lower case strings, flattened into tables. Generated by gen_bl_trie.py.
+ * The edges of each state are contiguous, starting at first_edge[state].
+ */
+typedef struct bl_trie_ {
+    const uint16_t* first_edge;
+    const uint8_t* edge_count;
+    const char* edge_chars;
+    const uint8_t* edge_next;
+    // String id when a string ends at the state, or -1
+    const int8_t* accept;
+} bl_trie;
+
+typedef struct bl_trie_selecter_ {
+    const bl_trie* trie;
+    uint8_t state;
+} bl_trie_selecter;
+
+/**
+ * @brief Like bl_str_select(), but walks a generated trie (one step per char, no matter how many strings)
+ * and ignores case. Can be fed the incomming string in as many pieces as it arrives in.
+ *
+ * @param selecter
+ * @param buf
+ * @param buf_len
+ * @return int The string id if everything so far matches a whole string, BL_STR_NO_MATCH_YET
+ *             if it's the start of one, or BL_STR_NO_MATCH
+ */
+int bl_trie_select(bl_trie_selecter* selecter, const char* buf, int buf_len);
+
+static inline void bl_trie_reset(bl_trie_selecter* selecter, const bl_trie* trie) {
+    selecter->trie = trie;
+    selecter->state = 0;
+}
+
+/**
+ * @brief Decoder state between calls. Zero it before the first one.
+ */
 typedef struct base64_ctx_ {
+    // <2 bit number of chars><6 unused bits><24 bits of chars so far>
     uint32_t partial;
 } base64_ctx;
 
+/**
+ * @brief Decodes base64 as it comes in. Anything that is not base64 (like line breaks) is skipped.
+ *
+ * @param ctx Left over chars are kept here until the next call
+ * @param base64_buf
+ * @param output_buf Room for base64_len * 3 / 4 + 3 bytes
+ * @param base64_len
+ * @param end Non zero if this is the last of it. Needed if the input is not padded.
+ * @return int Number of bytes written to output_buf
+ */
 int decode_base64(base64_ctx* ctx, char* base64_buf, char* output_buf, int base64_len, char end);
 
-int encode_base64(char* base64_buf, char* input_buf, int input_len);
+/**
+ * @brief Encoder state between calls. Zero it before the first one.
+ */
+typedef struct base64_enc_ctx_ {
+    uint8_t partial[3];
+    uint8_t partial_len;
+} base64_enc_ctx;
+
+/**
+ * @brief Encodes whole groups of 3 bytes, the rest is kept for the next call.
+ *
+ * @param ctx
+ * @param base64_buf Room for (input_len + 2) / 3 * 4 chars
+ * @param input_buf
+ * @param input_len
+ * @return int Number of chars written (not null terminated)
+ */
+int encode_base64_update(base64_enc_ctx* ctx, char* base64_buf, const char* input_buf, int input_len);
+
+/**
+ * @brief Encodes what is left over with padding.
+ *
+ * @return int Number of chars written, 0 or 4
+ */
+int encode_base64_final(base64_enc_ctx* ctx, char* base64_buf);
+
+/**
+ * @brief One shot encode.
+ *
+ * @return int Number of chars written (not null terminated)
+ */
+int encode_base64(char* base64_buf, const char* input_buf, int input_len);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,18 @@
+# embed_bytes(file out_var len_var): hex dumps a file into a C array body, 16 bytes a line.
+# Shared by embed_page.cmake and embed_tls.cmake.
+
+set(line_pattern "")
+foreach(i RANGE 15)
+    string(APPEND line_pattern "0x[0-9a-f][0-9a-f],")
+endforeach()
+
+function(embed_bytes file out_var len_var)
+    file(READ ${file} hex HEX)
+    string(LENGTH "${hex}" hex_len)
+    math(EXPR len "${hex_len} / 2")
+    string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," bytes "${hex}")
+    string(REGEX REPLACE "(${line_pattern})" "\\1\n    " bytes "${bytes}")
+    set(${out_var} "    ${bytes}" PARENT_SCOPE)
+    set(${len_var} ${len} PARENT_SCOPE)
+endfunction()
+
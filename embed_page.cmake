@@ -0,0 +1,81 @@
+# Turns a static page into a C header with complete, ready to send HTTP responses.
+# Run by the build (see CMakeLists.txt):
+#   cmake -DPAGE=index.html -DPAGE_GZ=index.html.gz -DNAME=index_html -DCONTENT_TYPE=text/html -DOUT=index_html.h -P embed_page.cmake
+#
+# For NAME it defines:
+#   NAME[], NAME_gz[]                           Page bodies, plain and gzip'd
+#   NAME_response[], NAME_gz_response[]         200 header blocks (Content-Length, ETag, ...) for each
+#   NAME_not_modified[], NAME_gz_not_modified[] 304 responses
+#   NAME_ETAG, NAME_GZ_ETAG (upper case)        Quoted ETags to match If-None-Match against
+
+foreach(var PAGE PAGE_GZ NAME CONTENT_TYPE OUT)
+    if(NOT DEFINED ${var})
+        message(FATAL_ERROR "embed_page.cmake: ${var} is not set")
+    endif()
+endforeach()
+
+string(TOUPPER ${NAME} NAME_UPPER)
+
+include(${CMAKE_CURRENT_LIST_DIR}/embed_bytes.cmake)
+
+embed_bytes(${PAGE} PAGE_BYTES PAGE_LEN)
+embed_bytes(${PAGE_GZ} GZ_BYTES GZ_LEN)
+
+# The ETag follows the content. Each encoding gets its own, they are different bytes.
+file(SHA1 ${PAGE} page_sha1)
+string(SUBSTRING ${page_sha1} 0 16 ETAG)
+
+# no-cache: the browser may keep the page, but has to ask (If-None-Match) before using it.
+string(CONFIGURE [=[
+// Generated by embed_page.cmake from @PAGE@. Do not edit.
+#ifndef @NAME_UPPER@_H
+#define @NAME_UPPER@_H
+
+#define @NAME_UPPER@_ETAG "\"@ETAG@\""
+#define @NAME_UPPER@_GZ_ETAG "\"@ETAG@-gz\""
+
+const unsigned char @NAME@[@PAGE_LEN@] = {
+@PAGE_BYTES@
+};
+
+const unsigned char @NAME@_gz[@GZ_LEN@] = {
+@GZ_BYTES@
+};
+
+const char @NAME@_response[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: @CONTENT_TYPE@; charset=UTF-8\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "ETag: \"@ETAG@\"\r\n"
+    "Content-Length: @PAGE_LEN@\r\n"
+    "\r\n";
+
+const char @NAME@_gz_response[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: @CONTENT_TYPE@; charset=UTF-8\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "Content-Encoding: gzip\r\n"
+    "ETag: \"@ETAG@-gz\"\r\n"
+    "Content-Length: @GZ_LEN@\r\n"
+    "\r\n";
+
+const char @NAME@_not_modified[] =
+    "HTTP/1.1 304 Not Modified\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "ETag: \"@ETAG@\"\r\n"
+    "\r\n";
+
+const char @NAME@_gz_not_modified[] =
+    "HTTP/1.1 304 Not Modified\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "ETag: \"@ETAG@-gz\"\r\n"
+    "\r\n";
+
+#endif
+]=] header @ONLY)
+
+file(WRITE ${OUT} "${header}")
@@ -0,0 +1,37 @@
+# Embeds the wss:// certificate and it's key (PEM) as a C header.
+# Run by the build when the WS_TLS option is on (see CMakeLists.txt):
+#   cmake -DCERT=cert.pem -DKEY=key.pem -DOUT=tls_credentials.h -P embed_tls.cmake
+#
+# Defines ws_tls_cert[] and ws_tls_key[]. Both are null terminated, mbedtls wants that for PEM
+# (and counts the null in the length).
+
+foreach(var CERT KEY OUT)
+    if(NOT DEFINED ${var})
+        message(FATAL_ERROR "embed_tls.cmake: ${var} is not set")
+    endif()
+endforeach()
+
+include(${CMAKE_CURRENT_LIST_DIR}/embed_bytes.cmake)
+
+embed_bytes(${CERT} CERT_BYTES CERT_LEN)
+embed_bytes(${KEY} KEY_BYTES KEY_LEN)
+math(EXPR CERT_LEN "${CERT_LEN} + 1")
+math(EXPR KEY_LEN "${KEY_LEN} + 1")
+
+string(CONFIGURE [=[
+// Generated by embed_tls.cmake from @CERT@ and @KEY@. Do not edit.
+#ifndef TLS_CREDENTIALS_H
+#define TLS_CREDENTIALS_H
+
+const unsigned char ws_tls_cert[@CERT_LEN@] = {
+@CERT_BYTES@0x00
+};
+
+const unsigned char ws_tls_key[@KEY_LEN@] = {
+@KEY_BYTES@0x00
+};
+
+#endif
+]=] header @ONLY)
+
+file(WRITE ${OUT} "${header}")
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""Generates a bl_trie (see bufferless_str.h) from a list of strings.
+
+    gen_bl_trie.py <list.txt> <out.h> <name> <PREFIX>
+
+Each non-comment line of list.txt gets <PREFIX><LINE> (upper case, '-' -> '_') as its id.
+The trie is lower case, bl_trie_select() folds the input to match.
+"""
+import re
+import sys
+
+
+def main():
+    if len(sys.argv) != 5:
+        sys.exit(__doc__)
+    src, out, name, prefix = sys.argv[1:]
+
+    words = []
+    with open(src) as f:
+        for line in f:
+            line = line.strip()
+            if line and not line.startswith('#'):
+                words.append(line)
+
+    # Build the trie. State 0 is the root.
+    edges = [{}]   # state -> {char: next state}
+    accept = [-1]  # state -> word id or -1
+    for word_id, word in enumerate(words):
+        state = 0
+        for c in word.lower():
+            if c not in edges[state]:
+                edges.append({})
+                accept.append(-1)
+                edges[state][c] = len(edges) - 1
+            state = edges[state][c]
+        if accept[state] != -1:
+            sys.exit('duplicate: ' + word)
+        accept[state] = word_id
+
+    if len(edges) >= 255:  # 255 is BL_TRIE_DEAD
+        sys.exit('too many states for uint8_t, %d' % len(edges))
+
+    # Flatten. Each state's edges are contiguous, sorted by char.
+    first_edge, edge_count, edge_chars, edge_next = [], [], [], []
+    for state_edges in edges:
+        first_edge.append(len(edge_chars))
+        edge_count.append(len(state_edges))
+        for c in sorted(state_edges):
+            edge_chars.append(c)
+            edge_next.append(state_edges[c])
+
+    def c_array(values, fmt=str, per_line=16):
+        lines = []
+        for i in range(0, len(values), per_line):
+            lines.append('    ' + ', '.join(fmt(v) for v in values[i:i + per_line]) + ',')
+        return '\n'.join(lines)
+
+    guard = re.sub(r'\W', '_', out.split('/')[-1]).upper()
+    ids = ['#define %s%s %d' % (prefix, re.sub(r'\W', '_', w).upper(), i) for i, w in enumerate(words)]
+
+    with open(out, 'w') as f:
+        f.write('''// Generated by gen_bl_trie.py from {src}. Do not edit.
+#ifndef {guard}
+#define {guard}
+
+#include "bufferless_str.h"
+
+{ids}
+
+#define {prefix}COUNT {count}
+
+static const uint16_t {name}_first_edge[] = {{
+{first_edge}
+}};
+static const uint8_t {name}_edge_count[] = {{
+{edge_count}
+}};
+static const char {name}_edge_chars[] = {{
+{edge_chars}
+}};
+static const uint8_t {name}_edge_next[] = {{
+{edge_next}
+}};
+static const int8_t {name}_accept[] = {{
+{accept}
+}};
+
+static const bl_trie {name} = {{
+    .first_edge = {name}_first_edge,
+    .edge_count = {name}_edge_count,
+    .edge_chars = {name}_edge_chars,
+    .edge_next  = {name}_edge_next,
+    .accept     = {name}_accept,
+}};
+
+#endif
+'''.format(src=src.split('/')[-1], guard=guard, ids='\n'.join(ids), prefix=prefix, count=len(words), name=name,
+           first_edge=c_array(first_edge), edge_count=c_array(edge_count),
+           edge_chars=c_array(edge_chars, lambda c: repr(c) if c != "'" else "'\\''"),
+           edge_next=c_array(edge_next), accept=c_array(accept)))
+
+
+if __name__ == '__main__':
+    main()
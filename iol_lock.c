@@ -1,13 +1,19 @@
-
 #include "iol_lock.h"
 
 #include "pico/stdlib.h"
 #include "pico/mutex.h"
+#include "pico/critical_section.h"
+#include "hardware/sync.h"
 
 // As mutex resources are limited, just have one global mutex to protect the
 // lock/unlock mechanisms from multi-core and/or interrupt speggetti.
 mutex_t global_core_lock;
 
+// The run queue gets pushed to from interrupts, so a mutex won't do.
+critical_section_t run_queue_lock;
+iol_lock_obj* run_queue_head;
+iol_lock_obj* run_queue_tail;
+
 /**
  * @brief Just an ugly global init function for global variables of horable globalness
  *
@@ -16,13 +22,19 @@ mutex_t global_core_lock;
 int iol_init() {
     // no mutex_free function exists yet. Kinda odd, but o well.
     mutex_init(&global_core_lock);
+    critical_section_init(&run_queue_lock);
+    run_queue_head = run_queue_tail = NULL;
     return 0;
 }
 
 void iol_unlock(iol_lock_obj* lock) {
     // We should be safe as this function only gets called when the task has ended
     // Aka, a locked context basically.
+    critical_section_enter_blocking(&run_queue_lock);
+    // Whatever came in while the task ran is only kept if it is waiting for it now.
+    lock->pending &= lock->waiting_reasons;
     lock->locked = false;
+    critical_section_exit(&run_queue_lock);
 }
 
 bool iol_trylock(iol_lock_obj* lock) {
@@ -36,87 +48,188 @@ bool iol_trylock(iol_lock_obj* lock) {
     return locked;
 }
 
-void iol_continue(iol_lock_obj* lock) {
-    while (true) {
+/**
+ * @brief Puts the lock at the end of the run queue, unless it is already on it.
+ */
+void iol_enqueue(iol_lock_obj* lock) {
+    critical_section_enter_blocking(&run_queue_lock);
+    if (!lock->queued) {
+        lock->queued = true;
+        lock->next_ready = NULL;
+        if (run_queue_tail) {
+            run_queue_tail->next_ready = lock;
+        } else {
+            run_queue_head = lock;
+        }
+        run_queue_tail = lock;
+    }
+    critical_section_exit(&run_queue_lock);
 
-        if (!iol_trylock(lock)) {
-            // did not aquire the lock. The task is still running and
-            // will do a reason check by its self when its ready.
-            break;
+    // Wake up the main loop if it is waiting for work.
+    __sev();
+}
+
+iol_lock_obj* iol_dequeue() {
+    critical_section_enter_blocking(&run_queue_lock);
+    iol_lock_obj* lock = run_queue_head;
+    if (lock) {
+        run_queue_head = lock->next_ready;
+        if (!run_queue_head) {
+            run_queue_tail = NULL;
         }
+        lock->next_ready = NULL;
+        lock->queued = false;
+    }
+    critical_section_exit(&run_queue_lock);
+    return lock;
+}
+
+bool iol_has_ready() {
+    return run_queue_head != NULL;
+}
+
+/**
+ * @brief Collects the reasons the task is waiting for that have happened (events or state).
+ * Pending events that get collected are cleared.
+ */
+size_t iol_take_fired(iol_lock_obj* lock) {
+    size_t waiting = lock->waiting_reasons;
+    size_t fired = lock->check_reason(lock->user_obj, waiting, lock->active_err) & waiting;
+
+    critical_section_enter_blocking(&run_queue_lock);
+    fired |= lock->pending & waiting;
+    lock->pending &= ~waiting;
+    critical_section_exit(&run_queue_lock);
+
+    return fired;
+}
+
+/**
+ * @brief Checks if the task has a reason to continue without consuming anything.
+ */
+bool iol_is_ready(iol_lock_obj* lock) {
+    size_t waiting = lock->waiting_reasons;
+    if (waiting == IOL_YIELD_REASON_END) {
+        return false; // ya, don't continue if we ended. That would cause a crash.
+    }
+    return lock->active_err
+        || (lock->pending & waiting)
+        || (lock->check_reason(lock->user_obj, waiting, lock->active_err) & waiting);
+}
+
+/**
+ * @brief Runs or continues the task once, if it is (still) ready.
+ *
+ * @return true if the task ran
+ */
+bool iol_continue(iol_lock_obj* lock) {
+    if (!iol_trylock(lock)) {
+        // did not aquire the lock. The task is still running and
+        // will do a reason check by its self when its ready.
+        return false;
+    }
+
+    if (lock->waiting_reasons == IOL_YIELD_REASON_START) {
+        lock->fired = 0;
+        lock->waiting_reasons = sub_task_run(lock->waiting_task, lock->task_function, lock->args);
 
+    } else if (lock->waiting_reasons != IOL_YIELD_REASON_END
+            && ((lock->fired = iol_take_fired(lock)) || lock->active_err)) {
         size_t err = lock->active_err;
         // lock->active_err = 0; // TODO: Maybe some types of errors should auto-clear? More specifig handling.
-        lock->waiting_reason = sub_task_continue(lock->waiting_task, (void*) err);
+        lock->waiting_reasons = sub_task_continue(lock->waiting_task, (void*) err);
 
+    } else {
+        // Spurious. Whatever we got notified for was already handled the last time the task ran.
         iol_unlock(lock);
+        return false;
+    }
+
+    iol_unlock(lock);
+
+    // Interrupts and other cores can now trigger notifications again.
+    // Check and handle any we might have missed while the task was running.
+    // Back of the line, so one busy task can't starve the others.
+    if (iol_is_ready(lock)) {
+        iol_enqueue(lock);
+    }
+    return true;
+}
+
+int iol_run_ready() {
+    int runs = 0;
+    iol_lock_obj* lock;
 
-        // Interrupts and other cores can now trigger notifications again.
-        // Check and handle any we might have missed while locked.
+    // Only drain what is on the queue right now. Tasks that get re-queued will run the next time around.
+    iol_lock_obj* last = run_queue_tail;
 
-        if (!lock->check_reason(lock->user_obj, lock->waiting_reason, lock->active_err)) {
-            // Still waiting for a valid reason to resume or the task has ended.
+    while (last && (lock = iol_dequeue())) {
+        runs += iol_continue(lock);
+        if (lock == last) {
             break;
         }
     }
+    return runs;
 }
 
 /**
- * @brief Tries to continue a task if it was waiting for the specified reason to continue.
+ * @brief Records the reasons and marks the task as ready if it was waiting for any of them.
+ * Safe to call from interrupts (lwIP callbacks). The task does not run until iol_run_ready() is called.
  *
  * @param lock
- * @param reason The task might be waiting for this reason
- * @return true
- * @return false
+ * @param reasons One or more reasons (bits) that happened
+ * @param err An error that any waiting task should see, or 0
+ * @return int 0 if the task was queued (or already was), non zero if it was not waiting for any of reasons
  */
-int iol_notify(iol_lock_obj* lock, size_t reason, size_t err) {
-    if (lock->waiting_reason != reason) {
-        return 1;
-    }
-
+int iol_notify(iol_lock_obj* lock, size_t reasons, size_t err) {
+    critical_section_enter_blocking(&run_queue_lock);
+    // A running task may be about to wait for any of them, iol_unlock() drops what it doesn't.
+    // A waiting one only keeps what it waits for, a stale one would end some later wait for nothing.
+    lock->pending |= lock->locked ? reasons : reasons & lock->waiting_reasons;
     if (err) {
         lock->active_err = err;
     }
+    critical_section_exit(&run_queue_lock);
 
-    iol_continue(lock);
+    size_t waiting = lock->waiting_reasons;
+    if (waiting == IOL_YIELD_REASON_END || waiting == IOL_YIELD_REASON_START || !(waiting & reasons)) {
+        return 1;
+    }
+
+    iol_enqueue(lock);
+    return 0;
 }
 
 /**
- * @brief Initialize the lock object and run the task with args
+ * @brief Initialize the lock object and queue the task to be run with args by iol_run_ready()
  *
  * @param lock
  * @return int
  */
 int iol_task_run(
         iol_lock_obj* lock,
-        bool (*check_reason)(void* user_obj, size_t reason, size_t err),
+        size_t (*check_reason)(void* user_obj, size_t reasons, size_t err),
         void* user_obj,
         sub_task* task, size_t (*task_function)(sub_task*, void*),
         void* args) {
 
+    if (lock->locked || lock->queued) {
+        // This should not happen. Something is very wrong.
+        return 1;
+    }
+
     lock->waiting_task = task;
     lock->user_obj = user_obj;
     lock->check_reason = check_reason;
-    lock->waiting_reason = 0;
+    lock->task_function = task_function;
+    lock->args = args;
+    lock->waiting_reasons = IOL_YIELD_REASON_START;
+    lock->pending = 0;
+    lock->fired = 0;
     lock->active_err = 0;
     lock->locked = false;
 
-    if (!iol_trylock(lock)) {
-        // This should not happen. Something is very wrong.
-        return 1;
-    }
-
-    lock->waiting_reason = sub_task_run(task, task_function, args);
-
-    iol_unlock(lock);
-
-    // Interrupts and other cores can now trigger notifications again.
-    // Check and handle any we might have missed while locked.
-
-    if (lock->check_reason(lock->user_obj, lock->waiting_reason, lock->active_err)) {
-        // An interrupt must have came in just as the task was finishing.
-        iol_continue(lock);
-    }
+    iol_enqueue(lock);
 
     return 0;
 }
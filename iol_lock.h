@@ -5,17 +5,38 @@
 #include <stdbool.h>
 #include "sub_task.h"
 
+// Reasons are bits, so a task can yield for any of several at once (READ | WAIT_FOR_ACK for example)
+// and find out which ones fired with iol_fired().
+#define IOL_REASON(bit) ((size_t) 1 << (bit))
+
+// Waiting for nothing, aka the task ended.
 #define IOL_YIELD_REASON_END 0
+// Not a real reason. The task is queued, but task_function has not been called yet.
+#define IOL_YIELD_REASON_START ((size_t) -1)
 
 typedef struct iol_lock_obj_t {
     // The task that is waiting to process an I/O operation
     sub_task* waiting_task;
     void* user_obj;
 
-    bool (*check_reason)(void* user_obj, size_t reason, size_t err);
+    // Only used for the first run
+    size_t (*task_function)(sub_task*, void*);
+    void* args;
+
+    // Returns which of the reasons are satisfied by the current state of user_obj (level triggered).
+    // Reasons that are only ever events (edge triggered) don't need to be handled here, see pending.
+    size_t (*check_reason)(void* user_obj, size_t reasons, size_t err);
+
+    // What is the task waiting for? Any of these reasons.
+    size_t waiting_reasons;
 
-    // What is the task waiting for?
-    size_t waiting_reason;
+    // Reasons that were notified, but not yet handed to the task. Notifications that come in
+    // while the task is running are remembered here instead of being lost, as long as the task
+    // then waits for them. Only waiting_reasons are kept otherwise.
+    size_t pending;
+
+    // The reasons the task was continued for. Valid after the task resumes.
+    size_t fired;
 
     // TODO: FIXME: active_err only stores the last error
     size_t active_err;
@@ -24,8 +45,33 @@ typedef struct iol_lock_obj_t {
     // This would result in upside-down-world! Don't go to upside-down-world;
     // don't continue an already running task.
     bool locked;
+
+    // Run queue. Notifications only put the lock on the queue, iol_run_ready() runs it.
+    // queued is set while the lock is on the queue so that many notifications only run the task once.
+    struct iol_lock_obj_t* next_ready;
+    bool queued;
 } iol_lock_obj;
 
+/**
+ * @brief Checks if the task has ended (or never ran) and its stack is no longer in use.
+ * A zeroed lock object counts as done.
+ *
+ * @param lock
+ * @return true The task returned IOL_YIELD_REASON_END and is not running.
+ * @return false The task is running or waiting for a reason to continue.
+ */
+static inline bool iol_task_done(iol_lock_obj* lock) {
+    return !lock->locked && !lock->queued && lock->waiting_reasons == IOL_YIELD_REASON_END;
+}
+
+/**
+ * @brief Which of the reasons the task yielded for caused it to continue.
+ * Call it from the task right after it resumes.
+ */
+static inline size_t iol_fired(iol_lock_obj* lock) {
+    return lock->fired;
+}
+
 /**
  * @brief Just an ugly global init function for global variables of horable globalness
  *
@@ -34,24 +80,38 @@ typedef struct iol_lock_obj_t {
 int iol_init();
 
 /**
- * @brief Tries to continue a task if it was waiting for the specified reason to continue.
+ * @brief Records the reasons and marks the task as ready if it was waiting for any of them.
+ * Safe to call from interrupts (lwIP callbacks). The task does not run until iol_run_ready() is called.
  *
  * @param lock
- * @param reason The task might be waiting for this reason
- * @return true
- * @return false
+ * @param reasons One or more reasons (bits) that happened
+ * @param err An error that any waiting task should see, or 0
+ * @return int 0 if the task was queued (or already was), non zero if it was not waiting for any of reasons
+ */
+int iol_notify(iol_lock_obj* lock, size_t reasons, size_t err);
+
+/**
+ * @brief Runs every task on the run queue until it yields. Call it from thread mode (main loop).
+ * Tasks that turn out not to be ready anymore (check_reason) are skipped.
+ *
+ * @return int Number of times a task was run or continued
+ */
+int iol_run_ready();
+
+/**
+ * @brief Checks if any task is waiting on the run queue.
  */
-int iol_notify(iol_lock_obj* lock, size_t reason, size_t err);
+bool iol_has_ready();
 
 /**
- * @brief Initialize the lock object and run the task with args
+ * @brief Initialize the lock object and queue the task to be run with args by iol_run_ready()
  *
  * @param lock
  * @return int
  */
 int iol_task_run(
         iol_lock_obj* lock,
-        bool (*check_reason)(void* user_obj, size_t reason, size_t err),
+        size_t (*check_reason)(void* user_obj, size_t reasons, size_t err),
         void* user_obj,
         sub_task* task, size_t (*task_function)(sub_task*, void*),
         void* args);
@@ -0,0 +1,104 @@
+#include "iol_timer.h"
+
+#include "pico/stdlib.h"
+
+static_assert((IOL_TIMER_WHEEL_SLOTS & (IOL_TIMER_WHEEL_SLOTS - 1)) == 0, "Wheel slots must be a power of two");
+
+// Hashed timer wheel. Timers go in the slot of their deadline tick modulo the number of slots.
+iol_timer* wheel[IOL_TIMER_WHEEL_SLOTS];
+// The next tick to be processed.
+uint32_t wheel_tick;
+int wheel_armed;
+
+static inline uint32_t iol_timer_tick_of(absolute_time_t time) {
+    // Rounded down. Wraps after 2^32 ticks, so comparisons must use (int32_t) differences.
+    return to_us_since_boot(time) / (IOL_TIMER_TICK_MS * 1000);
+}
+
+int iol_timer_init_wheel() {
+    for (int i = 0; i < IOL_TIMER_WHEEL_SLOTS; i++) {
+        wheel[i] = NULL;
+    }
+    wheel_tick = iol_timer_tick_of(get_absolute_time());
+    wheel_armed = 0;
+    return 0;
+}
+
+void iol_timer_cancel(iol_timer* timer) {
+    if (!iol_timer_armed(timer)) {
+        return;
+    }
+    *timer->prev_next = timer->next;
+    if (timer->next) {
+        timer->next->prev_next = timer->prev_next;
+    }
+    timer->next = NULL;
+    timer->prev_next = NULL;
+    wheel_armed--;
+}
+
+void iol_timer_set(iol_timer* timer, absolute_time_t deadline) {
+    iol_timer_cancel(timer);
+
+    // Round up so we never fire early.
+    uint32_t tick = iol_timer_tick_of(delayed_by_us(deadline, IOL_TIMER_TICK_MS * 1000 - 1));
+    if ((int32_t) (tick - wheel_tick) < 0) {
+        tick = wheel_tick; // Already passed. Fire on the next advance.
+    }
+    timer->deadline_tick = tick;
+
+    iol_timer** slot = &wheel[tick & (IOL_TIMER_WHEEL_SLOTS - 1)];
+    timer->next = *slot;
+    if (timer->next) {
+        timer->next->prev_next = &timer->next;
+    }
+    timer->prev_next = slot;
+    *slot = timer;
+    wheel_armed++;
+}
+
+int iol_timer_advance(absolute_time_t now) {
+    uint32_t now_tick = iol_timer_tick_of(now);
+    int fired = 0;
+
+    if ((int32_t) (now_tick - wheel_tick) >= IOL_TIMER_WHEEL_SLOTS) {
+        // We fell a whole lap (or more) behind. One lap visits every slot, which is all we need.
+        wheel_tick = now_tick - (IOL_TIMER_WHEEL_SLOTS - 1);
+    }
+
+    for (; (int32_t) (now_tick - wheel_tick) >= 0; wheel_tick++) {
+        if (!wheel_armed) {
+            wheel_tick = now_tick + 1;
+            break;
+        }
+
+        iol_timer* timer = wheel[wheel_tick & (IOL_TIMER_WHEEL_SLOTS - 1)];
+        while (timer) {
+            iol_timer* next = timer->next;
+
+            // Timers from a later lap share the slot, leave them be.
+            if ((int32_t) (timer->deadline_tick - now_tick) <= 0) {
+                iol_timer_cancel(timer);
+                iol_notify(timer->lock, IOL_YIELD_REASON_TIMER, 0);
+                fired++;
+            }
+            timer = next;
+        }
+    }
+
+    return fired;
+}
+
+absolute_time_t iol_timer_next_tick() {
+    if (!wheel_armed) {
+        return at_the_end_of_time;
+    }
+
+    absolute_time_t now = get_absolute_time();
+    if ((int32_t) (wheel_tick - iol_timer_tick_of(now)) <= 0) {
+        return now; // Overdue
+    }
+    // The start of the next tick
+    uint64_t tick_us = IOL_TIMER_TICK_MS * 1000;
+    return from_us_since_boot((to_us_since_boot(now) / tick_us + 1) * tick_us);
+}
@@ -0,0 +1,89 @@
+#ifndef IOL_TIMER_H
+#define IOL_TIMER_H
+
+#include <stdbool.h>
+#include "pico/time.h"
+#include "iol_lock.h"
+
+// Tasks can wait for it along with their own reasons to get a timeout.
+// Bit 30 whatever size_t is, so a mask of fired reasons still fits in a (positive) int. Counting
+// down from the top of size_t put it at bit 62 on 64 bit hosts, where the int lost it.
+#define IOL_YIELD_REASON_TIMER IOL_REASON(30)
+
+// Timer resolution. Deadlines are rounded up to the next tick.
+#define IOL_TIMER_TICK_MS 10
+// Must be a power of two. Timers further out than IOL_TIMER_WHEEL_SLOTS ticks just
+// get looked at (and skipped) once per lap around the wheel.
+#define IOL_TIMER_WHEEL_SLOTS 64
+
+/**
+ * @brief A deadline that notifies a lock with IOL_YIELD_REASON_TIMER once it passes.
+ * Timers are not thread safe. Set, cancel and advance them all from the same context (the main loop).
+ */
+typedef struct iol_timer_ {
+    // Doubly linked list in a wheel slot. prev_next is NULL when the timer is not armed.
+    struct iol_timer_* next;
+    struct iol_timer_** prev_next;
+
+    uint32_t deadline_tick;
+    iol_lock_obj* lock;
+} iol_timer;
+
+/**
+ * @brief Just an ugly global init function for the timer wheel.
+ *
+ * @return int non zero if stuff didn't work
+ */
+int iol_timer_init_wheel();
+
+static inline void iol_timer_init(iol_timer* timer, iol_lock_obj* lock) {
+    timer->next = NULL;
+    timer->prev_next = NULL;
+    timer->deadline_tick = 0;
+    timer->lock = lock;
+}
+
+static inline bool iol_timer_armed(iol_timer* timer) {
+    return timer->prev_next != NULL;
+}
+
+/**
+ * @brief Arms (or re-arms) the timer. A deadline in the past fires on the next iol_timer_advance().
+ *
+ * @param timer
+ * @param deadline
+ */
+void iol_timer_set(iol_timer* timer, absolute_time_t deadline);
+
+void iol_timer_cancel(iol_timer* timer);
+
+/**
+ * @brief Turns the wheel up to now and notifies the locks of every timer that expired.
+ * Call it from the main loop before iol_run_ready().
+ *
+ * @param now
+ * @return int The number of timers that fired
+ */
+int iol_timer_advance(absolute_time_t now);
+
+/**
+ * @brief When iol_timer_advance() should be called next.
+ *
+ * @return absolute_time_t The start of the next tick, or at_the_end_of_time if no timers are armed.
+ */
+absolute_time_t iol_timer_next_tick();
+
+/**
+ * @brief Yields until the deadline. Only for tasks run by the lock the timer belongs to.
+ *
+ * @return size_t 0 or an error that came in while sleeping
+ */
+static inline size_t iol_sleep_until(iol_timer* timer, absolute_time_t deadline) {
+    size_t err;
+    iol_timer_set(timer, deadline);
+    err = (size_t) sub_task_yield(IOL_YIELD_REASON_TIMER, timer->lock->waiting_task);
+    iol_timer_cancel(timer);
+    return err;
+}
+
+#endif
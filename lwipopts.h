@@ -49,6 +49,7 @@
 #define LWIP_DNS                    0
 #define LWIP_TCP_KEEPALIVE          1
 #define LWIP_NETIF_TX_SINGLE_PBUF   0 // no... no don't do that. We had a crash when doing large tcp_write
+#define LWIP_SUPPORT_CUSTOM_PBUF    1 // Decrypted TLS records are handed around as pbufs, but live on the C heap
 #define DHCP_DOES_ARP_CHECK         0
 #define LWIP_DHCP_DOES_ACD_CHECK    0
 
@@ -61,3 +61,8 @@
 #define MBEDTLS_ECDSA_C
 #define MBEDTLS_ASN1_WRITE_C
 
+/* wss:// server (ws_tls.c): PEM certificates and a session cache for resumption */
+#define MBEDTLS_PEM_PARSE_C
+#define MBEDTLS_BASE64_C
+#define MBEDTLS_SSL_CACHE_C
+
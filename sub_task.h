@@ -3,6 +3,7 @@
 #define SUB_TASK_H
 
 #include <stddef.h>
+#include <stdbool.h>
 
 typedef struct sub_task_ {
     void* stack_ptr;
@@ -36,13 +37,15 @@ typedef struct sub_task_ {
  * @brief Run or resume a subtask. It's like a thread. Use sub_task_yield to pause, pre-return data,
  * and have new data when resumed.
  *
- *  TODO: How TF does the caller know when the task is done!?!??!?!?
+ *  How TF does the caller know when the task is done!?!??!?!? -> sub_task_done()
  *        Had this crazy idea. What happens if it gets called anyway? Instead of sub_task_yield?
  *        Turns out it actually almost works! sub_task_yield's assembly was very much like sub_task_run.
  *        So I combined them and it even saves some bytes on the stack as everything resumes
  *        to the exact same location! Wow!
  *  TODO: Rename low level sub_task_run to sub_task_switch or something.
  *
+ *  sub_task.S is the RP2040's. sub_task_x86_64.S and sub_task_aarch64.S do the same on a Linux box (see bench/).
+ *
  * @param task
  * @param task_function task function pointer or null for resume
  * @param args Put data in here ...
@@ -70,15 +73,36 @@ static inline size_t sub_task_continue(sub_task* task, void* args) {
 }
 
 /**
- * @brief Checks the task's stack for a special trap that is placed when a task ends.
- * If this trap exists, then the task is reset.
+ * @brief Checks for the trap that sub_task_run parks in stack_ptr when a task ends.
+ *
+ * @return true If the task is done and the stack can be re-used
+ * @return false If the task did not finish (or was never run).
+ */
+static inline bool sub_task_done(sub_task* task) {
+    return task->stack_ptr == (void*) sub_task_trap;
+}
+
+/**
+ * @brief Puts the stack pointer back at the top of the stack, ready to run a new task.
+ * Only call this on a stack that is done or was never run.
+ *
+ * @param task
+ * @param size Total size of the stack, including the sub_task header. Same as the SUB_TASK_* macros.
+ */
+static inline void sub_task_init(sub_task* task, size_t size) {
+    task->stack_ptr = (void*) task + size;
+}
+
+/**
+ * @brief Resets the task if it is done.
  *
+ * @param size Total size of the stack, including the sub_task header.
  * @return true If the task was done and has been reset
  * @return false If the task did not finish.
  */
-static inline bool sub_task_reset(sub_task* task) {
-    if (*((void (**)()) task->stack_ptr) == sub_task_trap) {
-        task->stack_ptr = (void (**)()) task->stack_ptr + 1;
+static inline bool sub_task_reset(sub_task* task, size_t size) {
+    if (sub_task_done(task)) {
+        sub_task_init(task, size);
         return true;
     }
     return false;
@@ -0,0 +1,131 @@
+#include "sub_task_pool.h"
+
+#include "pico/stdlib.h"
+
+static inline sub_task* sub_task_pool_block(sub_task_pool* pool, size_t index) {
+    return (sub_task*) ((uint8_t*) pool->blocks + index * pool->block_size);
+}
+
+static inline size_t sub_task_pool_stack_len(sub_task_pool* pool) {
+    return pool->block_size - sizeof(sub_task);
+}
+
+/**
+ * @brief Finds the pool and index that owns the stack.
+ *
+ * @return int Block index or -1 if the stack is not from this pool.
+ */
+static int sub_task_pool_index_of(sub_task_pool* pool, sub_task* task) {
+    uint8_t* start = (uint8_t*) pool->blocks;
+    if ((uint8_t*) task < start || (uint8_t*) task >= start + pool->count * pool->block_size) {
+        return -1;
+    }
+    return ((uint8_t*) task - start) / pool->block_size;
+}
+
+static void sub_task_pool_paint(uint32_t* from, size_t words) {
+    for (size_t i = 0; i < words; i++) {
+        from[i] = SUB_TASK_POOL_PAINT;
+    }
+}
+
+void sub_task_pool_init(sub_task_pool* pool) {
+    pool->in_use = 0;
+    pool->peak_high_water = 0;
+    pool->overflows = 0;
+
+    for (size_t i = 0; i < pool->count; i++) {
+        sub_task* task = sub_task_pool_block(pool, i);
+        sub_task_pool_paint((uint32_t*) task->stack, sub_task_pool_stack_len(pool) / sizeof(uint32_t));
+        sub_task_init(task, pool->block_size);
+    }
+}
+
+size_t sub_task_pool_high_water(sub_task_pool* pool, sub_task* task) {
+    // Stacks grow down. Count the paint that is left from the bottom up.
+    uint32_t* stack = (uint32_t*) task->stack;
+    size_t words = sub_task_pool_stack_len(pool) / sizeof(uint32_t);
+    size_t untouched = 0;
+
+    while (untouched < words && stack[untouched] == SUB_TASK_POOL_PAINT) {
+        untouched++;
+    }
+    return (words - untouched) * sizeof(uint32_t);
+}
+
+sub_task* sub_task_pool_alloc(sub_task_pool* pools, int pools_len, size_t stack_size) {
+    for (int p = 0; p < pools_len; p++) {
+        sub_task_pool* pool = &pools[p];
+
+        if (sub_task_pool_stack_len(pool) < stack_size) {
+            continue; // too small
+        }
+
+        for (size_t i = 0; i < pool->count; i++) {
+            if (!(pool->in_use & (1u << i))) {
+                pool->in_use |= 1u << i;
+
+                sub_task* task = sub_task_pool_block(pool, i);
+                sub_task_init(task, pool->block_size);
+                return task;
+            }
+        }
+        // All taken, try the next size class up.
+    }
+    return NULL;
+}
+
+int sub_task_pool_release(sub_task_pool* pools, int pools_len, sub_task* task) {
+    for (int p = 0; p < pools_len; p++) {
+        sub_task_pool* pool = &pools[p];
+        int i = sub_task_pool_index_of(pool, task);
+        if (i < 0) {
+            continue;
+        }
+
+        int used;
+        size_t high_water = sub_task_pool_high_water(pool, task);
+
+        if (sub_task_pool_overflowed(task)) {
+            printf("STACK OVERFLOW: %s[%d] used all %u bytes and then some\n",
+                pool->name, i, sub_task_pool_stack_len(pool));
+            pool->overflows++;
+            used = -1;
+        } else {
+            used = high_water;
+        }
+        pool->peak_high_water = MAX(pool->peak_high_water, high_water);
+
+        // Only the top part of the stack was used, no need to re-paint the rest.
+        sub_task_pool_paint(
+            (uint32_t*) (task->stack + sub_task_pool_stack_len(pool) - high_water),
+            high_water / sizeof(uint32_t));
+        sub_task_init(task, pool->block_size);
+
+        pool->in_use &= ~(1u << i);
+        return used;
+    }
+
+    printf("ERROR: Released a stack that is not from a pool\n");
+    return -1;
+}
+
+void sub_task_pool_print_stats(sub_task_pool* pools, int pools_len) {
+    for (int p = 0; p < pools_len; p++) {
+        sub_task_pool* pool = &pools[p];
+        int active = 0;
+
+        for (size_t i = 0; i < pool->count; i++) {
+            if (pool->in_use & (1u << i)) {
+                active++;
+                printf("  %s[%u] high water: %u/%u bytes\n", pool->name, i,
+                    sub_task_pool_high_water(pool, sub_task_pool_block(pool, i)),
+                    sub_task_pool_stack_len(pool));
+            }
+        }
+
+        printf("%s: %d/%u in use, peak high water %u/%u bytes, %u overflows\n",
+            pool->name, active, pool->count,
+            pool->peak_high_water, sub_task_pool_stack_len(pool), pool->overflows);
+    }
+}
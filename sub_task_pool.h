@@ -0,0 +1,128 @@
+#ifndef SUB_TASK_POOL_H
+#define SUB_TASK_POOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include "sub_task.h"
+
+// Every unused word of a pooled stack holds this. Whatever is not paint anymore has been touched.
+#define SUB_TASK_POOL_PAINT 0x5AC3A55Cu
+
+// The lowest words of a stack are never supposed to be touched. If they are, the task overflowed
+// (and probably scribbled on whatever is below, ie. the next stack in the pool).
+#define SUB_TASK_POOL_GUARD_WORDS 2
+
+// in_use is a bitmask
+#define SUB_TASK_POOL_MAX_COUNT 32
+
+/**
+ * @brief A size class of equally sized sub_task stacks.
+ */
+typedef struct sub_task_pool_ {
+    const char* name;
+
+    // Stack size of each block, including the sub_task header. Multiple of 8 to keep the stacks aligned.
+    size_t block_size;
+    size_t count;
+    uint32_t* blocks;
+
+    // bit i is set when blocks[i] is handed out
+    uint32_t in_use;
+
+    // Stats
+    size_t peak_high_water;
+    size_t overflows;
+} sub_task_pool;
+
+#define SUB_TASK_POOL_BLOCK_WORDS(size) \
+    (((size) + sizeof(sub_task) + 7) / 8 * 2)
+
+/**
+ * @brief Allocates the stacks of a size class in global memory, for use with SUB_TASK_POOL().
+ * size does not include the sub_task header.
+ */
+#define SUB_TASK_POOL_BLOCKS(pool_name, size, num) \
+    static_assert((num) <= SUB_TASK_POOL_MAX_COUNT, "Too many stacks in one pool"); \
+    uint32_t _pool_blocks_##pool_name[(num) * SUB_TASK_POOL_BLOCK_WORDS(size)] __attribute__((aligned(8)));
+
+/**
+ * @brief Initializer for a size class whose stacks came from SUB_TASK_POOL_BLOCKS(). Lets several
+ * size classes sit in one array, the way sub_task_pool_alloc() wants them:
+ *     SUB_TASK_POOL_BLOCKS(small, 512, 4);
+ *     SUB_TASK_POOL_BLOCKS(large, 4096, 1);
+ *     sub_task_pool pools[] = { SUB_TASK_POOL(small, 512, 4), SUB_TASK_POOL(large, 4096, 1) };
+ */
+#define SUB_TASK_POOL(pool_name, size, num) { \
+        .name = #pool_name, \
+        .block_size = SUB_TASK_POOL_BLOCK_WORDS(size) * sizeof(uint32_t), \
+        .count = (num), \
+        .blocks = _pool_blocks_##pool_name, \
+    }
+
+/**
+ * @brief Allocates a size class of count stacks in global memory. size does not include the sub_task header.
+ * sub_task_pool_init(&name) must be called before it's first use.
+ */
+#define SUB_TASK_POOL_GLOBAL(pool_name, size, num) \
+    SUB_TASK_POOL_BLOCKS(pool_name, size, num) \
+    sub_task_pool pool_name = SUB_TASK_POOL(pool_name, size, num);
+
+/**
+ * @brief Paints every stack in the pool and marks them all as free.
+ *
+ * @param pool
+ */
+void sub_task_pool_init(sub_task_pool* pool);
+
+/**
+ * @brief Grabs a stack from the smallest size class that is large enough and has a free block.
+ *
+ * @param pools Size classes, sorted from smallest to largest
+ * @param pools_len
+ * @param stack_size Minimum usable stack size in bytes
+ * @return sub_task* Ready to run or NULL if nothing fits
+ */
+sub_task* sub_task_pool_alloc(sub_task_pool* pools, int pools_len, size_t stack_size);
+
+/**
+ * @brief Returns a stack to its pool. The task must be done or never have been run.
+ * Checks for an overflow, records the high water mark and re-paints the part that was used.
+ *
+ * @param pools
+ * @param pools_len
+ * @param task
+ * @return int The number of stack bytes the task used, or a negative value if it overflowed
+ *             or the stack does not belong to the pools.
+ */
+int sub_task_pool_release(sub_task_pool* pools, int pools_len, sub_task* task);
+
+/**
+ * @brief How deep the stack has been used so far (in bytes). Can be called while the task is alive.
+ *
+ * @param pool The pool that owns the stack
+ * @param task
+ * @return size_t
+ */
+size_t sub_task_pool_high_water(sub_task_pool* pool, sub_task* task);
+
+/**
+ * @brief Checks the guard words at the bottom of the stack.
+ *
+ * @return true If the task has overflowed its stack
+ */
+static inline bool sub_task_pool_overflowed(sub_task* task) {
+    for (int i = 0; i < SUB_TASK_POOL_GUARD_WORDS; i++) {
+        if (((uint32_t*) task->stack)[i] != SUB_TASK_POOL_PAINT) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief printf's the usage of each size class.
+ */
+void sub_task_pool_print_stats(sub_task_pool* pools, int pools_len);
+
+#endif
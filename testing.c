@@ -8,12 +8,20 @@
 
 #include "lwip/pbuf.h"
 #include "lwip/tcp.h"
+#include "lwip/memp.h"
+#include "lwip/stats.h"
 
 #include "bufferless_str.h"
 #include "sub_task.h"
+#include "sub_task_pool.h"
 #include "iol_lock.h"
+#include "iol_timer.h"
+#include "ws_mask.h"
+#include "ws_handshake.h"
+#include "ws_tls.h"
+#include "ws_stats.h"
+#include "ws_trace.h"
 
-#include "mbedtls/sha1.h"
 
 #define DEBUG_printf printf
 
@@ -43,21 +51,74 @@ const char wifi_ssid[] = "placeholder";
 const char wifi_password[] = "placeholder";
 #define TCP_PORT 8080
 
-// TODO: Support multiple connections
-SUB_TASK_GLOBAL(task_ws_header, 1020);
+// Number of clients that can be served at the same time. Each one gets its own task stack.
+#define WS_MAX_CONNECTIONS 4
+// Check the high water marks ('s' command) before shrinking this.
+#define WS_CLI_CON_STACK_SIZE 1020
+// Drop clients that leave us waiting for the rest of a request (or frame) for this long. 0 = never.
+#define WS_READ_TIMEOUT_MS 10000
+// Persistent HTTP connections are closed after waiting this long for the next request.
+#define WS_HTTP_KEEP_ALIVE_TIMEOUT_MS 5000
+// Trace records the main loop prints each time around, so a burst does not hold up the tasks.
+#define WS_TRACE_DRAIN_PER_LOOP 16
+// How often the sensor value is pushed to websocket clients.
+#define WS_PUSH_INTERVAL_MS 50
+// ADC samples in each pushed sensor message. The page averages them.
+#define WS_SENSOR_SAMPLES 4
+// Take permessage-deflate when a client offers it. Window sizes are in ws_deflate.h.
+#define WS_USE_DEFLATE true
+
+// Serve wss:// (https://) on WS_TLS_PORT too. Set by the WS_TLS cmake option, which embeds the certificate.
+#ifndef WS_TLS
+#define WS_TLS 0
+#endif
+#define WS_TLS_PORT 8443
+// TLS clients, on top of WS_MAX_CONNECTIONS. mbedtls allocates ~20K of record buffers for each one.
+#define WS_TLS_MAX_CONNECTIONS 2
+// The handshake (ECDHE and the signature) runs on the connection's task. Check the high water marks.
+#define WS_TLS_CON_STACK_SIZE 6144
+
+#define WS_MAX_SLOTS (WS_MAX_CONNECTIONS + (WS_TLS ? WS_TLS_MAX_CONNECTIONS : 0))
+
+// Task stack size classes, smallest first. The plain connection one has to be first.
+SUB_TASK_POOL_BLOCKS(task_pool_cli_con, WS_CLI_CON_STACK_SIZE, WS_MAX_CONNECTIONS);
+#if WS_TLS
+SUB_TASK_POOL_BLOCKS(task_pool_tls_con, WS_TLS_CON_STACK_SIZE, WS_TLS_MAX_CONNECTIONS);
+#endif
+sub_task_pool task_pools[] = {
+    SUB_TASK_POOL(task_pool_cli_con, WS_CLI_CON_STACK_SIZE, WS_MAX_CONNECTIONS),
+#if WS_TLS
+    SUB_TASK_POOL(task_pool_tls_con, WS_TLS_CON_STACK_SIZE, WS_TLS_MAX_CONNECTIONS),
+#endif
+};
+#define TASK_POOLS_LEN ((int) (sizeof(task_pools) / sizeof(task_pools[0])))
+
+// Certificate, key and session cache for the wss:// port. NULL when it's not open.
+ws_tls_server* tls_server = NULL;
 
 // =============== Header Processing stuff ===========
 // recieve
-#define WS_H_FIELD_UPGRADE 0
-#define WS_H_FIELD_KEY 1
-
-#define WS_KEY_LEN 24
-
-#define WS_H_FIELDS_LEN 2
-const char* WS_H_FIELDS[] = {
-    "Upgrade",
-    "Sec-WebSocket-Key",
-};
+// HTTP_H_* ids and the http_headers trie, generated from http_headers.txt.
+#include "http_headers.h"
+
+// do_ws_header() served a plain HTTP request and the connection can take another one.
+#define WS_HTTP_KEEP_ALIVE 1
+// do_ws_header() switched the connection to websocket. ws_websocket_session() takes it from there.
+#define WS_HTTP_UPGRADED 2
+// do_ws_header() read a GET /stats (or /stats.json with WS_HTTP_STATS_JSON). Or'ed with WS_HTTP_KEEP_ALIVE,
+// ws_serve_stats() answers it once the header parsing is off the stack.
+#define WS_HTTP_STATS      4
+#define WS_HTTP_STATS_JSON 8
+
+// Room for the /stats body, every slot and memp pool included
+#define WS_STATS_BODY_LEN 6144
+
+// The /stats header, Content-Type and Content-Length go in
+const char ws_responce_stats[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: %s; charset=UTF-8\r\n"
+    "Cache-Control: no-store\r\n"
+    "Content-Length: %u\r\n\r\n";
 
 // send
 const char ws_responce1[] =
@@ -66,31 +127,50 @@ const char ws_responce1[] =
     "Connection: upgrade\r\n"
     "Sec-WebSocket-Accept: ";
 
-const char ws_responce2[] =
-    "\r\nSec-WebSocket-Protocol: chat\r\n\r\n";
+// Only if the client asked for it
+const char ws_responce_protocol[] =
+    "\r\nSec-WebSocket-Protocol: chat";
 
-const char ws_uuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+// Followed by what ws_handshake_deflate_response() says
+const char ws_responce_extensions[] =
+    "\r\nSec-WebSocket-Extensions: ";
 
-const char ws_page_responce1[] =
-    "HTTP/1.1 200 OK\r\n"
-    "Content-Type: text/html; charset=UTF-8\r\n"
-    "Connection: \r\n"
-    "Content-Length: ";
+const char ws_responce_end[] =
+    "\r\n\r\n";
 
-// TODO: Make the linker handle this with a normal HTML file
-const char ws_page_responce2[] =
-    "\r\n"
-    "\r\n";
+// The upgrade request was not one we can take
+const char ws_responce_bad_request[] =
+    "HTTP/1.1 400 Bad Request\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
 
-//const char ws_page_body[] =
-//    "<!doctype html><html><body>Test page. TODO: add a script to connet via websocket and display information</body></html>";
+const char ws_responce_bad_version[] =
+    "HTTP/1.1 426 Upgrade Required\r\n"
+    "Sec-WebSocket-Version: " WS_HANDSHAKE_VERSION "\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
+
+// No memory for the /stats body
+const char ws_responce_unavailable[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
+
+// Page bodies and their complete response headers, generated by embed_page.cmake.
 #include "index_html.h"
 
+#if WS_TLS
+// ws_tls_cert[] and ws_tls_key[] (PEM), generated by embed_tls.cmake from WS_TLS_CERT and WS_TLS_KEY.
+#include "tls_credentials.h"
+#endif
+
 // ================ CLIANT CONNECTION ================
 
-#define WS_T_YIELD_REASON_READ 1
-#define WS_T_YIELD_REASON_FLUSH 2
-#define WS_T_YIELD_REASON_WAIT_FOR_ACK 3
+// Bits, so a task can wait for more than one at a time. See ws_t_wait().
+#define WS_T_YIELD_REASON_READ         IOL_REASON(0)
+#define WS_T_YIELD_REASON_FLUSH        IOL_REASON(1)
+#define WS_T_YIELD_REASON_WAIT_FOR_ACK IOL_REASON(2)
+static_assert((int) IOL_YIELD_REASON_TIMER > 0, "ws_t_wait() hands the fired reasons back in an int");
 
 typedef struct ws_ack_callback_ {
     err_t (*call)(void*, u16_t);
@@ -98,7 +178,6 @@ typedef struct ws_ack_callback_ {
 } ws_ack_callback;
 
 typedef struct ws_cliant_con_ {
-    struct tcp_pcb* server_pcb; // TODO: remove server pcb.
     struct tcp_pcb* printed_circuit_board; // I honistly have no idea
 
     ws_ack_callback ack_callback;
@@ -107,24 +186,69 @@ typedef struct ws_cliant_con_ {
     struct pbuf* p_current;
     // Count the data we have processed so we can call tcp_receved in one shot, usually after a yield.
     size_t recved_current;
+    // Someone holds a pointer into the first pbuf of p_current (websocket_peek). Don't coalesce it.
+    bool p_pinned;
 
-    // Basically a thread that is handling a single connection.
-    // TODO: Multiple connections!
+    // Basically a thread that is handling a single connection. Owned by the connection slot.
     // TODO: Support multiple threads. Maybe the connection should only track threads that
     //       are waiting for it. Some users might want a reader and writer thread.
     sub_task* task;
     iol_lock_obj io_task;
-
-    // TODO: better WS_T_YIELD_REASON_WAIT_FOR_ACK
-    bool notify_ack;
+    // Wakes io_task with IOL_YIELD_REASON_TIMER. Used for sleeps and timeouts.
+    iol_timer timer;
+
+    uint32_t read_timeout_ms;
+
+    // Accepted on WS_TLS_PORT. tcp_cli_con_recv() then queues ciphertext on tls_in, and everything
+    // below sees plaintext on p_current once ws_tls_pump() decrypted it.
+    bool secure;
+    // Set once the handshake is done (ws_tls_open())
+    mbedtls_ssl_context* tls;
+    // Ciphertext mbedtls has not taken yet
+    struct pbuf* tls_in;
+    // More ciphertext came in since mbedtls last ran out (or ws_tls_pump() left some for later)
+    bool tls_in_fresh;
+    // Plaintext written with TCP_WRITE_FLAG_MORE, sealed into one record with what comes after it.
+    // WS_TLS_OUT_LEN, allocated by the first write that needs it.
+    uint8_t* tls_out;
+    uint16_t tls_out_len;
+
+    // Zeroed in ws_server_claim_cli_con(), added to server_stats.closed by ws_cli_con_close()
+    ws_con_stats stats;
+    // Index in ws_server.cli_cons, for the trace
+    uint16_t slot;
 
 } ws_cliant_con;
 
+ws_server_stats server_stats;
+
 void set_ack_callback(ws_cliant_con* cli_con, err_t (*call)(void*, u16_t), void* arg) {
     cli_con->ack_callback.call = call;
     cli_con->ack_callback.arg = arg;
 }
 
+/**
+ * @brief sub_task_yield() for the connection's task, counting it in cli_con->stats.
+ *
+ * @param cli_con
+ * @param reasons WS_T_YIELD_REASON_* bits or'ed togeather
+ * @return void* What sub_task_yield() returned, non NULL is an error
+ */
+void* ws_t_yield(ws_cliant_con* cli_con, size_t reasons) {
+#if WS_STATS
+    cli_con->stats.yields_read += (reasons & WS_T_YIELD_REASON_READ) != 0;
+    cli_con->stats.yields_flush += (reasons & WS_T_YIELD_REASON_FLUSH) != 0;
+    if (reasons & WS_T_YIELD_REASON_WAIT_FOR_ACK) {
+        cli_con->stats.yields_ack++;
+        absolute_time_t start = get_absolute_time();
+        void* ret = sub_task_yield(reasons, cli_con->task);
+        cli_con->stats.ack_wait_us += (uint32_t) absolute_time_diff_us(start, get_absolute_time());
+        return ret;
+    }
+#endif
+    return sub_task_yield(reasons, cli_con->task);
+}
+
 // normal helper functions
 
 /**
@@ -156,7 +280,8 @@ int ws_read(ws_cliant_con* cli_con, char* buf, size_t size) {
     // if a large volume of data is being sent and we are just barly keeping up. Once
     // enough data has not been acked (but we have not hit this point, aka yielded for more because we slow).
     // The connection may hickup resulting in a lag spike (or worse?) when it could smoothly chug along.
-    if (cli_con->printed_circuit_board != NULL) {
+    // (TLS connections tell it about the ciphertext instead, in ws_tls_bio_recv().)
+    if (cli_con->printed_circuit_board != NULL && !cli_con->secure) {
         tcp_recved(cli_con->printed_circuit_board, cli_con->recved_current);
         cli_con->recved_current = 0;
     }
@@ -164,6 +289,37 @@ int ws_read(ws_cliant_con* cli_con, char* buf, size_t size) {
     return bytes_read; // We are still waiting for more data
 }
 
+int ws_consume(ws_cliant_con* cli_con, size_t size);
+
+/**
+ * @brief ws_read() that unmasks while copying. Walks the pbuf chain itself so the data
+ * is only touched once.
+ *
+ * @param cli_con
+ * @param buf
+ * @param size size of buf (max size that can be read)
+ * @param mask Lined up with the next byte. Updated to line up with the byte after what was read.
+ * @return The number of bytes actually read or an error code
+ */
+int ws_read_masked(ws_cliant_con* cli_con, char* buf, size_t size, uint32_t* mask) {
+    if (!cli_con->p_current) {
+        return cli_con->printed_circuit_board == NULL ? ERR_CLSD : 0; // We are still waiting for more data
+    }
+
+    size_t bytes_read = 0;
+    for (struct pbuf* q = cli_con->p_current; q != NULL && bytes_read < size; q = q->next) {
+        size_t len = MIN(q->len, size - bytes_read);
+        *mask = ws_mask_copy(buf + bytes_read, q->payload, len, *mask);
+        bytes_read += len;
+    }
+
+    int err;
+    if ((err = ws_consume(cli_con, bytes_read))) {
+        return err;
+    }
+    return bytes_read;
+}
+
 /**
  * @brief Provides access to the next raw pbuf payload. Call ws_consume() or ws_read() to
  * actually advance the communication.
@@ -199,7 +355,8 @@ int ws_consume(ws_cliant_con* cli_con, size_t size) {
     // if a large volume of data is being sent and we are just barly keeping up. Once
     // enough data has not been acked (but we have not hit this point, aka yielded for more because we slow).
     // The connection may hickup resulting in a lag spike (or worse?) when it could smoothly chug along.
-    if (cli_con->printed_circuit_board != NULL) {
+    // (TLS connections tell it about the ciphertext instead, in ws_tls_bio_recv().)
+    if (cli_con->printed_circuit_board != NULL && !cli_con->secure) {
         tcp_recved(cli_con->printed_circuit_board, cli_con->recved_current);
         cli_con->recved_current = 0;
     }
@@ -209,8 +366,286 @@ int ws_consume(ws_cliant_con* cli_con, size_t size) {
 
 // end normal helper functions
 
+// TLS transport helper functions
+
+/**
+ * @brief Plaintext decrypted by ws_tls_pump(). On the heap, records don't fit in the lwIP heap.
+ */
+typedef struct ws_tls_plain_ {
+    struct pbuf_custom p;
+    uint8_t payload[];
+} ws_tls_plain;
+
+// ws_tls_pump() reads this much when a new record is started, then shrinks it to what it got.
+#define WS_TLS_READ_CHUNK 512
+// ws_tls_pump() stops decrypting once this much plaintext is waiting to be read. The ciphertext stays
+// on tls_in, un-recved, so the client runs into the window instead of into our heap.
+#ifndef WS_TLS_MAX_PLAIN
+#define WS_TLS_MAX_PLAIN 4096
+#endif
+// Writes with TCP_WRITE_FLAG_MORE are gathered up to one record's worth.
+#define WS_TLS_OUT_LEN MBEDTLS_SSL_OUT_CONTENT_LEN
+
+static void ws_tls_plain_free(struct pbuf* p) {
+    free(p); // p is the first thing in ws_tls_plain
+}
+
+/**
+ * @brief mbedtls wants ciphertext. Copies it out of the pbufs tcp_cli_con_recv() queued on tls_in.
+ */
+static int ws_tls_bio_recv(void* ctx, unsigned char* buf, size_t len) {
+    ws_cliant_con* cli_con = ctx;
+
+    if (!cli_con->tls_in) {
+        cli_con->tls_in_fresh = false;
+        return cli_con->printed_circuit_board == NULL ? 0 /* EOF */ : MBEDTLS_ERR_SSL_WANT_READ;
+    }
+
+    u16_t n = pbuf_copy_partial(cli_con->tls_in, buf, MIN(len, 0xFFFF), 0);
+    cli_con->tls_in = pbuf_free_header(cli_con->tls_in, n);
+
+    // The window follows the ciphertext mbedtls took. What the client gets ahead of us is bounded by
+    // ws_tls_pump() not taking more once WS_TLS_MAX_PLAIN is waiting.
+    if (cli_con->printed_circuit_board != NULL) {
+        tcp_recved(cli_con->printed_circuit_board, n);
+    }
+    return n;
+}
+
+/**
+ * @brief mbedtls has a record (or the rest of one) to send. It re-uses it's buffer for the next record, so it's copied.
+ */
+static int ws_tls_bio_send(void* ctx, const unsigned char* buf, size_t len) {
+    ws_cliant_con* cli_con = ctx;
+
+    if (cli_con->printed_circuit_board == NULL) {
+        return MBEDTLS_ERR_SSL_CONN_EOF;
+    }
+
+    u16_t n = MIN(len, tcp_sndbuf(cli_con->printed_circuit_board));
+    if (n == 0) {
+        return MBEDTLS_ERR_SSL_WANT_WRITE;
+    }
+
+    err_t err = tcp_write(cli_con->printed_circuit_board, buf, n, TCP_WRITE_FLAG_COPY);
+    if (err == ERR_MEM) {
+        return MBEDTLS_ERR_SSL_WANT_WRITE; // Out of segments (TCP_SND_QUEUELEN), wait for some ACKs
+    }
+    if (err) {
+        return MBEDTLS_ERR_SSL_INTERNAL_ERROR;
+    }
+    return n;
+}
+
+/**
+ * @brief Decrypts whatever ciphertext came in onto p_current, so the readers don't know the difference.
+ * Called by ws_t_wait() when woken for READ. Stops at WS_TLS_MAX_PLAIN, the rest waits until that was read.
+ *
+ * @param cli_con
+ * @return int ERR_OK, ERR_CLSD once the client said close_notify, or another negative error code
+ */
+static int ws_tls_pump(ws_cliant_con* cli_con) {
+    while (cli_con->tls_in || mbedtls_ssl_get_bytes_avail(cli_con->tls)) {
+        if (cli_con->p_current && cli_con->p_current->tot_len >= WS_TLS_MAX_PLAIN) {
+            // Left fresh, so the next READ wait comes right back here once the readers caught up.
+            cli_con->tls_in_fresh = true;
+            return ERR_OK;
+        }
+
+        // What's left of the record mbedtls has open, or a guess for a new one.
+        size_t want = mbedtls_ssl_get_bytes_avail(cli_con->tls);
+        if (!want) {
+            want = WS_TLS_READ_CHUNK;
+        }
+
+        ws_tls_plain* plain = malloc(sizeof(ws_tls_plain) + want);
+        if (!plain) {
+            return ERR_MEM;
+        }
+
+        int n = mbedtls_ssl_read(cli_con->tls, plain->payload, want);
+        if (n <= 0) {
+            free(plain);
+            if (n == MBEDTLS_ERR_SSL_WANT_READ) {
+                break; // The rest of the record is still on it's way
+            }
+            if (n == 0 || n == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY || n == MBEDTLS_ERR_SSL_CONN_EOF) {
+                return ERR_CLSD;
+            }
+            DEBUG_printf("TLS read failed -0x%04x\n", -n);
+            return ERR_VAL;
+        }
+
+        if (n < want) {
+            // Can't really fail when shrinking. If it does, the bigger block does just as well.
+            ws_tls_plain* shrunk = realloc(plain, sizeof(ws_tls_plain) + n);
+            if (shrunk) {
+                plain = shrunk;
+            }
+        }
+        plain->p.custom_free_function = ws_tls_plain_free;
+        struct pbuf* p = pbuf_alloced_custom(PBUF_RAW, n, PBUF_RAM, &plain->p, plain->payload, n);
+
+        if (cli_con->p_current) {
+            pbuf_cat(cli_con->p_current, p);
+        } else {
+            cli_con->p_current = p;
+        }
+    }
+
+    cli_con->tls_in_fresh = false;
+    return ERR_OK;
+}
+
+/**
+ * @brief The ack_callback gets the plaintext bytes once they are sealed in a record, instead of when
+ * TCP acks them. Nothing points into the caller's buffer after mbedtls_ssl_write() took them.
+ */
+static void ws_tls_acked(ws_cliant_con* cli_con, size_t len) {
+    while (len > 0 && cli_con->ack_callback.call) {
+        u16_t chunk = MIN(len, 0xFFFF);
+        cli_con->ack_callback.call(cli_con->ack_callback.arg, chunk);
+        len -= chunk;
+    }
+}
+
+/**
+ * @brief Seals len bytes into records and hands them to TCP. Nothing points into dataptr afterwards.
+ */
+static err_t ws_tls_seal(ws_cliant_con* cli_con, const void* dataptr, size_t len) {
+    err_t ret;
+
+    while (len > 0) {
+        if (cli_con->printed_circuit_board == NULL) {
+            return ERR_CLSD;
+        }
+
+        int n = mbedtls_ssl_write(cli_con->tls, dataptr, len);
+        if (n == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            // Part of the record is still waiting in mbedtls' buffer. It wants the same call again once there is room.
+            tcp_output(cli_con->printed_circuit_board);
+            if (ret = (size_t) ws_t_yield(cli_con, WS_T_YIELD_REASON_WAIT_FOR_ACK)) {
+                return ret;
+            }
+            continue;
+        }
+        if (n < 0) {
+            DEBUG_printf("TLS write failed -0x%04x\n", -n);
+            return ERR_VAL;
+        }
+
+        dataptr += n;
+        len -= n;
+    }
+    return ERR_OK;
+}
+
+/**
+ * @brief ws_t_write() for TLS connections. Every record costs a header, a MAC and a tcp_write, so writes
+ * with TCP_WRITE_FLAG_MORE (the pieces of an HTTP response) are copied into tls_out and sealed together
+ * with the write that ends them. Anything else is sealed straight from dataptr (the framinator's ring).
+ */
+static err_t ws_tls_write(ws_cliant_con* cli_con, const void* dataptr, size_t len, u8_t apiflags) {
+    err_t ret;
+    bool more = apiflags & TCP_WRITE_FLAG_MORE;
+
+    while (len > 0 && (more || cli_con->tls_out_len)) {
+        if (!cli_con->tls_out && !(cli_con->tls_out = malloc(WS_TLS_OUT_LEN))) {
+            break; // One record per write it is
+        }
+        size_t n = MIN(len, WS_TLS_OUT_LEN - cli_con->tls_out_len);
+        memcpy(cli_con->tls_out + cli_con->tls_out_len, dataptr, n);
+        cli_con->tls_out_len += n;
+        ws_tls_acked(cli_con, n);
+        dataptr += n;
+        len -= n;
+
+        if (cli_con->tls_out_len == WS_TLS_OUT_LEN || (!more && !len)) {
+            size_t out_len = cli_con->tls_out_len;
+            cli_con->tls_out_len = 0;
+            if ((ret = ws_tls_seal(cli_con, cli_con->tls_out, out_len))) {
+                return ret;
+            }
+        }
+    }
+    if (cli_con->tls_out_len && !more) {
+        // Out of memory with something staged, it still goes first
+        size_t out_len = cli_con->tls_out_len;
+        cli_con->tls_out_len = 0;
+        if ((ret = ws_tls_seal(cli_con, cli_con->tls_out, out_len))) {
+            return ret;
+        }
+    }
+    if (len > 0 && (ret = ws_tls_seal(cli_con, dataptr, len))) {
+        return ret;
+    }
+    ws_tls_acked(cli_con, len);
+    return ERR_OK;
+}
+
+// end TLS transport helper functions
+
 // threaded helper functions
 
+/**
+ * @brief Yields until any of the reasons happen.
+ *
+ * @param cli_con
+ * @param reasons WS_T_YIELD_REASON_* bits or'ed togeather
+ * @return int The reasons that fired or a negative error code
+ */
+int ws_t_wait(ws_cliant_con* cli_con, size_t reasons) {
+    int err;
+    if (err = (int) ws_t_yield(cli_con, reasons)) {
+        return err;
+    }
+
+    int fired = iol_fired(&cli_con->io_task);
+    if ((fired & WS_T_YIELD_REASON_READ) && cli_con->tls && (err = ws_tls_pump(cli_con))) {
+        return err;
+    }
+    return fired;
+}
+
+/**
+ * @brief Yields until any of the reasons happen or the deadline passes.
+ *
+ * @param cli_con
+ * @param reasons WS_T_YIELD_REASON_* bits or'ed togeather
+ * @param deadline
+ * @return int The reasons that fired (IOL_YIELD_REASON_TIMER on timeout) or a negative error code
+ */
+int ws_t_wait_until(ws_cliant_con* cli_con, size_t reasons, absolute_time_t deadline) {
+    iol_timer_set(&cli_con->timer, deadline);
+    int fired = ws_t_wait(cli_con, reasons | IOL_YIELD_REASON_TIMER);
+    iol_timer_cancel(&cli_con->timer);
+    return fired;
+}
+
+/**
+ * @brief Yields until more data comes in or the connection's read timeout passes.
+ *
+ * @param cli_con
+ * @return int ERR_OK, ERR_TIMEOUT or another negative error code
+ */
+int ws_t_wait_read(ws_cliant_con* cli_con) {
+    int fired;
+    if (!cli_con->read_timeout_ms) {
+        fired = ws_t_wait(cli_con, WS_T_YIELD_REASON_READ);
+    } else {
+        fired = ws_t_wait_until(cli_con, WS_T_YIELD_REASON_READ, make_timeout_time_ms(cli_con->read_timeout_ms));
+    }
+
+    if (fired < 0) {
+        return fired;
+    }
+    if (!(fired & WS_T_YIELD_REASON_READ)) {
+        DEBUG_printf("Read timed out\n");
+        return ERR_TIMEOUT;
+    }
+    return ERR_OK;
+}
+
 /**
  * @brief Returns a condiguious byte array of the given size by yielding when more is needed.
  *
@@ -232,7 +667,36 @@ int ws_t_read(ws_cliant_con* cli_con, char* buf, size_t size) {
 
         if (size > ret) {
 
-            if (r = (int) sub_task_yield(WS_T_YIELD_REASON_READ, cli_con->task)) {
+            if (r = ws_t_wait_read(cli_con)) {
+                return r;
+            }
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief ws_t_read() that unmasks while copying.
+ *
+ * @param cli_con
+ * @param buf
+ * @param size
+ * @param mask Lined up with the next byte. Kept lined up as bytes are read.
+ * @return The number of bytes actually read or an error code
+ */
+int ws_t_read_masked(ws_cliant_con* cli_con, char* buf, size_t size, uint32_t* mask) {
+    int ret = 0;
+
+    while (size > ret) {
+        int r = ws_read_masked(cli_con, buf + ret, size - ret, mask);
+        if (r < 0) {
+            return r;
+        }
+
+        ret += r;
+
+        if (size > ret) {
+            if (r = ws_t_wait_read(cli_con)) {
                 return r;
             }
         }
@@ -253,27 +717,60 @@ int ws_t_peak(ws_cliant_con* cli_con, char** buf_ptr) {
     while ((ret = ws_peak(cli_con, buf_ptr)) == 0) {
 
         int err;
-        if (err = (int) sub_task_yield(WS_T_YIELD_REASON_READ, cli_con->task)) {
+        if (err = ws_t_wait_read(cli_con)) {
             return err;
         }
     }
     return ret;
 }
 
+/**
+ * @brief Throws away the next size bytes, yielding for more when needed.
+ * Whole pbufs are freed at once instead of being copied out.
+ *
+ * @param cli_con
+ * @param size Number of bytes to skip
+ * @return int ERR_OK or a negative error code
+ */
+int ws_t_skip(ws_cliant_con* cli_con, uint64_t size) {
+    int ret;
+
+    while (size > 0) {
+        if (!cli_con->p_current) {
+            if (cli_con->printed_circuit_board == NULL) {
+                return ERR_CLSD;
+            }
+            if (ret = ws_t_wait_read(cli_con)) {
+                return ret;
+            }
+            continue;
+        }
+
+        u16_t chunk = MIN(size, cli_con->p_current->tot_len);
+        if ((ret = ws_consume(cli_con, chunk))) {
+            return ret;
+        }
+        size -= chunk;
+    }
+    return ERR_OK;
+}
+
 err_t ws_t_write(ws_cliant_con* cli_con, void* dataptr, size_t len, u8_t apiflags/*, tcpwnd_size_t* countdown*/) {
     err_t ret;
 
     if (cli_con->printed_circuit_board == NULL) {
         return ERR_CLSD;
     }
+    if (cli_con->tls) {
+        return ws_tls_write(cli_con, dataptr, len, apiflags);
+    }
 
     // Wait until we have at least *some* space on the send buffer
     while (tcp_sndbuf(cli_con->printed_circuit_board) == 0) {
         tcp_output(cli_con->printed_circuit_board);
-        if (ret = (size_t) sub_task_yield(WS_T_YIELD_REASON_WAIT_FOR_ACK, cli_con->task)) {
+        if (ret = (size_t) ws_t_yield(cli_con, WS_T_YIELD_REASON_WAIT_FOR_ACK)) {
             return ret;
         }
-        cli_con->notify_ack = false;
     }
 
     while (tcp_sndbuf(cli_con->printed_circuit_board) < len) {
@@ -291,10 +788,9 @@ err_t ws_t_write(ws_cliant_con* cli_con, void* dataptr, size_t len, u8_t apiflag
 
         // Now that the send buffer is maxed out, lets wait for at some of it to drain out
         tcp_output(cli_con->printed_circuit_board);
-        if (ret = (size_t) sub_task_yield(WS_T_YIELD_REASON_WAIT_FOR_ACK, cli_con->task)) {
+        if (ret = (size_t) ws_t_yield(cli_con, WS_T_YIELD_REASON_WAIT_FOR_ACK)) {
             return ret;
         }
-        cli_con->notify_ack = false;
     }
     tcp_write(cli_con->printed_circuit_board, dataptr, len, apiflags);
 
@@ -317,43 +813,52 @@ size_t ws_t_write_barrier(ws_cliant_con* cli_con) {
 
     while (cli_con->printed_circuit_board->snd_queuelen) {
         size_t ret;
-        if (ret = (size_t) sub_task_yield(WS_T_YIELD_REASON_FLUSH, cli_con->task)) {
+        if (ret = (size_t) ws_t_yield(cli_con, WS_T_YIELD_REASON_FLUSH)) {
             return ret;
         }
     }
 }
 
-bool ws_check_reason(void* user_obj, size_t reason, size_t err) {
+size_t ws_check_reason(void* user_obj, size_t reasons, size_t err) {
     ws_cliant_con* cli_con = user_obj;
+    size_t ready = 0;
 
-    if (reason && err) {
-        return true; // Let the task handle the error.
+    // Fresh ciphertext may or may not finish a record. ws_t_wait() finds out, the readers wait again if not.
+    if (reasons & WS_T_YIELD_REASON_READ && (cli_con->p_current != NULL || cli_con->tls_in_fresh)) {
+        ready |= WS_T_YIELD_REASON_READ;
     }
 
-    switch (reason) {
-        case WS_T_YIELD_REASON_READ:
-            return cli_con->p_current != NULL;
+    if (reasons & WS_T_YIELD_REASON_FLUSH) {
+        // When no more pbufs are in the send buffer, we are flushed. All of them have been ack'ed.
+        // Checking that tcp_sndbuf is at it's max would also work.
+        if (cli_con->printed_circuit_board == NULL || !cli_con->printed_circuit_board->snd_queuelen) {
+            ready |= WS_T_YIELD_REASON_FLUSH;
+        }
+    }
 
-        case WS_T_YIELD_REASON_FLUSH:
-            // When no more pbufs are in the send buffer, we are flushed. All of them have been ack'ed.
-            // Checking that tcp_sndbuf is at it's max would also work.
-            return cli_con->printed_circuit_board == NULL || !cli_con->printed_circuit_board->snd_queuelen;
+    // WS_T_YIELD_REASON_WAIT_FOR_ACK is an event, not a state. iol_notify keeps track of it for us.
 
-        case WS_T_YIELD_REASON_WAIT_FOR_ACK:
-            // TODO: better WS_T_YIELD_REASON_WAIT_FOR_ACK
-            return cli_con->notify_ack;
+    return ready;
+}
 
-        case IOL_YIELD_REASON_END:
-            return false; // ya, don't continue if we ended. That would cause a crash.
+// end threaded helper functions
 
-        default:
-            DEBUG_printf("Unimplemented reason: %i\n", reason);
-            return false;
+/**
+ * @brief Drops the connection with a RST. lwIP frees everything queued on it right away,
+ * so nothing we handed to tcp_write is referenced afterwards.
+ */
+void ws_cli_con_abort(ws_cliant_con* cli_con) {
+    if (cli_con->printed_circuit_board != NULL) {
+        tcp_arg(cli_con->printed_circuit_board, NULL);
+        tcp_poll(cli_con->printed_circuit_board, NULL, 0);
+        tcp_sent(cli_con->printed_circuit_board, NULL);
+        tcp_recv(cli_con->printed_circuit_board, NULL);
+        tcp_err(cli_con->printed_circuit_board, NULL);
+        tcp_abort(cli_con->printed_circuit_board);
+        cli_con->printed_circuit_board = NULL;
     }
 }
 
-// end threaded helper functions
-
 // TODO: cleanup this crazy header
 #include <websocket_framinator.h>
 
@@ -402,16 +907,163 @@ int ws_consume_line(ws_cliant_con* cli_con) {
     }
 }
 
-int ws_confirm_tag(ws_cliant_con* cli_con, char* tag) {
+/**
+ * @brief Looks for token anywhere in the rest of the line (the header value). Consumes up to the '\r'.
+ *
+ * @param cli_con
+ * @param token Must not start over inside of its self (like "aab"), the match does not back track.
+ * @return int true if it was found, false if not, or a negative error code
+ */
+int ws_line_contains(ws_cliant_con* cli_con, const char* token) {
     int i;
     char* buf;
-    size_t len;
-    size_t tlen = 0;
+    int len;
+    size_t matched = 0;
+    bool found = false;
 
-    int ret;
+    while (true) {
+        if ((len = ws_t_peak(cli_con, &buf)) < 0) {
+            return len; // error
+        }
+
+        for (i = 0; i < len; i++) {
+            if (buf[i] == '\r') {
+                ws_consume(cli_con, i);
+                return found;
+            }
+            if (found) {
+                continue;
+            }
+            if (buf[i] != token[matched]) {
+                matched = 0;
+            }
+            if (buf[i] == token[matched] && token[++matched] == '\0') {
+                found = true;
+            }
+        }
+        ws_consume(cli_con, len);
+    }
+}
+
+/**
+ * @brief Reads the request line ("GET /path HTTP/1.1"). The path is copied into path as a string,
+ * cut off if it does not fit. Consumes up to the '\r'.
+ *
+ * @return int true for a HTTP/1.0 request, false if not, or a negative error code
+ */
+int ws_read_request_line(ws_cliant_con* cli_con, char* path, size_t size) {
+    int i;
+    char* buf;
+    int len;
+    size_t copied = 0;
+    bool in_path = false;
+
+    while (true) {
+        if ((len = ws_t_peak(cli_con, &buf)) < 0) {
+            return len; // error
+        }
+
+        for (i = 0; i < len; i++) {
+            if (buf[i] == '\r' || (buf[i] == ' ' && in_path)) {
+                break;
+            }
+            if (buf[i] == ' ') {
+                in_path = true; // Done with the method
+            } else if (in_path && copied < size - 1) {
+                path[copied++] = buf[i];
+            }
+        }
+        ws_consume(cli_con, i);
+
+        if (i < len) {
+            path[copied] = '\0';
+            return ws_line_contains(cli_con, "HTTP/1.0"); // The version is what's left
+        }
+    }
+}
+
+/**
+ * @brief Copies the rest of the line (the header value) into buf as a string, cut off if it does not fit.
+ * Consumes up to the '\r'.
+ *
+ * @return int Length of the whole value (size or more if it was cut off) or a negative error code
+ */
+int ws_read_line(ws_cliant_con* cli_con, char* line, size_t size) {
+    int i;
+    char* buf;
+    int len;
+    size_t copied = 0;
+    int total = 0;
+
+    while (true) {
+        if ((len = ws_t_peak(cli_con, &buf)) < 0) {
+            return len; // error
+        }
+
+        for (i = 0; i < len && buf[i] != '\r'; i++);
+
+        size_t n = MIN((size_t) i, size - 1 - copied);
+        memcpy(line + copied, buf, n);
+        copied += n;
+        total += i;
+        ws_consume(cli_con, i);
+
+        if (i < len) {
+            line[copied] = '\0';
+            return total;
+        }
+    }
+}
+
+/**
+ * @brief Feeds the rest of the line (Sec-WebSocket-Key) to the handshake straight out of the pbufs.
+ * Consumes up to the '\r'. Trailing whitespace is left alone.
+ *
+ * @return int 0, WS_HANDSHAKE_ERR_KEY (the line is still consumed) or a negative error code
+ */
+int ws_read_key(ws_cliant_con* cli_con, ws_handshake* hs) {
+    int i;
+    char* buf;
+    int len;
+    int bad = 0;
+
+    while (true) {
+        if ((len = ws_t_peak(cli_con, &buf)) < 0) {
+            return len; // error
+        }
+
+        for (i = 0; i < len && buf[i] != '\r' && buf[i] != ' ' && buf[i] != '\t'; i++);
+
+        if (!bad) {
+            bad = ws_handshake_key_update(hs, buf, i);
+        }
+        ws_consume(cli_con, i);
+
+        if (i < len) {
+            return bad;
+        }
+    }
+}
+
+static char ws_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/**
+ * @brief Checks the rest of the line (the header value) is tag, ignoring case. Consumes up to the '\r'.
+ *
+ * @param tag Lower case
+ * @return int true if it is, false if not, or a negative error code
+ */
+int ws_confirm_tag(ws_cliant_con* cli_con, char* tag) {
+    int i;
+    char* buf;
+    int len;
 
     while(true) {
-        len = ws_t_peak(cli_con, &buf);
+        if ((len = ws_t_peak(cli_con, &buf)) < 0) {
+            return len; // error
+        }
 
         for (i = 0; i < len; i++) {
             if (tag[i] == '\0') {
@@ -428,7 +1080,7 @@ int ws_confirm_tag(ws_cliant_con* cli_con, char* tag) {
                     return false;
                 }
             }
-            if (buf[i] != tag[i]) {
+            if (ws_lower(buf[i]) != tag[i]) {
                 ws_consume(cli_con, i);
                 ws_consume_line(cli_con);
                 return false;
@@ -440,17 +1092,150 @@ int ws_confirm_tag(ws_cliant_con* cli_con, char* tag) {
     }
 }
 
-size_t do_ws_header(ws_cliant_con* cli_con) {
+/**
+ * @brief Binary sensor message header. Everything is little-endian (like the RP2040).
+ * Followed by sample_count uint16_t ADC samples.
+ */
+typedef struct ws_sensor_header_ {
+    uint32_t time_ms;
+    uint16_t sample_count;
+    uint8_t  led;
+    uint8_t  reserved;
+} ws_sensor_header;
+
+int ws_push_sensor(ws_framinator* framinator) {
+    ws_sensor_header header = {
+        .time_ms = to_ms_since_boot(get_absolute_time()),
+        .sample_count = WS_SENSOR_SAMPLES,
+        .led = gpio_get(11),
+    };
+    uint16_t samples[WS_SENSOR_SAMPLES];
+    for (int i = 0; i < WS_SENSOR_SAMPLES; i++) {
+        samples[i] = adc_read();
+    }
+
+    // One binary message, gathered right into the ring.
+    ws_iovec iov[] = {
+        { &header, sizeof(header) },
+        { samples, sizeof(samples) },
+    };
+    return websocket_writev(framinator, WS_HEADER_OPCODE_DATA, iov, sizeof(iov) / sizeof(iov[0]));
+}
+
+/**
+ * @brief Pushes the sensor value and handles commands until the connection is done.
+ */
+int ws_websocket_loop(ws_cliant_con* cli_con, ws_framinator* framinator) {
+    int ret;
+
+    absolute_time_t next_push = make_timeout_time_ms(WS_PUSH_INTERVAL_MS);
+
+    while (true) {
+        if (time_reached(next_push)) {
+            if ((ret = ws_push_sensor(framinator))) {
+                return ret;
+            }
+            next_push = delayed_by_ms(next_push, WS_PUSH_INTERVAL_MS);
+            if (time_reached(next_push)) {
+                // We fell behind (slow client?). Don't try to catch up with a burst.
+                next_push = make_timeout_time_ms(WS_PUSH_INTERVAL_MS);
+            }
+        }
+
+        if ((ret = websocket_poll(framinator))) {
+            return ret;
+        }
+
+        if (!cli_con->p_current) {
+            // Wait for a command, until it's time to push the next sensor value
+            // or until a small frame has waited long enough. With anything queued or in flight,
+            // an ACK wakes us too: websocket_poll() sends the small frame once nothing is in flight.
+            size_t reasons = WS_T_YIELD_REASON_READ;
+            if (framinator->current_payload_len || websocket_in_flight(framinator)) {
+                reasons |= WS_T_YIELD_REASON_WAIT_FOR_ACK;
+            }
+            if ((ret = ws_t_wait_until(cli_con, reasons,
+                    absolute_time_min(next_push, websocket_send_deadline(framinator)))) < 0) {
+                return ret;
+            }
+            continue;
+        }
+
+        // Commands are single bytes. Handle them right out of the pbuf. None if all that came was a ping.
+        char* commands;
+        int len;
+        if ((len = websocket_peek(framinator, &commands)) < 0) {
+            return len;
+        }
+
+        for (int i = 0; i < len; i++) {
+            char command = commands[i]; // 0 = off, 1 = on, 2 = toggle
+
+            if (command == '1') {
+                gpio_put(11, 1); // on
+            } else if (command == '0') {
+                gpio_put(11, 0); // off
+            } else if (command == '2') {
+                gpio_put(11, !gpio_get(11)); // toggle
+            } else if (command == 'b') {
+                // Still supported for clients that poll
+                if ((ret = ws_push_sensor(framinator))) {
+                    return ret;
+                }
+            }
+
+            WS_TRACE_V(WS_TRACE_COMMAND, cli_con->slot, command);
+        }
+
+        if ((ret = websocket_consume(framinator, len))) {
+            return ret;
+        }
+    }
+
+    return IOL_YIELD_REASON_END; // TODO: Do more stuff with this task? Will a new task be started?
+}
+
+/**
+ * @brief Reads a request and answers it.
+ *
+ * @param cli_con
+ * @param deflate Set to what was agreed on if the connection was upgraded
+ * @return size_t WS_HTTP_KEEP_ALIVE, WS_HTTP_UPGRADED, WS_HTTP_STATS (and friends), IOL_YIELD_REASON_END
+ *                or a negative error code
+ */
+size_t do_ws_header(ws_cliant_con* cli_con, ws_deflate_params* deflate_out) {
     int ret;
 
-    bl_str_selecter tag_finder;
+    bl_trie_selecter tag_finder;
 
     bool websocket_upgrade = false;
-    bool websocket_gotKey = false;
-    char wsKey[WS_KEY_LEN + sizeof(ws_uuid)];
+    char accept_encoding[64] = "";
+    char if_none_match[48] = "";
+    char connection[64] = "";
+    bool connection_cut = false;
+    char version[8] = "";
+    bool protocol_requested = false;
+    bool protocol_chat = false;
+    bool key_bad = false;
+    int key_count = 0;
+    ws_deflate_params deflate = { .enabled = false };
+    // The offer on the way in, our answer on the way out
+    char extensions[136];
+
+    // Sec-WebSocket-Key is hashed as it comes in. (The sha1 context does not allocate anything,
+    // so bailing out on an error without ws_handshake_free() is fine.)
+    ws_handshake handshake;
+    ws_handshake_init(&handshake);
 
     // Read the header
-    ws_consume_line(cli_con); // Throw away the first line, hehe
+    // The request line. 1.0 does not keep connections open by default. The path only picks /stats,
+    // anything else gets the page.
+    char path[16];
+    if ((ret = ws_read_request_line(cli_con, path, sizeof(path))) < 0) {
+        return ret;
+    }
+    bool http10 = ret;
+    path[strcspn(path, "?")] = '\0';
     ws_eat_whitespace(cli_con);
     while (true) { // break when we hit a double end line? (\r\n\r\n)
 
@@ -459,10 +1244,12 @@ size_t do_ws_header(ws_cliant_con* cli_con) {
         int len;
         int selected;
 
-        bl_str_reset(&tag_finder, WS_H_FIELDS, WS_H_FIELDS_LEN);
+        bl_trie_reset(&tag_finder, &http_headers);
 
         do {
-            len = ws_t_peak(cli_con, &buffer); // *grab*
+            if ((len = ws_t_peak(cli_con, &buffer)) < 0) { // *grab*
+                return len;
+            }
 
             // *inspect*
             for (i = 0; i < len && buffer[i] != ':'; i++) {
@@ -472,61 +1259,148 @@ size_t do_ws_header(ws_cliant_con* cli_con) {
                     goto header_done;
                 }
             }
-            selected = bl_str_select(&tag_finder, buffer, i);
+            selected = bl_trie_select(&tag_finder, buffer, i);
 
             ws_consume(cli_con, i); // *munch!*
 
         } while(i == len); // If i == len, we have read part of the string, but have not hit the ':' yet
 
-        if (ws_eat_whitespace(cli_con) == 1) { // eat the ": "
+        if ((ret = ws_eat_whitespace(cli_con)) == 1) { // eat the ": "
             DEBUG_printf("Unexpected line end.\n");
+        } else if (ret < 0) {
+            return ret;
         }
 
         switch (selected) {
-            case WS_H_FIELD_UPGRADE:
+            case HTTP_H_UPGRADE:
 
-                if (ws_confirm_tag(cli_con, "websocket")) {
+                if ((ret = ws_confirm_tag(cli_con, "websocket")) < 0) {
+                    return ret;
+                } else if (ret) {
                     websocket_upgrade = true;
                 } else {
                     DEBUG_printf("Error, thats not websocket.\n");
                 }
                 break;
 
-            case WS_H_FIELD_KEY:
+            case HTTP_H_SEC_WEBSOCKET_KEY:
+
+                // More than one key is not allowed, ws_handshake_key_finish() will not like it anyway.
+                key_count++;
+                if ((ret = ws_read_key(cli_con, &handshake)) == WS_HANDSHAKE_ERR_KEY) {
+                    key_bad = true;
+                } else if (ret < 0) {
+                    return ret;
+                }
+                break;
+
+            case HTTP_H_SEC_WEBSOCKET_VERSION:
+
+                if ((ret = ws_read_line(cli_con, version, sizeof(version))) < 0) {
+                    return ret;
+                }
+                break;
+
+            case HTTP_H_SEC_WEBSOCKET_PROTOCOL: {
+
+                // Can come more than once. We only speak chat, so that's all we need to know.
+                char protocols[64];
+                if ((ret = ws_read_line(cli_con, protocols, sizeof(protocols))) < 0) {
+                    return ret;
+                }
+                protocol_requested = true;
+                protocol_chat |= ws_handshake_has_token(protocols, "chat");
+                break;
+            }
+
+            case HTTP_H_SEC_WEBSOCKET_EXTENSIONS:
+
+                if ((ret = ws_read_line(cli_con, extensions, sizeof(extensions))) < 0) {
+                    return ret;
+                }
+                if (WS_USE_DEFLATE && !deflate.enabled) {
+                    ws_handshake_deflate_offer(extensions, &deflate);
+                }
+                break;
+
+            case HTTP_H_ACCEPT_ENCODING:
+
+                if ((ret = ws_read_line(cli_con, accept_encoding, sizeof(accept_encoding))) < 0) {
+                    return ret;
+                } else if (ret >= (int) sizeof(accept_encoding)) {
+                    // Whatever got cut off could turn gzip down, plain is always fine.
+                    accept_encoding[0] = '\0';
+                }
+                break;
+
+            case HTTP_H_IF_NONE_MATCH:
+
+                // Kept until we know (Accept-Encoding) which ETag it has to match.
+                if ((ret = ws_read_line(cli_con, if_none_match, sizeof(if_none_match))) < 0) {
+                    return ret;
+                }
+                break;
+
+            case HTTP_H_CONNECTION:
 
-                if ((ret = ws_t_read(cli_con, wsKey, WS_KEY_LEN)) < 0) {
+                if ((ret = ws_read_line(cli_con, connection, sizeof(connection))) < 0) {
                     return ret;
                 }
+                // Upgrade or close could be in the part that's gone
+                connection_cut = ret >= (int) sizeof(connection);
                 break;
 
             case BL_STR_NO_MATCH:
             case BL_STR_NO_MATCH_YET:
+            default: // Known, but nothing to do with it (yet)
                 break;
         }
 
-        while (!ws_eat_whitespace(cli_con)) { // eat "\r\n"
+        while (!(ret = ws_eat_whitespace(cli_con))) { // eat "\r\n"
             // This will happen if we did not fully process a known key
             // or if we have an unknown key that we need to just skip.
             DEBUG_printf("Part of value unconsumed.\n");
             ws_consume_line(cli_con);
         }
+        if (ret < 0) {
+            return ret;
+        }
     }
     header_done:
 
     if (!websocket_upgrade) {
+        ws_handshake_free(&handshake);
         printf("Normal HTTP request recieved.\n");
 
-        // TODO: For now we just assume the header is a valid HTTP 1.1 GET request.
+        // HTTP/1.1 connections stay open unless the client says otherwise. (1.0 keep-alive is not worth it.)
+        int keep_alive = !http10 && !connection_cut && !ws_handshake_has_token(connection, "close")
+            ? WS_HTTP_KEEP_ALIVE : 0;
 
-        // Write the first part of the responce
-        ws_t_write(cli_con, ws_page_responce1, sizeof(ws_page_responce1) - 1, TCP_WRITE_FLAG_MORE);
+        if (!strcmp(path, "/stats")) {
+            return WS_HTTP_STATS | keep_alive;
+        }
+        if (!strcmp(path, "/stats.json")) {
+            return WS_HTTP_STATS | WS_HTTP_STATS_JSON | keep_alive;
+        }
 
-        char contentLenBuf[12];
-        sprintf(contentLenBuf, "%i", sizeof(index_html));
+        // TODO: For now we just assume the header is a valid HTTP 1.1 GET request.
 
-        ws_t_write(cli_con, contentLenBuf, strlen(contentLenBuf), TCP_WRITE_FLAG_MORE);
-        ws_t_write(cli_con, ws_page_responce2, sizeof(ws_page_responce2) - 1, TCP_WRITE_FLAG_MORE);
-        ws_t_write(cli_con, index_html, sizeof(index_html), 0);
+        // Everything is pre-built, just pick the right one.
+        bool accept_gzip = ws_handshake_accepts(accept_encoding, "gzip");
+        if (ws_handshake_etag_match(if_none_match, accept_gzip ? INDEX_HTML_GZ_ETAG : INDEX_HTML_ETAG)) {
+            // The browser already has it
+            if (accept_gzip) {
+                ws_t_write(cli_con, index_html_gz_not_modified, sizeof(index_html_gz_not_modified) - 1, 0);
+            } else {
+                ws_t_write(cli_con, index_html_not_modified, sizeof(index_html_not_modified) - 1, 0);
+            }
+        } else if (accept_gzip) {
+            ws_t_write(cli_con, index_html_gz_response, sizeof(index_html_gz_response) - 1, TCP_WRITE_FLAG_MORE);
+            ws_t_write(cli_con, index_html_gz, sizeof(index_html_gz), 0);
+        } else {
+            ws_t_write(cli_con, index_html_response, sizeof(index_html_response) - 1, TCP_WRITE_FLAG_MORE);
+            ws_t_write(cli_con, index_html, sizeof(index_html), 0);
+        }
 
         // Flush the output? I am not really sure if this is needed or even wanted.
         //tcp_output(cli_con->printed_circuit_board);
@@ -536,6 +1410,29 @@ size_t do_ws_header(ws_cliant_con* cli_con) {
 
         DEBUG_printf("Header sent.\n");
 
+        return keep_alive ? WS_HTTP_KEEP_ALIVE : IOL_YIELD_REASON_END;
+    }
+
+    // Make sure it's an upgrade we can do before agreeing to it. The key goes last, it has the hash to finish.
+    const char* reject = NULL;
+    if (strcmp(version, WS_HANDSHAKE_VERSION)) {
+        DEBUG_printf("Unsupported Sec-WebSocket-Version: %s\n", version);
+        reject = ws_responce_bad_version;
+    } else if (connection_cut) {
+        DEBUG_printf("Connection header too long.\n");
+        reject = ws_responce_bad_request;
+    } else if (!ws_handshake_has_token(connection, "upgrade")) {
+        DEBUG_printf("Connection: %s, not upgrade.\n", connection);
+        reject = ws_responce_bad_request;
+    } else if (key_count != 1 || key_bad || ws_handshake_key_finish(&handshake)) {
+        DEBUG_printf("Bad Sec-WebSocket-Key.\n");
+        reject = ws_responce_bad_request;
+    }
+    ws_handshake_free(&handshake); // The accept key stays
+
+    if (reject) {
+        ws_t_write(cli_con, reject, strlen(reject), 0);
+        ws_t_write_barrier(cli_con);
         return IOL_YIELD_REASON_END;
     }
 
@@ -543,16 +1440,20 @@ size_t do_ws_header(ws_cliant_con* cli_con) {
     ws_t_write(cli_con, ws_responce1, sizeof(ws_responce1) - 1, TCP_WRITE_FLAG_MORE);
 
     // Write the Accept key
-    char hashBuf[20];
-    char baseBuf[28];
-    memcpy(wsKey + WS_KEY_LEN, ws_uuid, sizeof(ws_uuid));
-    mbedtls_sha1_ret(wsKey, WS_KEY_LEN + (sizeof(ws_uuid) - 1), hashBuf);
-    encode_base64(baseBuf, hashBuf, 20);
+    ws_t_write(cli_con, handshake.accept, WS_HANDSHAKE_ACCEPT_LEN, TCP_WRITE_FLAG_MORE);
 
-    ws_t_write(cli_con, baseBuf, sizeof(baseBuf), TCP_WRITE_FLAG_MORE);
-
-    // Write the first last of the responce
-    ws_t_write(cli_con, ws_responce2, sizeof(ws_responce2) - 1, 0);
+    // Write the last of the responce. A subprotocol only if they asked for one we have.
+    if (protocol_chat) {
+        ws_t_write(cli_con, ws_responce_protocol, sizeof(ws_responce_protocol) - 1, TCP_WRITE_FLAG_MORE);
+    } else if (protocol_requested) {
+        DEBUG_printf("No subprotocol we know, going without.\n");
+    }
+    if (deflate.enabled) {
+        ws_t_write(cli_con, ws_responce_extensions, sizeof(ws_responce_extensions) - 1, TCP_WRITE_FLAG_MORE);
+        ws_t_write(cli_con, extensions, ws_handshake_deflate_response(&deflate, extensions, sizeof(extensions)),
+                   TCP_WRITE_FLAG_MORE);
+    }
+    ws_t_write(cli_con, ws_responce_end, sizeof(ws_responce_end) - 1, 0);
 
     // Flush the output? I am not really sure if this is needed or even wanted.
     //tcp_output(cli_con->printed_circuit_board);
@@ -562,8 +1463,25 @@ size_t do_ws_header(ws_cliant_con* cli_con) {
 
     DEBUG_printf("Header sent.\n");
 
+    *deflate_out = deflate;
+    return WS_HTTP_UPGRADED;
+}
+
+/**
+ * @brief Runs an upgraded connection. Called after do_ws_header() returned, so the header
+ * parsing is not on the (small) stack the whole time.
+ */
+int ws_websocket_session(ws_cliant_con* cli_con, const ws_deflate_params* deflate) {
+    int ret;
+
     ws_framinator framinator;
-    websocket_initialize_framinator(&framinator, cli_con);
+    if ((ret = websocket_initialize_framinator(&framinator, cli_con))) {
+        return ret;
+    }
+    if (deflate->enabled && (ret = websocket_enable_deflate(&framinator, deflate))) {
+        websocket_deinit_framinator(&framinator);
+        return ret;
+    }
 
     //char cool_message[] = "The PI Pico now has WebSockets!\n";
     //websocket_write(&framinator, cool_message, sizeof(cool_message) - 1); // subtract the null char
@@ -571,33 +1489,79 @@ size_t do_ws_header(ws_cliant_con* cli_con) {
     //websocket_write(&framinator, cool_message, sizeof(cool_message) - 1); // subtract the null char
     //websocket_flush(&framinator);
 
-    while (true) {
-        char command; // 0 = off, 1 = on, 2 = toggle
+    ret = ws_websocket_loop(cli_con, &framinator);
+    websocket_deinit_framinator(&framinator);
+    return ret;
+}
 
-        if ((ret = websocket_read(&framinator, &command, 1))) {
-            return ret;
+/**
+ * @brief Runs the TLS handshake on a connection accepted on WS_TLS_PORT. Afterwards ws_read() and
+ * friends see plaintext and ws_t_write() seals records. A returning client is resumed from tls_server's cache.
+ *
+ * @param cli_con
+ * @return int ERR_OK or a negative error code
+ */
+int ws_tls_open(ws_cliant_con* cli_con) {
+    int ret;
+    int err = ERR_OK;
+
+    mbedtls_ssl_context* tls = malloc(sizeof(mbedtls_ssl_context));
+    if (!tls) {
+        return ERR_MEM;
+    }
+    if ((ret = ws_tls_setup(tls_server, tls, cli_con, ws_tls_bio_send, ws_tls_bio_recv))) {
+        DEBUG_printf("TLS setup failed -0x%04x\n", -ret);
+        err = ERR_MEM;
+    }
+
+    while (!err && (ret = mbedtls_ssl_handshake(tls))) {
+        if (cli_con->printed_circuit_board != NULL) {
+            tcp_output(cli_con->printed_circuit_board);
         }
 
-        if (command == '1') {
-            gpio_put(11, 1); // on
-        } else if (command == '0') {
-            gpio_put(11, 0); // off
-        } else if (command == '2') {
-            gpio_put(11, !gpio_get(11)); // toggle
-        } else if (command == 'b') {
-            char number_str[10];
-            sprintf(number_str, "%d", adc_read());
-            websocket_write(&framinator, number_str, strlen(number_str));
-            websocket_flush(&framinator);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ) {
+            err = ws_t_wait_read(cli_con);
+        } else if (ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            err = (int) ws_t_yield(cli_con, WS_T_YIELD_REASON_WAIT_FOR_ACK);
+        } else {
+            DEBUG_printf("TLS handshake failed -0x%04x\n", -ret);
+            err = cli_con->printed_circuit_board == NULL ? ERR_CLSD : ERR_VAL;
         }
+    }
 
-        printf("%c", command);
+    if (err) {
+        mbedtls_ssl_free(tls);
+        free(tls);
+        return err;
+    }
 
-        // o god. I wanted to write messages in a loop, but we need a threaded sleep!
-        //sleep_ms(1000);
+    if (cli_con->printed_circuit_board != NULL) {
+        tcp_output(cli_con->printed_circuit_board); // Our Finished
     }
+    cli_con->tls = tls;
+    return ERR_OK;
+}
 
-    return IOL_YIELD_REASON_END; // TODO: Do more stuff with this task? Will a new task be started?
+/**
+ * @brief Says close_notify (if the connection is still there) and frees the TLS state.
+ */
+void ws_tls_close(ws_cliant_con* cli_con) {
+    if (cli_con->tls) {
+        if (cli_con->printed_circuit_board != NULL) {
+            mbedtls_ssl_close_notify(cli_con->tls); // Best effort, it's not waited for.
+        }
+        mbedtls_ssl_free(cli_con->tls);
+        free(cli_con->tls);
+        cli_con->tls = NULL;
+    }
+    if (cli_con->tls_in) {
+        pbuf_free(cli_con->tls_in);
+        cli_con->tls_in = NULL;
+    }
+    cli_con->tls_in_fresh = false;
+    free(cli_con->tls_out);
+    cli_con->tls_out = NULL;
+    cli_con->tls_out_len = 0;
 }
 
 /**
@@ -615,7 +1579,8 @@ err_t ws_cli_con_close_pcb(ws_cliant_con* cli_con) {
         tcp_err(cli_con->printed_circuit_board, NULL);
         err = tcp_close(cli_con->printed_circuit_board);
         if (err != ERR_OK) {
-            DEBUG_printf("close failed %d, calling abort\n", err);
+            // Can be in the recv callback, no printing here
+            WS_TRACE_I(WS_TRACE_CLOSE_FAILED, cli_con->slot, err);
             tcp_abort(cli_con->printed_circuit_board);
             err = ERR_ABRT;
         }
@@ -632,13 +1597,72 @@ err_t ws_cli_con_close(ws_cliant_con* cli_con, err_t status) {
         DEBUG_printf("Connection closed with error: %d\n", status);
     }
 
-    return ws_cli_con_close_pcb(cli_con);
+    ws_tls_close(cli_con);
+    err_t err = ws_cli_con_close_pcb(cli_con);
+
+    // Whatever the client sent that we never got to
+    if (cli_con->p_current) {
+        pbuf_free(cli_con->p_current);
+        cli_con->p_current = NULL;
+    }
+    WS_STAT(ws_con_stats_add(&server_stats.closed, &cli_con->stats));
+    return err;
+}
+
+int ws_serve_stats(ws_cliant_con* cli_con, bool json);
+
+/**
+ * @brief do_ws_header(), then the /stats answer if that's what was asked for.
+ *
+ * @return int Same as do_ws_header(), without the WS_HTTP_STATS bits
+ */
+int ws_http_request(ws_cliant_con* cli_con, ws_deflate_params* deflate_out) {
+    int ret = do_ws_header(cli_con, deflate_out);
+
+    if (ret > 0 && (ret & WS_HTTP_STATS)) {
+        int err;
+        if ((err = ws_serve_stats(cli_con, ret & WS_HTTP_STATS_JSON))) {
+            return err;
+        }
+        return ret & WS_HTTP_KEEP_ALIVE ? WS_HTTP_KEEP_ALIVE : IOL_YIELD_REASON_END;
+    }
+    return ret;
 }
 
 size_t do_cli_con_task(sub_task* task, void* args) {
     ws_cliant_con* cli_con = (ws_cliant_con*) args;
 
-    return ws_cli_con_close(cli_con, do_ws_header(cli_con));
+    int ret;
+    ws_deflate_params deflate;
+
+    if (cli_con->secure && (ret = ws_tls_open(cli_con))) {
+        ws_cli_con_close(cli_con, ret);
+        return IOL_YIELD_REASON_END;
+    }
+
+    while ((ret = ws_http_request(cli_con, &deflate)) == WS_HTTP_KEEP_ALIVE) {
+        // Pipelined requests are already waiting in p_current. Otherwise give the browser a while to send another.
+        if (!cli_con->p_current) {
+            int fired = ws_t_wait_until(cli_con, WS_T_YIELD_REASON_READ, make_timeout_time_ms(WS_HTTP_KEEP_ALIVE_TIMEOUT_MS));
+            if (fired < 0) {
+                ret = fired == ERR_CLSD ? ERR_OK : fired; // Browser hung up, nothing wrong with that.
+                break;
+            }
+            if (!(fired & WS_T_YIELD_REASON_READ)) {
+                DEBUG_printf("Keep-alive connection idle\n");
+                ret = ERR_OK;
+                break;
+            }
+        }
+    }
+
+    if (ret == WS_HTTP_UPGRADED) {
+        ret = ws_websocket_session(cli_con, &deflate);
+    }
+
+    // Whatever the close says, the task is over. Anything but END would keep the slot (and stack) taken.
+    ws_cli_con_close(cli_con, ret);
+    return IOL_YIELD_REASON_END;
 }
 
 // ============= BETTER, BUT STILL KINDA BAD! =============
@@ -665,35 +1689,28 @@ static err_t tcp_cli_con_sent(void* arg, struct tcp_pcb* tpcb, u16_t len) {
     #error "You better check this before enabling LWIP_WND_SCALE!"
     #endif
 
-    // call all the ack_callback's
-    if (cli_con->ack_callback.call) {
+    // call all the ack_callback's. On TLS connections these are ciphertext bytes,
+    // ws_tls_write() already acked the plaintext.
+    if (cli_con->ack_callback.call && !cli_con->secure) {
         cli_con->ack_callback.call(cli_con->ack_callback.arg, len);
     }
 
-    cli_con->notify_ack = true;
-
-    printf("[_]");
-    // TODO: FIXME: Handling multiple like this may cause a problem when the task
-    // waits for the first reason, and then waits for the second reason. Thus
-    // hitting one after the other right here in the same ACK!
-    iol_notify(&cli_con->io_task, WS_T_YIELD_REASON_WAIT_FOR_ACK, ERR_OK);
-    iol_notify(&cli_con->io_task, WS_T_YIELD_REASON_FLUSH, ERR_OK);
+    WS_STAT(cli_con->stats.bytes_out += len);
+    WS_TRACE_V(WS_TRACE_ACKED, cli_con->slot, len);
+    iol_notify(&cli_con->io_task, WS_T_YIELD_REASON_WAIT_FOR_ACK | WS_T_YIELD_REASON_FLUSH, ERR_OK);
 
     return ERR_OK;
 }
 
 static void tcp_cli_con_err(void *arg, err_t err) {
-    DEBUG_printf("tcp_client_err_fn %d\n", err);
-
     ws_cliant_con* cli_con = (ws_cliant_con*)arg;
+    WS_TRACE_I(WS_TRACE_ERROR, cli_con->slot, err);
 
     // The PCB is already freed according to the tcp_err() spec.
     cli_con->printed_circuit_board = NULL;
 
-    // TODO: FIXME: See reason why this is bad in ACK handler.
-    iol_notify(&cli_con->io_task, WS_T_YIELD_REASON_READ, err);
-    iol_notify(&cli_con->io_task, WS_T_YIELD_REASON_WAIT_FOR_ACK, err);
-    iol_notify(&cli_con->io_task, WS_T_YIELD_REASON_FLUSH, err);
+    iol_notify(&cli_con->io_task,
+        WS_T_YIELD_REASON_READ | WS_T_YIELD_REASON_WAIT_FOR_ACK | WS_T_YIELD_REASON_FLUSH, err);
 }
 
 err_t tcp_cli_con_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
@@ -714,9 +1731,22 @@ err_t tcp_cli_con_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t er
     }
 
     //DEBUG_printf("tcp_cli_con_recv %d err %d\n", p->tot_len, err);
+    // p can be coalesced away (freed) below
+    u16_t len = p->tot_len;
+    WS_STAT(cli_con->stats.bytes_in += len);
+
+    if (cli_con->secure) {
+        // Ciphertext. mbedtls copies it out when the task gets to it (ws_tls_pump()). Until then it sits on the
+        // pool, at most a window's worth as it's not recved before that.
+        if (cli_con->tls_in) {
+            pbuf_cat(cli_con->tls_in, p);
+        } else {
+            cli_con->tls_in = p;
+        }
+        cli_con->tls_in_fresh = true;
 
     // We might have some un-processed pbufs if the subtask yielded for some other reason, stack the new ones on top.
-    if (cli_con->p_current) {
+    } else if (cli_con->p_current) {
         pbuf_cat(cli_con->p_current, p);
 
         // TODO: With multiple connections, the *total* number of 
@@ -727,14 +1757,20 @@ err_t tcp_cli_con_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t er
         // Coalesce the pbuf's when the chain gets kinda long. We could use memp_pools[MEMP_PBUF_POOL]->stats->used
         // or 
         if (memp_pools[MEMP_PBUF_POOL]->stats->used > (PBUF_POOL_SIZE / 3) * 2) {
-            cli_con->p_current = pbuf_coalesce(cli_con->p_current, PBUF_RAW);
+            WS_STAT(cli_con->stats.pbuf_coalesces++);
+            if (!cli_con->p_pinned) {
+                cli_con->p_current = pbuf_coalesce(cli_con->p_current, PBUF_RAW);
+            } else if (cli_con->p_current->next) {
+                // Leave the first one alone, it's tot_len stays the same.
+                cli_con->p_current->next = pbuf_coalesce(cli_con->p_current->next, PBUF_RAW);
+            }
         }
 
     } else {
         cli_con->p_current = p;
     }
 
-    printf("[#]");
+    WS_TRACE_V(WS_TRACE_RECV, cli_con->slot, len);
 
     iol_notify(&cli_con->io_task, WS_T_YIELD_REASON_READ, ERR_OK);
 
@@ -744,12 +1780,10 @@ err_t tcp_cli_con_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t er
 }
 
 static err_t tcp_cli_con_poll(void *arg, struct tcp_pcb *tpcb) {
-    // DEBUG_printf("tcp_cli_con_poll_fn\n");
-    // Basically a 10 second timeout for now.
+    ws_cliant_con* cli_con = (ws_cliant_con*)arg;
 
-    // TODO: implement connection timeouts.
-    // return tcp_cli_con_result(arg, -1);
-    DEBUG_printf("-");
+    // Connection timeouts are handled by the task (read_timeout_ms) using iol_timer.
+    WS_TRACE_V(WS_TRACE_POLL, cli_con->slot, 0);
 
     return ERR_OK;
 }
@@ -757,40 +1791,229 @@ static err_t tcp_cli_con_poll(void *arg, struct tcp_pcb *tpcb) {
 
 // ================ CLIANT CONNECTION ACCEPTER ================
 
-int reset_cli_con_for_new_client(ws_cliant_con* cli_con) {
-    // TODO: DELETE THIS FUNCTION! When we support multiple clients, new objects will be allocated.
-    // For now, just zero out the client connection specific parts of our mega struct while
-    // not touching the server stuff.
+typedef struct ws_server_ {
+    struct tcp_pcb* server_pcb;
+    // WS_TLS_PORT, NULL without WS_TLS
+    struct tcp_pcb* tls_server_pcb;
+
+    // Connection slots. A slot is free once its task has ended (or never ran).
+    // The task closes its pcb before it ends, so a done task means the slot can be handed out again.
+    // The stack goes back to the pool right after the task ends, see ws_server_release_done().
+    ws_cliant_con cli_cons[WS_MAX_SLOTS];
+} ws_server;
+
+// The one that's listening, for /stats and the main loop
+ws_server* stats_server = NULL;
+
+#if MEMP_STATS
+// MEMP_* enum names, in the order of memp_pools
+static const char* const ws_memp_names[] = {
+#define LWIP_MEMPOOL(name, num, size, desc) #name,
+#include "lwip/priv/memp_std.h"
+};
+#endif
 
-    if (cli_con->task != NULL && !sub_task_reset(cli_con->task)) {
-        // There is likely already an active connection
-        DEBUG_printf("Failed to reset the task.\n");
-        return ERR_INPROGRESS;
+/**
+ * @brief Formats server_stats, the counters of every active connection, their total
+ * (closed connections included) and lwIP's pools and heap.
+ */
+void ws_server_format_stats(ws_server* server, ws_stats_buf* out) {
+    // Long enough for "memp." and the longest pool name
+    char prefix[32];
+
+    ws_stats_begin(out);
+    ws_stats_u32(out, NULL, "uptime_ms", to_ms_since_boot(get_absolute_time()));
+    ws_stats_u32(out, NULL, "accepted", server_stats.accepted);
+    ws_stats_u32(out, NULL, "rejected", server_stats.rejected);
+    ws_stats_u32(out, NULL, "accept_errors", server_stats.accept_errors);
+
+    ws_con_stats total = server_stats.closed;
+    ws_stats_begin_array(out, "connections");
+    for (int i = 0; server && i < WS_MAX_SLOTS; i++) {
+        ws_cliant_con* cli_con = &server->cli_cons[i];
+        if (iol_task_done(&cli_con->io_task)) {
+            continue;
+        }
+        ws_con_stats_add(&total, &cli_con->stats);
+
+        snprintf(prefix, sizeof(prefix), "con.%d.", i);
+        ws_stats_begin_object(out, NULL);
+        ws_stats_u32(out, prefix, "slot", i);
+        ws_stats_bool(out, prefix, "secure", cli_con->secure);
+        ws_stats_con(out, prefix, &cli_con->stats);
+        ws_stats_end_object(out);
+    }
+    ws_stats_end_array(out);
+
+    ws_stats_begin_object(out, "total");
+    ws_stats_con(out, "total.", &total);
+    ws_stats_end_object(out);
+
+#if MEMP_STATS
+    ws_stats_begin_object(out, "memp");
+    for (int i = 0; i < MEMP_MAX; i++) {
+        const struct stats_mem* pool = memp_pools[i]->stats;
+        snprintf(prefix, sizeof(prefix), "memp.%s.", ws_memp_names[i]);
+        ws_stats_begin_object(out, ws_memp_names[i]);
+        ws_stats_u32(out, prefix, "used", pool->used);
+        ws_stats_u32(out, prefix, "max", pool->max);
+        ws_stats_u32(out, prefix, "avail", pool->avail);
+        ws_stats_u32(out, prefix, "err", pool->err);
+        ws_stats_end_object(out);
     }
+    ws_stats_end_object(out);
+#endif
 
-    cli_con->ack_callback.call = NULL;
-    // cli_con->io_task handled cleanly by iol_task_run
-    cli_con->notify_ack = 0;
-    cli_con->p_current = NULL;
-    cli_con->printed_circuit_board = NULL;
-    cli_con->recved_current = 0;
-    cli_con->task = NULL;
+#if MEM_STATS
+    ws_stats_begin_object(out, "mem");
+    ws_stats_u32(out, "mem.", "used", lwip_stats.mem.used);
+    ws_stats_u32(out, "mem.", "max", lwip_stats.mem.max);
+    ws_stats_u32(out, "mem.", "avail", lwip_stats.mem.avail);
+    ws_stats_u32(out, "mem.", "err", lwip_stats.mem.err);
+    ws_stats_end_object(out);
+#endif
 
-    return ERR_OK;
+    ws_stats_end(out);
 }
 
-// goes in ---> tcp_accept()
-// A new client connection is accepted.
-static err_t tcp_server_accept(void *arg, struct tcp_pcb *client_pcb, err_t err) {
-    ws_cliant_con* cli_con = (ws_cliant_con*)arg;
-    if (err != ERR_OK || client_pcb == NULL || (err = reset_cli_con_for_new_client(cli_con))) {
-        DEBUG_printf("Failure in accept: %i\n", err);
+/**
+ * @brief Answers GET /stats (text) or /stats.json.
+ *
+ * @param cli_con
+ * @param json
+ * @return int ERR_OK or a negative error code
+ */
+int ws_serve_stats(ws_cliant_con* cli_con, bool json) {
+    int ret;
+
+    // lwIP copies it. The pcb can be closed (and still retransmitting) by the time the barrier gives up,
+    // so nothing it sends may point in here.
+    char* body = malloc(WS_STATS_BODY_LEN);
+    if (!body) {
+        ws_t_write(cli_con, ws_responce_unavailable, sizeof(ws_responce_unavailable) - 1, 0);
+        ws_t_write_barrier(cli_con);
+        return ERR_MEM;
+    }
+
+    ws_stats_buf out;
+    ws_stats_buf_init(&out, body, WS_STATS_BODY_LEN, json);
+    ws_server_format_stats(stats_server, &out);
+    if (out.truncated) {
+        DEBUG_printf("Stats cut off at %u bytes\n", out.len);
+    }
+
+    char header[sizeof(ws_responce_stats) + 24];
+    int header_len = snprintf(header, sizeof(header), ws_responce_stats,
+        json ? "application/json" : "text/plain", (unsigned) out.len);
+
+    if (!(ret = ws_t_write(cli_con, header, header_len, TCP_WRITE_FLAG_COPY | TCP_WRITE_FLAG_MORE))) {
+        ret = ws_t_write(cli_con, body, out.len, TCP_WRITE_FLAG_COPY);
+    }
+    ws_t_write_barrier(cli_con);
+    free(body);
+    return ret;
+}
+
+/**
+ * @brief The text /stats to the UART.
+ */
+void ws_server_print_stats() {
+    char* body = malloc(WS_STATS_BODY_LEN);
+    if (!body) {
+        return;
+    }
+    ws_stats_buf out;
+    ws_stats_buf_init(&out, body, WS_STATS_BODY_LEN, false);
+    ws_server_format_stats(stats_server, &out);
+    printf("%s", body);
+    free(body);
+}
+
+/**
+ * @brief Gives the stacks of the connection tasks that have ended back to their pools, which records
+ * how much of each was used and whether it overflowed. Main loop only: the paint scan and the prints
+ * are no job for an lwIP callback. Call it after iol_run_ready(), with lwIP locked out.
+ *
+ * @param server
+ */
+void ws_server_release_done(ws_server* server) {
+    for (int i = 0; server && i < WS_MAX_SLOTS; i++) {
+        ws_cliant_con* cli_con = &server->cli_cons[i];
+        if (cli_con->task != NULL && iol_task_done(&cli_con->io_task)) {
+            int used = sub_task_pool_release(task_pools, TASK_POOLS_LEN, cli_con->task);
+            DEBUG_printf("Connection task used %i stack bytes\n", used);
+            cli_con->task = NULL;
+        }
+    }
+}
+
+/**
+ * @brief Finds a free connection slot and resets it for a new client.
+ *
+ * @param server
+ * @param secure Accepted on WS_TLS_PORT, it needs a stack from the TLS size class
+ * @return ws_cliant_con* The claimed slot or NULL if all slots are busy
+ */
+ws_cliant_con* ws_server_claim_cli_con(ws_server* server, bool secure) {
+    for (int i = 0; i < WS_MAX_SLOTS; i++) {
+        ws_cliant_con* cli_con = &server->cli_cons[i];
+
+        if (!iol_task_done(&cli_con->io_task)) {
+            continue; // There is an active connection on this slot
+        }
+        if (cli_con->task != NULL) {
+            continue; // Ended, but ws_server_release_done() has not given the stack back yet
+        }
+
+        iol_timer_cancel(&cli_con->timer);
+
+        // Plain connections stick to the first size class, the TLS stacks are kept for wss://.
+        sub_task* task = sub_task_pool_alloc(task_pools, secure ? TASK_POOLS_LEN : 1,
+            secure ? WS_TLS_CON_STACK_SIZE : WS_CLI_CON_STACK_SIZE);
+        if (!task) {
+            return NULL;
+        }
+
+        cli_con->ack_callback.call = NULL;
+        // cli_con->io_task handled cleanly by iol_task_run
+        cli_con->p_current = NULL;
+        cli_con->p_pinned = false;
+        cli_con->printed_circuit_board = NULL;
+        cli_con->recved_current = 0;
+        cli_con->task = task;
+        iol_timer_init(&cli_con->timer, &cli_con->io_task);
+        cli_con->read_timeout_ms = WS_READ_TIMEOUT_MS;
+        cli_con->secure = secure;
+        cli_con->tls = NULL;
+        cli_con->tls_in = NULL;
+        cli_con->tls_in_fresh = false;
+        cli_con->tls_out = NULL;
+        cli_con->tls_out_len = 0;
+        memset(&cli_con->stats, 0, sizeof(cli_con->stats));
+        cli_con->slot = i;
+
+        return cli_con;
+    }
+    return NULL;
+}
+
+// A new client connection is accepted, on either port.
+static err_t ws_server_accept(ws_server* server, struct tcp_pcb *client_pcb, err_t err, bool secure) {
+    ws_cliant_con* cli_con;
+    if (err != ERR_OK || client_pcb == NULL) {
+        WS_TRACE_I(WS_TRACE_ACCEPT_ERROR, secure, err);
+        WS_STAT(server_stats.accept_errors++);
         return ERR_VAL;
     }
-    DEBUG_printf("Client connected\n");
+    if (!(cli_con = ws_server_claim_cli_con(server, secure))) {
+        WS_TRACE_I(WS_TRACE_REJECT, secure, 0);
+        WS_STAT(server_stats.rejected++);
+        return ERR_MEM;
+    }
+    WS_STAT(server_stats.accepted++);
+    WS_TRACE_I(WS_TRACE_ACCEPT, cli_con->slot, secure);
 
     cli_con->printed_circuit_board = client_pcb;
-    cli_con->task = task_ws_header; // TODO: make the task more local to the connection
 
     tcp_arg(client_pcb, cli_con);
     tcp_sent(client_pcb, tcp_cli_con_sent);
@@ -799,63 +2022,98 @@ static err_t tcp_server_accept(void *arg, struct tcp_pcb *client_pcb, err_t err)
     tcp_poll(client_pcb, tcp_cli_con_poll, 2); // 1 second polling (2 "TCP coarse grained timer shots")
     tcp_err(client_pcb, tcp_cli_con_err);
 
-    // It will just run until it needs bytes and wait
+    // Queued up. It will run from the main loop until it needs bytes and wait
     size_t ret = iol_task_run(&cli_con->io_task, ws_check_reason, cli_con, cli_con->task, do_cli_con_task, cli_con);
 
     //return tcp_server_send_data(arg, cli_con->printed_circuit_board);
     return ret;
 }
 
+// goes in ---> tcp_accept()
+static err_t tcp_server_accept(void *arg, struct tcp_pcb *client_pcb, err_t err) {
+    return ws_server_accept((ws_server*) arg, client_pcb, err, false);
+}
+
+static err_t tcp_server_accept_tls(void *arg, struct tcp_pcb *client_pcb, err_t err) {
+    return ws_server_accept((ws_server*) arg, client_pcb, err, true);
+}
+
 // ================ MAIN FUNCTIONS ================
 
-static bool tcp_server_open(ws_cliant_con* cli_con) {
-    DEBUG_printf("Starting server at %s on port %u\n", ip4addr_ntoa(netif_ip4_addr(netif_list)), TCP_PORT);
+static struct tcp_pcb* tcp_server_listen(ws_server* server, u16_t port, int backlog, tcp_accept_fn accept) {
+    DEBUG_printf("Starting server at %s on port %u\n", ip4addr_ntoa(netif_ip4_addr(netif_list)), port);
 
     struct tcp_pcb *pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
     if (!pcb) {
         DEBUG_printf("failed to create pcb\n");
-        return false;
+        return NULL;
     }
 
-    err_t err = tcp_bind(pcb, NULL, TCP_PORT);
+    err_t err = tcp_bind(pcb, NULL, port);
     if (err) {
-        DEBUG_printf("failed to bind to port %u\n", TCP_PORT);
-        return false;
+        DEBUG_printf("failed to bind to port %u\n", port);
+        return NULL;
     }
 
-    cli_con->server_pcb = tcp_listen_with_backlog(pcb, 1);
-    if (!cli_con->server_pcb) {
+    struct tcp_pcb* listen_pcb = tcp_listen_with_backlog(pcb, backlog);
+    if (!listen_pcb) {
         DEBUG_printf("failed to listen\n");
         if (pcb) {
             tcp_close(pcb);
         }
+        return NULL;
+    }
+
+    tcp_arg(listen_pcb, server);
+    tcp_accept(listen_pcb, accept);
+
+    return listen_pcb;
+}
+
+static bool tcp_server_open(ws_server* server) {
+    server->server_pcb = tcp_server_listen(server, TCP_PORT, WS_MAX_CONNECTIONS, tcp_server_accept);
+    if (!server->server_pcb) {
         return false;
     }
 
-    tcp_arg(cli_con->server_pcb, cli_con);
-    tcp_accept(cli_con->server_pcb, tcp_server_accept);
+#if WS_TLS
+    // The plain port keeps working without it.
+    int ret;
+    if (!(tls_server = malloc(sizeof(ws_tls_server)))) {
+        return true;
+    }
+    if ((ret = ws_tls_server_init(tls_server, ws_tls_cert, sizeof(ws_tls_cert), ws_tls_key, sizeof(ws_tls_key)))) {
+        DEBUG_printf("TLS setup failed -0x%04x, no wss://\n", -ret);
+        ws_tls_server_free(tls_server);
+        free(tls_server);
+        tls_server = NULL;
+        return true;
+    }
+    server->tls_server_pcb = tcp_server_listen(server, WS_TLS_PORT, WS_TLS_MAX_CONNECTIONS, tcp_server_accept_tls);
+#endif
 
     return true;
 }
 
 void run_tcp_server_test() {
-    // TODO: use a server struct and allocate this later?
-    ws_cliant_con* cli_con = calloc(1, sizeof(ws_cliant_con));
-    if (!cli_con) {
+    // All slots start out free (zeroed io_task)
+    ws_server* server = calloc(1, sizeof(ws_server));
+    if (!server) {
         return;
     }
+    stats_server = server;
 
-    if (!tcp_server_open(cli_con)) {
+    if (!tcp_server_open(server)) {
         DEBUG_printf("Server failed to open :(\n");
         return;
     }
-    // TODO: deallocate ws_cliant_con later
+    // TODO: deallocate ws_server later
 
-    //TODO: move server deconstruction to its own function/struct
-    /*if (cli_con->server_pcb) {
-        tcp_arg(cli_con->server_pcb, NULL);
-        tcp_close(cli_con->server_pcb);
-        cli_con->server_pcb = NULL;
+    //TODO: move server deconstruction to its own function
+    /*if (server->server_pcb) {
+        tcp_arg(server->server_pcb, NULL);
+        tcp_close(server->server_pcb);
+        server->server_pcb = NULL;
     }*/
 }
 
@@ -874,9 +2132,11 @@ int main() {
     adc_gpio_init(26);
     adc_select_input(0);
 
-    SUB_TASK_GLOBAL_INIT(task_ws_header)
-
     iol_init(); // ugly global init thingy
+    iol_timer_init_wheel();
+    for (int i = 0; i < TASK_POOLS_LEN; i++) {
+        sub_task_pool_init(&task_pools[i]);
+    }
 
     if (cyw43_arch_init_with_country(CYW43_COUNTRY_USA)) {
         printf("Wi-Fi init failed\n");
@@ -948,9 +2208,14 @@ int main() {
     printf("Connected to wifi with IP: %s\n", ip4addr_ntoa(netif_ip4_addr(&cyw43_state.netif[0])));
 
     // Start our test server. Interrupts or calls to cyw43_arch_poll/cyw43_arch_wait_for_work_until
-    // should be all it need to keep it alive.
+    // keep it alive, iol_run_ready() runs the connection tasks.
     run_tcp_server_test();
 
+    bool led_on = false;
+    absolute_time_t next_blink = make_timeout_time_ms(100);
+    // Print the trace as it comes in. 'l' toggles it, 't' dumps the ring either way.
+    bool trace_live = true;
+
     while (true) {
 
         if (uart_is_readable(uart_default)) {
@@ -972,41 +2237,59 @@ int main() {
                     break;
                 case 's':
                     stats_display();
+                    sub_task_pool_print_stats(task_pools, TASK_POOLS_LEN);
+                    ws_server_print_stats();
+                    break;
+                case 't':
+                    ws_trace_dump();
+                    break;
+                case 'l':
+                    trace_live = !trace_live;
                     break;
             }
         }
 
-        cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, 1);
-
 #if PICO_CYW43_ARCH_POLL
         // if you are using pico_cyw43_arch_poll, then you must poll periodically from your
         // main loop (not from a timer) to check for Wi-Fi driver or lwIP work that needs to be done.
         cyw43_arch_poll();
-        // you can poll as often as you like, however if you have nothing else to do you can
-        // choose to sleep until either a specified time, or cyw43_arch_poll() has work to do:
-        cyw43_arch_wait_for_work_until(make_timeout_time_ms(100));
-#else
-        // if you are not using pico_cyw43_arch_poll, then WiFI driver and lwIP work
-        // is done via interrupt in the background. This sleep is just an example of some (blocking)
-        // work you might be doing.
-        sleep_ms(100);
 #endif
 
+        // Timers notify tasks that are sleeping or waiting with a timeout.
+        iol_timer_advance(get_absolute_time());
+
+        // The lwIP callbacks only notify the connection tasks. They get to run here, in thread mode,
+        // so a slow task does not hold up the network stack's interrupt.
+        // The tasks call into lwIP, so keep the lwIP work in the background out while they run.
+        cyw43_arch_lwip_begin();
+        iol_run_ready();
+        // The tasks that just ended are done with their stacks
+        ws_server_release_done(stats_server);
+        cyw43_arch_lwip_end();
+
+        // What the callbacks and tasks traced, printed out here where blocking on the UART is fine.
+        if (trace_live) {
+            ws_trace_drain(WS_TRACE_DRAIN_PER_LOOP);
+        }
+
+        if (time_reached(next_blink)) {
+            led_on = !led_on;
+            cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, led_on);
+            next_blink = make_timeout_time_ms(100);
+        }
 
-        cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, 0);
+        if (iol_has_ready()) {
+            continue; // More work came in while we were busy (or a task got re-queued)
+        }
 
 #if PICO_CYW43_ARCH_POLL
-        // if you are using pico_cyw43_arch_poll, then you must poll periodically from your
-        // main loop (not from a timer) to check for Wi-Fi driver or lwIP work that needs to be done.
-        cyw43_arch_poll();
         // you can poll as often as you like, however if you have nothing else to do you can
         // choose to sleep until either a specified time, or cyw43_arch_poll() has work to do:
-        cyw43_arch_wait_for_work_until(make_timeout_time_ms(100));
+        cyw43_arch_wait_for_work_until(absolute_time_min(next_blink, iol_timer_next_tick()));
 #else
-        // if you are not using pico_cyw43_arch_poll, then WiFI driver and lwIP work
-        // is done via interrupt in the background. This sleep is just an example of some (blocking)
-        // work you might be doing.
-        sleep_ms(100);
+        // WiFI driver and lwIP work is done via interrupt in the background.
+        // Sleep until a notification (iol_notify does a __sev()), a timer or it's time to blink.
+        best_effort_wfe_or_timeout(absolute_time_min(next_blink, iol_timer_next_tick()));
 #endif
 
         // TODO: What happens if the wifi link goes down? will the server/connections error out?
@@ -2,16 +2,54 @@
 #include <stdint.h>
 #include <stdalign.h>
 #include "lwip/err.h"
+#include "ws_deflate.h"
 
 // Arbetrary huristics
 #define WS_BUF_STARTING_LEN 1024
+// The ring grows (doubling) up to this while the connection is limited by it rather than by TCP.
+#define WS_BUF_MAX_LEN TCP_SND_BUF
+// Ring bytes handed to TCP and not ack'ed yet. The next frame waits for ACKs rather than going past it.
+// Control frames (websocket_send_control()) go out behind what TCP has, so this is what a pong or close
+// can be stuck behind, instead of all of TCP_SND_BUF.
+#ifndef WS_RING_MAX_IN_TCP
+#define WS_RING_MAX_IN_TCP (TCP_SND_BUF / 2)
+#endif
+// The ring is freed whenever nothing is queued in it or in flight, and allocated again (WS_BUF_STARTING_LEN)
+// by the next write. A grown ring is kept until it has not run out of space for this long.
+#define WS_BUF_SHRINK_AFTER_MS 2000
+// On the way out, how long to wait for the ring to be ack'ed before dropping the connection.
+#define WS_BUF_DRAIN_TIMEOUT_MS 2000
 #define WS_MAX_PAYLOAD_LEN 256 // maybe make this a small part of the buffer we allocate.
 #define WS_ITS_LARGE_ENOUGH_JUST_SEND_IT 192
+// Frames of a streamed message (websocket_message_begin()) can be larger, there is no latency to worry about.
+// Half the ring, so one frame can fill while the other one is in flight.
+#define WS_MAX_STREAM_FRAME_PAYLOAD_LEN(ws_con) ((ws_con)->buf_len / 2)
 #define WS_JUST_WRAP_ANYWAY_ITS_NOT_WORTH_IT_PAYLOAD_LEN 16
-
-// Lets plan on *NOT* sending a frame larger than 64KB.
-#define WS_MAX_NO_MASK_HEADER_LEN  (2 + 2)
+// Messages (all frames of it togeather) with more payload than this are not read, see max_message_len.
+#define WS_MAX_MESSAGE_LEN (16 * 1024)
+// Even when skipping, a frame longer than this means the client is up to no good. Close.
+#define WS_MAX_SKIP_LEN (1024 * 1024)
+
+// permessage-deflate. A frame is compressed into a scratch buffer of this size and only sent compressed
+// if it got smaller. Frames that can't possibly fit in it compressed are not tried.
+#define WS_DEFLATE_SCRATCH_LEN WS_MAX_PAYLOAD_LEN
+#define WS_DEFLATE_MAX_LEN (4 * WS_DEFLATE_SCRATCH_LEN)
+// Not worth it for less than this
+#define WS_DEFLATE_MIN_LEN 32
+// First guess of the inflated size of a message (or 4x the compressed size if that is more). Doubled until it fits.
+#define WS_INFLATE_STARTING_LEN 256
+
+// Small frames wait at most this long for more data before they are sent anyway.
+#define WS_COALESCE_MAX_DELAY_MS 20
+
+#define WS_MAX_NO_MASK_HEADER_LEN  (2 + 8)
 #define WS_MAX_MASK_HEADER_LEN     (WS_MAX_NO_MASK_HEADER_LEN + 4)
+// Room for the header is kept in front of every frame's payload, and the header is written right
+// before the payload once its length is known. A frame starts out with room for the short header and
+// websocket_write_ring() makes room for the 16 bit extended length when the payload gets that long.
+// No frame we build needs the 64 bit one. Unused bytes in front of the header are scratch.
+#define WS_SHORT_HEADER_LEN 2
+#define WS_16BIT_HEADER_LEN (2 + 2)
 
 #define WS_MRK_FLAG_WRAP 0x40000000
 #define WS_MRK_SCRATCH_LEN(val)        ((uint32_t)val << 24)
@@ -19,10 +57,11 @@
 #define WS_MRK_LEN(val)                ((uint32_t)val)
 #define WS_MRK_GET_LEN(packed)         ((uint32_t)packed & 0x00FFFFFF)
 
-#define WS_HEADER_FIN_old  0x8000 // TODO: switch to little endian
 #define WS_HEADER_FIN      0x0080
+#define WS_HEADER_RSV1     0x0040 // Compressed message (permessage-deflate)
+#define WS_HEADER_RSV2     0x0020
+#define WS_HEADER_RSV3     0x0010
 #define WS_HEADER_GET_OPCODE(code) ((uint16_t)code & 0x000F)
-#define WS_HEADER_OPCODE(code) ((uint16_t)code << 8) // TODO: switch endian here and where it is used.
 #define WS_HEADER_OPCODE_CONTINUATION 0x0
 #define WS_HEADER_OPCODE_TEXT         0x1
 #define WS_HEADER_OPCODE_DATA         0x2
@@ -35,6 +74,45 @@
 #define WS_HEADER_PAYLOAD_LEN_USE_16BIT 126
 #define WS_HEADER_PAYLOAD_LEN_USE_64BIT 127
 
+#define WS_HEADER_OPCODE_IS_CONTROL(opcode) ((opcode) & 0x8)
+#define WS_CONTROL_MAX_PAYLOAD_LEN 125
+
+// Close status codes
+#define WS_CLOSE_NORMAL         1000
+#define WS_CLOSE_GOING_AWAY     1001
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+#define WS_CLOSE_TOO_BIG        1009
+#define WS_CLOSE_INTERNAL_ERROR 1011
+
+// Control frames that can be in flight at once. They skip the ring, so the ack callback
+// has to know where they are in the TCP stream.
+#define WS_CTRL_QUEUE_LEN 4
+
+/**
+ * @brief One of the buffers a websocket_writev() message is gathered from.
+ */
+typedef struct ws_iovec_ {
+    const void* iov_base;
+    size_t iov_len;
+} ws_iovec;
+
+/**
+ * @brief A control frame written straight to TCP (the priority lane) and the number of
+ * ring bytes that went out before it (after the previous control frame).
+ */
+typedef struct ws_ctrl_in_flight_ {
+    size_t ring_before;
+    size_t len;
+} ws_ctrl_in_flight;
+
+/**
+ * @brief Compressor and where it puts its output. Allocated when permessage-deflate was negotiated.
+ */
+typedef struct ws_framinator_deflate_ {
+    ws_deflate def;
+    uint8_t scratch[WS_DEFLATE_SCRATCH_LEN];
+} ws_framinator_deflate;
+
 typedef struct ws_framinator_ {
 
     ws_cliant_con* con;
@@ -43,19 +121,58 @@ typedef struct ws_framinator_ {
     // NOTE! To cleverly avoid copying all the time,
     // the max header length (that we will actually ever use) is allocated
     // at the beginning of this buffer!
+    // NULL when the ring was released (idle). Allocated again by the next write.
     char* buf;
     size_t buf_len;
 
+    // Elastic ring. Resizing does not wait for TCP: the old ring is retired and freed once the bytes
+    // TCP still points to in it have been ack'ed. Everything sent from it went out before anything
+    // from the new ring, so the first old_unacked ack'ed ring bytes are its.
+    char* old_buf;
+    size_t old_unacked;
+    // Ring bytes (old and current ring) handed to TCP and not ack'ed yet.
+    size_t ring_in_flight;
+    absolute_time_t last_stall;
+
     size_t head;
     size_t tail;
+    // How much of the frame at tail has been ack'ed so far. The marker at tail is never
+    // re-written, as TCP may still need to re-send the bytes after it.
+    size_t tail_acked;
+
+    // Priority lane. Control frames bypass whatever is being built in the ring.
+    ws_ctrl_in_flight ctrl[WS_CTRL_QUEUE_LEN];
+    int ctrl_len;
+    // Ring bytes written to TCP after the last control frame (or all un-ack'ed ones if ctrl_len == 0).
+    size_t ring_since_ctrl;
+
+    bool close_sent;
+    bool close_received;
 
     // Current marker/frame that we are building
     size_t current_marker;
-    // The frame's payload starts at (current_marker + sizeof(ws_buf_marker) + WS_MAX_NO_MASK_HEADER_LEN).
+    // The frame's payload starts at (current_marker + sizeof(ws_buf_marker) + current_header_room).
+    size_t current_header_room;
 
     // The current marker/frame's size. We will set this in the header just before writing it out.
     size_t current_payload_len;
 
+    // Opcode of frames from websocket_write() (outside of a streamed message).
+    uint8_t write_opcode;
+
+    // Streamed message (websocket_message_begin() to websocket_message_end()). Its frames don't have
+    // FIN set (except the last) and all but the first are continuations.
+    bool msg_streaming;
+    bool msg_fin;
+    uint8_t msg_opcode;
+    size_t msg_frames_sent;
+
+    // permessage-deflate, NULL if it was not negotiated (see websocket_enable_deflate()).
+    // Only messages that go out as a single frame are compressed, there is no context to keep that way.
+    ws_framinator_deflate* deflate;
+    // The frame about to be sent was compressed (RSV1)
+    bool frame_compressed;
+
     // example buf structure:
     // ...
     // <tail>--->
@@ -71,7 +188,7 @@ typedef struct ws_framinator_ {
     // <head>--->
     // ...
 
-    // When re-allocating the buffer, TCP must be flushed as it has references into the buffer.
+    // When re-allocating the buffer, TCP still has references into the old one (see old_buf).
     // Also correcting for a special case when wrapping around to fit in a ws_buf_marker would cause issues.
 
     // Huristics:
@@ -80,11 +197,16 @@ typedef struct ws_framinator_ {
     // 3.
 
 
-    // TODO: Timer that will go off after X amount of time has passed
-    // since the first element was placed on the buffer. This will prevent
-    // a small amout of data from getting stuck if the application pauses
-    // for a bit. Although, this is not so very important if the application
-    // sends us some hints.
+    // 4. Small frames are sent right away if nothing is in flight (like Nagle). Otherwise they
+    //    wait for more data, but no longer than WS_COALESCE_MAX_DELAY_MS after the first byte.
+    //    The application must call websocket_poll() by send_deadline (see websocket_send_deadline()).
+    //    websocket_read() also sends them before it has to wait for data.
+    // 5. websocket_cork() holds small frames until websocket_uncork(). Large frames still go out.
+    // 6. Running out of ring space while TCP could take more than the whole ring grows the ring
+    //    (up to WS_BUF_MAX_LEN). websocket_poll() frees it once nothing is queued or in flight (a grown
+    //    one once it has not run out of space for a while).
+    absolute_time_t send_deadline;
+    bool corked;
 
     uint64_t read_length;
 
@@ -100,6 +222,29 @@ typedef struct ws_framinator_ {
     // When the FIN bit is not set, we need to keep track of the last opcode
     // as the next frames will just have the CONTINUATION opcode.
     uint8_t  read_lastOp;
+    // Opcode of the frame we are reading (continuations already resolved to the message's opcode).
+    uint8_t  read_opcode;
+
+    // Payload of the current message so far, including the frame we are reading.
+    uint64_t read_message_len;
+    // Skip the rest of the current message. It was too large.
+    bool read_skip_message;
+
+    // Oversized messages are skipped (without reading them), or the connection is closed if close_oversized is set.
+    uint64_t max_message_len;
+    bool close_oversized;
+
+    // Bytes at the front of con->p_current that websocket_peek() already unmasked in place,
+    // but were not consumed yet. read_mask is already rotated past them.
+    size_t read_unmasked;
+
+    // Compressed message (RSV1). Its frames are gathered in inflate_in and inflated in one go once
+    // the last one is in. Then read_length bytes are read from inflated (at inflated_pos), not the pbufs.
+    bool read_compressed;
+    uint8_t* inflate_in;
+    size_t inflate_in_len;
+    uint8_t* inflated;
+    size_t inflated_pos;
 
 } ws_framinator;
 
@@ -116,54 +261,72 @@ typedef struct ws_buf_marker_ {
 } ws_buf_marker;
 
 /**
- * @brief Basically a websocket frame template.
+ * @brief Frees ack'ed frames from the ring.
  */
-typedef struct ws_frame_small_ {
-    ws_buf_marker marker; // Remember to use + sizeof(ws_buf_marker) + sizeof(uint16_t) bytes scratch
-    uint16_t empty_space;
-
-    // ----> <>
-    uint16_t header;      // <----- Send from here
-
-} ws_frame_small;
+void websocket_framinator_ack_ring(ws_framinator* framinator, size_t len) {
+
+    framinator->ring_in_flight -= len;
+    if (framinator->old_buf) {
+        // Retired ring first
+        size_t to_ack = MIN(len, framinator->old_unacked);
+        framinator->old_unacked -= to_ack;
+        len -= to_ack;
+        if (framinator->old_unacked == 0) {
+            free(framinator->old_buf);
+            framinator->old_buf = NULL;
+        }
+    }
 
-/**
- * @brief Basically a websocket large frame template.
- */
-typedef struct ws_frame_large_ {
-    ws_buf_marker marker; // Remember to use + sizeof(ws_buf_marker) bytes scratch
+    // Released (websocket_idle_ring()) with nothing of it in flight, there is nothing left to free.
+    while (len > 0 && framinator->buf) {
+        int flags_and_len = ((ws_buf_marker*) (framinator->buf + framinator->tail))->flags_and_len;
 
-    uint16_t header;      // <----- Send from here
-    uint16_t e_payload_len;
+        if (flags_and_len & WS_MRK_FLAG_WRAP) {
+            framinator->tail = 0;
+        } else {
+            size_t to_ack = MIN(len, WS_MRK_GET_LEN(flags_and_len) - framinator->tail_acked);
+            framinator->tail_acked += to_ack;
 
-} ws_frame_large;
+            if (framinator->tail_acked == WS_MRK_GET_LEN(flags_and_len)) {
+                // Fully consume the marker.
+                framinator->tail += WS_MRK_GET_LEN(flags_and_len) + WS_MRK_GET_SCRATCH_LEN(flags_and_len);
+                framinator->tail_acked = 0;
+            }
+            // else: Keep track of the partial ack. TCP still references the rest.
+            len -= to_ack;
+        }
+    }
+}
 
 err_t websocket_framinator_ack_callback(void* arg, u16_t len) {
     ws_framinator* framinator = (ws_framinator*) arg;
 
     while (len > 0) {
-        int flags_and_len = ((ws_buf_marker*) (framinator->buf + framinator->tail))->flags_and_len;
+        if (framinator->ctrl_len == 0) {
+            // Simple case, everything in flight came from the ring.
+            websocket_framinator_ack_ring(framinator, len);
+            framinator->ring_since_ctrl -= len;
+            break;
+        }
 
-        if (flags_and_len & WS_MRK_FLAG_WRAP) {
-            framinator->tail = 0;
+        ws_ctrl_in_flight* ctrl = &framinator->ctrl[0];
+        size_t to_ack;
+
+        if (ctrl->ring_before) {
+            // Ring bytes that were sent before the control frame
+            to_ack = MIN(len, ctrl->ring_before);
+            websocket_framinator_ack_ring(framinator, to_ack);
+            ctrl->ring_before -= to_ack;
         } else {
-            size_t to_ack = MIN(len, WS_MRK_GET_LEN(flags_and_len));
-            if (len >= to_ack) {
-                // Fully consume the last marker.
-                framinator->tail += to_ack + WS_MRK_GET_SCRATCH_LEN(flags_and_len);
-            } else {
-                // Advance the current marker, keep it aligned and keep track of padding bytes.
-                size_t advance = WS_MRK_GET_SCRATCH_LEN(flags_and_len) + to_ack;
-                size_t new_scratch = advance % alignof(ws_buf_marker);
-                advance -= new_scratch;
-                framinator->tail += advance;
-
-                ((ws_buf_marker*) (framinator->buf + framinator->tail))->flags_and_len =
-                          WS_MRK_SCRATCH_LEN(new_scratch)
-                        | WS_MRK_LEN(WS_MRK_GET_LEN(flags_and_len) - to_ack);
+            // The control frame its self. Nothing to free, it was copied.
+            to_ack = MIN(len, ctrl->len);
+            ctrl->len -= to_ack;
+            if (ctrl->len == 0) {
+                framinator->ctrl_len--;
+                memmove(&framinator->ctrl[0], &framinator->ctrl[1], framinator->ctrl_len * sizeof(ws_ctrl_in_flight));
             }
-            len -= to_ack;
         }
+        len -= to_ack;
     }
 
     return ERR_OK;
@@ -178,61 +341,266 @@ err_t websocket_initialize_framinator(ws_framinator* framinator, ws_cliant_con*
     framinator->buf_len = WS_BUF_STARTING_LEN;
     if(!(framinator->buf = malloc(framinator->buf_len)))
         return ERR_MEM;
+    framinator->old_buf = NULL;
+    framinator->old_unacked = 0;
+    framinator->ring_in_flight = 0;
+    framinator->last_stall = nil_time;
     framinator->tail = 0;
+    framinator->tail_acked = 0;
+
+    framinator->ctrl_len = 0;
+    framinator->ring_since_ctrl = 0;
+    framinator->close_sent = false;
+    framinator->close_received = false;
 
     framinator->current_marker = 0;
-    framinator->head = framinator->current_marker + sizeof(ws_buf_marker) + WS_MAX_NO_MASK_HEADER_LEN;
+    framinator->current_header_room = WS_SHORT_HEADER_LEN;
+    framinator->head = framinator->current_marker + sizeof(ws_buf_marker) + framinator->current_header_room;
+    ((ws_buf_marker*) (framinator->buf + framinator->current_marker))->flags_and_len = 0x00000000;
 
     framinator->current_payload_len = 0;
+    framinator->send_deadline = at_the_end_of_time;
+    framinator->corked = false;
+
+    framinator->write_opcode = WS_HEADER_OPCODE_TEXT;
+    framinator->msg_streaming = false;
+    framinator->msg_fin = false;
+    framinator->msg_opcode = WS_HEADER_OPCODE_TEXT;
+    framinator->msg_frames_sent = 0;
+    framinator->deflate = NULL;
+    framinator->frame_compressed = false;
 
     framinator->read_length = 0;
     framinator->read_mask = 0;
     framinator->read_lastOp = 0;
+    framinator->read_opcode = 0;
+    framinator->read_unmasked = 0;
+    framinator->read_message_len = 0;
+    framinator->read_skip_message = false;
+    framinator->max_message_len = WS_MAX_MESSAGE_LEN;
+    framinator->close_oversized = false;
+    framinator->read_compressed = false;
+    framinator->inflate_in = NULL;
+    framinator->inflate_in_len = 0;
+    framinator->inflated = NULL;
+    framinator->inflated_pos = 0;
 
     return ERR_OK;
 }
 
-void websocket_complete_and_send_frame(ws_framinator* ws_con) {
+/**
+ * @brief Turns on permessage-deflate with what the handshake agreed on.
+ */
+err_t websocket_enable_deflate(ws_framinator* framinator, const ws_deflate_params* params) {
+    if (!framinator->deflate && !(framinator->deflate = malloc(sizeof(ws_framinator_deflate)))) {
+        return ERR_MEM;
+    }
+    ws_deflate_init(&framinator->deflate->def, params->server_window_bits);
+    return ERR_OK;
+}
 
-    // TODO: Compute number of scratch/no-ack bytes fromws_con->current_payload_len
-    // and by assuming ws_con->head is the true end.
-    err_t ret;
+/**
+ * @brief Writes the frame header right in front of the payload. Big endian, as short as the length allows.
+ *
+ * @param payload Start of the payload, there must be room for the header in front of it.
+ * @return size_t Length of the header
+ */
+size_t websocket_write_frame_header(char* payload, bool fin, uint8_t opcode, uint64_t payload_len) {
+    size_t header_len;
+    if (payload_len < WS_HEADER_PAYLOAD_LEN_USE_16BIT) {
+        header_len = 2;
+    } else if (payload_len <= 0xFFFF) {
+        header_len = 2 + 2;
+    } else {
+        header_len = 2 + 8;
+    }
 
-    uint16_t header = WS_HEADER_FIN_old | WS_HEADER_OPCODE(WS_HEADER_OPCODE_TEXT);
-    if (ws_con->current_payload_len >= WS_HEADER_PAYLOAD_LEN_USE_16BIT) {
-        header |= WS_HEADER_PAYLOAD_LEN_USE_16BIT;
-        ws_frame_large* frame = ((ws_frame_large*) (ws_con->buf + ws_con->current_marker));
+    uint8_t* header = (uint8_t*) payload - header_len;
+    header[0] = (fin ? WS_HEADER_FIN : 0) | opcode;
 
-        size_t send_len = ws_con->current_payload_len + (sizeof(ws_frame_large) - offsetof(ws_frame_large, header));
+    if (header_len == 2) {
+        header[1] = payload_len; // Server frames are not masked
+    } else if (header_len == 2 + 2) {
+        header[1] = WS_HEADER_PAYLOAD_LEN_USE_16BIT;
+        header[2] = payload_len >> 8;
+        header[3] = payload_len;
+    } else {
+        header[1] = WS_HEADER_PAYLOAD_LEN_USE_64BIT;
+        for (int i = 0; i < 8; i++) {
+            header[2 + i] = payload_len >> (56 - i * 8);
+        }
+    }
+    return header_len;
+}
 
-        frame->marker.flags_and_len = WS_MRK_SCRATCH_LEN(
-            ws_con->head - ws_con->current_marker // total length
-            - send_len) // subtract length to be sent
-            | WS_MRK_LEN(send_len);
-        frame->header = (header << 8) | (header >> 8); // TODO: oops! quick fix for little endian u16.
-        frame->e_payload_len = (ws_con->current_payload_len << 8) | (ws_con->current_payload_len >> 8); // TODO: oops! quick fix for little endian u16.
+/**
+ * @brief Moves the frame being built to the start of a new ring of new_len bytes. The old ring
+ * is freed right away if nothing in it is in flight, otherwise it is retired until it is.
+ * Only one ring can be retired at a time.
+ *
+ * @param ws_con
+ * @param new_len Multiple of alignof(ws_buf_marker)
+ * @return err_t ERR_INPROGRESS if a ring is still being retired, ERR_MEM
+ */
+err_t websocket_resize_ring(ws_framinator* ws_con, size_t new_len) {
+    if (ws_con->old_buf) {
+        return ERR_INPROGRESS;
+    }
+    size_t frame_start = sizeof(ws_buf_marker) + ws_con->current_header_room;
+    if (new_len < frame_start + ws_con->current_payload_len + sizeof(ws_buf_marker) + WS_JUST_WRAP_ANYWAY_ITS_NOT_WORTH_IT_PAYLOAD_LEN) {
+        return ERR_ARG;
+    }
 
-        ret = ws_t_write(ws_con->con, &(frame->header),
-                send_len,
-                0 /*no flags*/);
+    char* new_buf = malloc(new_len);
+    if (!new_buf) {
+        return ERR_MEM;
+    }
 
-    } else {
-        header |= ws_con->current_payload_len;
-        ws_frame_small* frame = ((ws_frame_small*) (ws_con->buf + ws_con->current_marker));
+    if (ws_con->buf) {
+        memcpy(new_buf + frame_start, ws_con->buf + ws_con->current_marker + frame_start, ws_con->current_payload_len);
 
-        size_t send_len = ws_con->current_payload_len + (sizeof(ws_frame_small) - offsetof(ws_frame_small, header));
+        if (ws_con->ring_in_flight) {
+            ws_con->old_buf = ws_con->buf;
+            ws_con->old_unacked = ws_con->ring_in_flight;
+        } else {
+            free(ws_con->buf);
+        }
+    }
+
+    ws_con->buf = new_buf;
+    ws_con->buf_len = new_len;
+    ws_con->tail = 0;
+    ws_con->tail_acked = 0;
+    ws_con->current_marker = 0;
+    ws_con->head = frame_start + ws_con->current_payload_len;
+    ((ws_buf_marker*) (ws_con->buf + ws_con->current_marker))->flags_and_len = 0x00000000;
+
+    return ERR_OK;
+}
+
+/**
+ * @brief Called when the ring is out of space. If TCP could take more than the whole ring,
+ * the ring is what holds us back, so it grows. Otherwise waits for an ACK.
+ *
+ * @return int 1 if the ring grew (the frame being built is at the start of the new one),
+ *             0 after waiting, or a negative error code
+ */
+int websocket_wait_for_space(ws_framinator* ws_con) {
+    int ret;
+    ws_con->last_stall = get_absolute_time();
+
+    if (ws_con->buf_len < WS_BUF_MAX_LEN && !ws_con->old_buf && ws_con->con->printed_circuit_board != NULL
+        && tcp_sndbuf(ws_con->con->printed_circuit_board) >= ws_con->buf_len) {
+        size_t new_len = MIN(ws_con->buf_len * 2, WS_BUF_MAX_LEN) & ~(alignof(ws_buf_marker) - 1);
+        if (websocket_resize_ring(ws_con, new_len) == ERR_OK) {
+            DEBUG_printf("Ring grew to %u\n", new_len);
+            WS_STAT(ws_con->con->stats.ring_grows++);
+            return 1;
+        }
+        // No memory? Just wait then.
+    }
+
+    WS_STAT(ws_con->con->stats.ring_stalls++);
+    if (ret = (size_t) ws_t_yield(ws_con->con, WS_T_YIELD_REASON_WAIT_FOR_ACK)) {
+        return ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief Frees the ring when nothing is queued in it or in flight. A connection that pushes now and then
+ * only holds a ring while a push is on its way.
+ * A grown ring is kept while it still runs out of space now and then, it would just grow again.
+ */
+void websocket_idle_ring(ws_framinator* ws_con) {
+    if (!ws_con->buf || ws_con->ring_in_flight || ws_con->old_buf
+        || ws_con->current_payload_len || ws_con->msg_streaming) {
+        return;
+    }
+
+    if (ws_con->buf_len > WS_BUF_STARTING_LEN
+        && absolute_time_diff_us(ws_con->last_stall, get_absolute_time()) <= WS_BUF_SHRINK_AFTER_MS * 1000) {
+        return;
+    }
+    free(ws_con->buf);
+    ws_con->buf = NULL;
+    ws_con->buf_len = 0;
+}
+
+/**
+ * @brief Frees the ring(s). TCP may still need to re-send from them (the writes are not copied),
+ * so it waits a bit for the ACKs and drops the connection if they don't come.
+ */
+void websocket_deinit_framinator(ws_framinator* ws_con) {
+    ws_cliant_con* con = ws_con->con;
+
+    while (ws_con->ring_in_flight && con->printed_circuit_board != NULL) {
+        int fired = ws_t_wait_until(con, WS_T_YIELD_REASON_WAIT_FOR_ACK, make_timeout_time_ms(WS_BUF_DRAIN_TIMEOUT_MS));
+        if (fired < 0 || !(fired & WS_T_YIELD_REASON_WAIT_FOR_ACK)) {
+            break;
+        }
+    }
+    if (ws_con->ring_in_flight && con->printed_circuit_board != NULL) {
+        DEBUG_printf("Ring not ack'ed, aborting\n");
+        ws_cli_con_abort(con);
+    }
+
+    set_ack_callback(con, NULL, NULL);
+    free(ws_con->buf);
+    free(ws_con->old_buf);
+    ws_con->buf = NULL;
+    ws_con->old_buf = NULL;
+
+    free(ws_con->deflate);
+    free(ws_con->inflate_in);
+    free(ws_con->inflated);
+    ws_con->deflate = NULL;
+    ws_con->inflate_in = NULL;
+    ws_con->inflated = NULL;
+}
+
+err_t websocket_complete_and_send_frame(ws_framinator* ws_con) {
+    err_t ret;
+
+    bool fin = true;
+    uint8_t opcode = ws_con->write_opcode;
+    if (ws_con->msg_streaming) {
+        fin    = ws_con->msg_fin;
+        opcode = ws_con->msg_frames_sent ? WS_HEADER_OPCODE_CONTINUATION : ws_con->msg_opcode;
+    }
+
+    if (ws_con->frame_compressed) {
+        opcode |= WS_HEADER_RSV1;
+        ws_con->frame_compressed = false;
+    }
 
-        frame->marker.flags_and_len = WS_MRK_SCRATCH_LEN(
-            ws_con->head - ws_con->current_marker // total length
-            - send_len) // subtract length to be sent
-            | WS_MRK_LEN(send_len);
-        frame->header = (header << 8) | (header >> 8); // TODO: oops! quick fix for little endian u16.
+    char* payload = ws_con->buf + ws_con->current_marker + sizeof(ws_buf_marker) + ws_con->current_header_room;
+    size_t header_len = websocket_write_frame_header(payload, fin, opcode, ws_con->current_payload_len);
+    size_t send_len = header_len + ws_con->current_payload_len;
 
-        ret = ws_t_write(ws_con->con, &(frame->header),
-                send_len,
-                0 /*no flags*/);
+    // A frame larger than WS_RING_MAX_IN_TCP on its own still goes out, once nothing else is in TCP.
+    // The marker stays clear until then, the frame is not on its way yet (websocket_message_abort()).
+    while (ws_con->ring_in_flight && ws_con->ring_in_flight + send_len > WS_RING_MAX_IN_TCP) {
+        if (ret = (size_t) ws_t_yield(ws_con->con, WS_T_YIELD_REASON_WAIT_FOR_ACK)) {
+            return ret;
+        }
     }
 
+    // Everything before the header (and the padding after the payload) is scratch.
+    ((ws_buf_marker*) (ws_con->buf + ws_con->current_marker))->flags_and_len = WS_MRK_SCRATCH_LEN(
+        ws_con->head - ws_con->current_marker // total length
+        - send_len) // subtract length to be sent
+        | WS_MRK_LEN(send_len);
+
+    // Before writing, ACKs can come in while ws_t_write yields.
+    ws_con->ring_since_ctrl += send_len;
+    ws_con->ring_in_flight  += send_len;
+    WS_STAT(ws_con->con->stats.frames_out++);
+    WS_STAT(ws_con->con->stats.ring_peak = MAX(ws_con->con->stats.ring_peak, ws_con->ring_in_flight));
+    ret = ws_t_write(ws_con->con, payload - header_len,
+            send_len,
+            0 /*no flags*/);
+
     if (ws_con->con->printed_circuit_board == NULL) {
         return ERR_CLSD;
     }
@@ -241,30 +609,205 @@ void websocket_complete_and_send_frame(ws_framinator* ws_con) {
         return ret;
     }
 
+    ws_con->msg_frames_sent++;
     ws_con->current_payload_len = 0;
+    return ERR_OK;
+}
+
+/**
+ * @brief Compresses the frame being built in place, if it is a whole message and that makes it smaller.
+ * Has to happen before head is used to place anything after the frame.
+ */
+void websocket_deflate_frame(ws_framinator* ws_con) {
+    size_t len = ws_con->current_payload_len;
+
+    if (!ws_con->deflate || len < WS_DEFLATE_MIN_LEN || len > WS_DEFLATE_MAX_LEN) {
+        return;
+    }
+    if (ws_con->msg_streaming && (!ws_con->msg_fin || ws_con->msg_frames_sent)) {
+        return; // Part of a longer message, that one goes out as is.
+    }
+
+    char* payload = ws_con->buf + ws_con->current_marker + sizeof(ws_buf_marker) + ws_con->current_header_room;
+    int compressed = ws_deflate_compress(&ws_con->deflate->def, ws_con->deflate->scratch,
+                                         MIN(len - 1, WS_DEFLATE_SCRATCH_LEN), (uint8_t*) payload, len);
+    if (compressed < 0) {
+        return; // Did not get any smaller
+    }
+
+    memcpy(payload, ws_con->deflate->scratch, compressed);
+    ws_con->current_payload_len = compressed;
+    ws_con->head = payload - ws_con->buf + compressed;
+    ws_con->frame_compressed = true;
+}
+
+/**
+ * @brief Sends the frame we are building and starts a new one after it (or at the start of the buffer).
+ * Yields if the new frame does not fit yet.
+ */
+err_t websocket_send_frame_and_advance(ws_framinator* ws_con) {
+    err_t ret;
+    size_t space;
+
+    websocket_deflate_frame(ws_con);
+
+    if (ws_con->buf_len - ws_con->head - sizeof(ws_buf_marker) < WS_JUST_WRAP_ANYWAY_ITS_NOT_WORTH_IT_PAYLOAD_LEN) {
+        // Case spagetti, yikes.
+        // Head/tail could be in any order, but head is getting too close to buf_len.
+
+        // Create a new wrap marker in preparation to loop head back to the start of the buffer.
+
+        // We know that there is at least enough space for a wrap marker
+        // >>> ADVANCE HEAD >>>
+        // Pad head forward a bit if needed
+        uint8_t padding = (alignof(ws_buf_marker) - ws_con->head % alignof(ws_buf_marker)) % alignof(ws_buf_marker);
+        ws_con->head += padding;
+        ((ws_buf_marker*) (ws_con->buf + ws_con->head))->flags_and_len =
+            WS_MRK_FLAG_WRAP/*| WS_MRK_SCRATCH_LEN(ws_con->buf_len - ws_con->head) ignored when wrap is set*/;
+
+        if ((ret = websocket_complete_and_send_frame(ws_con))) {
+            return ret;
+        }
+
+        // Ensure that there is enough space at the start of the buffer.
+        while (ws_con->tail > ws_con->head || ws_con->tail < sizeof(ws_buf_marker) + WS_SHORT_HEADER_LEN) {
+            if ((ret = websocket_wait_for_space(ws_con))) {
+                return ret < 0 ? ret : ERR_OK; // > 0: New ring, the next frame is already set up.
+            }
+            WS_STAT(ws_con->con->stats.wrap_stalls++);
+        }
+
+        // >>> ADVANCE HEAD >>>
+        ws_con->current_marker = 0;
+        ws_con->current_header_room = WS_SHORT_HEADER_LEN;
+        ws_con->head = sizeof(ws_buf_marker) + WS_SHORT_HEADER_LEN;
+        // TODO: Low priority. Maybe we don't need to initialize it to zero as we will enter the values
+        // when ready to advance ws_con->head/send the packet anyway.
+        ((ws_buf_marker*) (ws_con->buf + ws_con->current_marker))->flags_and_len = 0x00000000;
+        // >>>              >>>
+
+    } else if (ws_con->head >= ws_con->tail) {
+        // tail behind head
+
+        // got handled above: if (space < WS_JUST_WRAP_ANYWAY_ITS_NOT_WORTH_IT_PAYLOAD_LEN)
+
+        // We have enough space for a frame right after this one.
+
+        // >>> ADVANCE HEAD >>>
+        // Pad head forward a bit if needed
+        uint8_t padding = (alignof(ws_buf_marker) - ws_con->head % alignof(ws_buf_marker)) % alignof(ws_buf_marker);
+        ws_con->head += padding;
+
+        if ((ret = websocket_complete_and_send_frame(ws_con))) {
+            return ret;
+        }
+
+        ws_con->current_marker = ws_con->head;
+        ws_con->current_header_room = WS_SHORT_HEADER_LEN;
+        ws_con->head += sizeof(ws_buf_marker) + WS_SHORT_HEADER_LEN;
+        // TODO: Low priority. Maybe we don't need to initialize it to zero as we will enter the values
+        // when ready to advance ws_con->head/send the packet anyway.
+        ((ws_buf_marker*) (ws_con->buf + ws_con->current_marker))->flags_and_len = 0x00000000;
+        // >>>              >>>
+
+    } else {
+        // Snake about to eat it's own tail
+
+        // empty space at the end of the buffer:
+        space = ws_con->tail - ws_con->head
+            - (sizeof(ws_buf_marker)); // save room for a wrap marker.
+
+        if (space < sizeof(ws_buf_marker) + WS_SHORT_HEADER_LEN) {
+            // not enough space
+
+            // >>> ADVANCE HEAD >>>
+            // Pad head forward a bit if needed
+            uint8_t padding = (alignof(ws_buf_marker) - ws_con->head % alignof(ws_buf_marker)) % alignof(ws_buf_marker);
+            ws_con->head += padding;
+
+            if ((ret = websocket_complete_and_send_frame(ws_con))) {
+                return ret;
+            }
+
+            // Ensure that there is enough space at the start of the buffer.
+            while (ws_con->tail > ws_con->head && ws_con->tail - ws_con->head < sizeof(ws_buf_marker) + WS_SHORT_HEADER_LEN) {
+                if ((ret = websocket_wait_for_space(ws_con))) {
+                    return ret < 0 ? ret : ERR_OK;
+                }
+            }
+
+            // >>> ADVANCE HEAD >>>
+            ws_con->current_marker = ws_con->head;
+            ws_con->current_header_room = WS_SHORT_HEADER_LEN;
+            ws_con->head += sizeof(ws_buf_marker) + WS_SHORT_HEADER_LEN;
+            // TODO: Low priority. Maybe we don't need to initialize it to zero as we will enter the values
+            // when ready to advance ws_con->head/send the packet anyway.
+            ((ws_buf_marker*) (ws_con->buf + ws_con->current_marker))->flags_and_len = 0x00000000;
+            // >>>              >>>
+        } else {
+            // We have enough space for a frame right after this one.
+
+            // >>> ADVANCE HEAD >>>
+            // Pad head forward a bit if needed
+            uint8_t padding = (alignof(ws_buf_marker) - ws_con->head % alignof(ws_buf_marker)) % alignof(ws_buf_marker);
+            ws_con->head += padding;
+
+            if ((ret = websocket_complete_and_send_frame(ws_con))) {
+                return ret;
+            }
+
+            ws_con->current_marker = ws_con->head;
+            ws_con->current_header_room = WS_SHORT_HEADER_LEN;
+            ws_con->head += sizeof(ws_buf_marker) + WS_SHORT_HEADER_LEN;
+            // TODO: Low priority. Maybe we don't need to initialize it to zero as we will enter the values
+            // when ready to advance ws_con->head/send the packet anyway.
+            ((ws_buf_marker*) (ws_con->buf + ws_con->current_marker))->flags_and_len = 0x00000000;
+            // >>>              >>>
+        }
+    }
+    return ERR_OK;
+}
+
+/**
+ * @brief Number of bytes on the connection that have not been ack'ed yet.
+ */
+static inline size_t websocket_in_flight(ws_framinator* ws_con) {
+    return TCP_SND_BUF - tcp_sndbuf(ws_con->con->printed_circuit_board);
 }
 
-err_t websocket_write(ws_framinator* ws_con, char* buf, size_t len) {
+/**
+ * @brief Copies into the ring, into frames of the streamed message if there is one open.
+ * websocket_write() and websocket_message_append().
+ */
+err_t websocket_write_ring(ws_framinator* ws_con, const char* buf, size_t len) {
     static_assert(WS_JUST_WRAP_ANYWAY_ITS_NOT_WORTH_IT_PAYLOAD_LEN <= (0b00111111 - sizeof(ws_buf_marker)),
                   "Can't skip over a size greater than about 6 bits");
     static_assert(alignof(ws_buf_marker) <= sizeof(ws_buf_marker) && sizeof(ws_buf_marker) % alignof(ws_buf_marker) == 0,
                   "Sanity check as we use sizeof(ws_buf_marker) to ensure enough space at the end of the struct");
+    static_assert(WS_MAX_PAYLOAD_LEN <= 0xFFFF && WS_BUF_MAX_LEN / 2 <= 0xFFFF,
+                  "Frames are built with room for at most a 16 bit extended length");
     err_t ret;
 
+    if (ws_con->con->printed_circuit_board == NULL || ws_con->close_sent) {
+        return ERR_CLSD;
+    }
+    if (!ws_con->buf && (ret = websocket_resize_ring(ws_con, WS_BUF_STARTING_LEN))) {
+        return ret; // Was released while idle
+    }
+
     while (len > 0) {
         size_t space;
 
 
         if (ws_con->head < ws_con->tail) {
             // make sure we can fit an aligned ws_buf_marker at the end.
-            space = ws_con->tail - ws_con->head
-                   - sizeof(ws_buf_marker) - ws_con->tail % alignof(ws_buf_marker);
+            size_t reserved = sizeof(ws_buf_marker) + ws_con->tail % alignof(ws_buf_marker);
+            space = ws_con->tail - ws_con->head > reserved ? ws_con->tail - ws_con->head - reserved : 0;
 
-            if (space <= 0) {
-                if (ret = (size_t) sub_task_yield(WS_T_YIELD_REASON_WAIT_FOR_ACK, ws_con->con->task)) {
+            if (space == 0) {
+                if ((ret = websocket_wait_for_space(ws_con)) < 0) {
                     return ret;
                 }
-                ws_con->con->notify_ack = false;
                 continue;
             }
 
@@ -276,7 +819,34 @@ err_t websocket_write(ws_framinator* ws_con, char* buf, size_t len) {
 
         }
 
-        space = MIN(space, MIN(WS_MAX_PAYLOAD_LEN - ws_con->current_payload_len, len));
+        size_t max_payload = ws_con->msg_streaming ? WS_MAX_STREAM_FRAME_PAYLOAD_LEN(ws_con) : WS_MAX_PAYLOAD_LEN;
+        size_t send_at     = ws_con->msg_streaming ? WS_MAX_STREAM_FRAME_PAYLOAD_LEN(ws_con) : WS_ITS_LARGE_ENOUGH_JUST_SEND_IT;
+        size_t want        = MIN(max_payload - ws_con->current_payload_len, len);
+        bool full = false;
+
+        if (ws_con->current_header_room < WS_16BIT_HEADER_LEN
+            && ws_con->current_payload_len + MIN(space, want) >= WS_HEADER_PAYLOAD_LEN_USE_16BIT) {
+            // Too long for the short header.
+            size_t short_left = WS_HEADER_PAYLOAD_LEN_USE_16BIT - 1 - ws_con->current_payload_len;
+            if (space > short_left + WS_16BIT_HEADER_LEN - WS_SHORT_HEADER_LEN) {
+                // Move what we have up to make room for the extended length
+                char* payload = ws_con->buf + ws_con->current_marker + sizeof(ws_buf_marker) + ws_con->current_header_room;
+                memmove(payload + WS_16BIT_HEADER_LEN - WS_SHORT_HEADER_LEN, payload, ws_con->current_payload_len);
+                ws_con->head += WS_16BIT_HEADER_LEN - WS_SHORT_HEADER_LEN;
+                space        -= WS_16BIT_HEADER_LEN - WS_SHORT_HEADER_LEN;
+                ws_con->current_header_room = WS_16BIT_HEADER_LEN;
+            } else {
+                // No room for it. Send it short, the rest goes in the next frame.
+                space = short_left;
+                full = true;
+            }
+        }
+
+        space = MIN(space, want);
+        if (ws_con->current_payload_len == 0 && space > 0) {
+            // First bytes of a new frame. Start the clock.
+            ws_con->send_deadline = make_timeout_time_ms(WS_COALESCE_MAX_DELAY_MS);
+        }
         memcpy(ws_con->buf + ws_con->head, buf, space);
         // update frame builder's state
         ws_con->current_payload_len += space;
@@ -286,137 +856,200 @@ err_t websocket_write(ws_framinator* ws_con, char* buf, size_t len) {
         buf += space;
 
         // Should we send the frame?
-        if (ws_con->head >= ws_con->buf_len - sizeof(ws_buf_marker)
-            || ws_con->current_payload_len >= WS_ITS_LARGE_ENOUGH_JUST_SEND_IT
-            /*||  TODO: enough time has passed since the first bytes on this frame */) {
-
-            if (ws_con->buf_len - ws_con->head - sizeof(ws_buf_marker) < WS_JUST_WRAP_ANYWAY_ITS_NOT_WORTH_IT_PAYLOAD_LEN) {
-                // Case spagetti, yikes.
-                // Head/tail could be in any order, but head is getting too close to buf_len.
-
-                // Create a new wrap marker in preparation to loop head back to the start of the buffer.
-
-                // We know that there is at least enough space for a wrap marker
-                // >>> ADVANCE HEAD >>>
-                // Pad head forward a bit if needed
-                uint8_t padding = (alignof(ws_buf_marker) - ws_con->head % alignof(ws_buf_marker)) % alignof(ws_buf_marker);
-                ws_con->head += padding;
-                ((ws_buf_marker*) (ws_con->buf + ws_con->head))->flags_and_len =
-                    WS_MRK_FLAG_WRAP/*| WS_MRK_SCRATCH_LEN(ws_con->buf_len - ws_con->head) ignored when wrap is set*/;
-
-                websocket_complete_and_send_frame(ws_con);
-
-                // Ensure that there is enough space at the start of the buffer.
-                while (ws_con->tail > ws_con->head || ws_con->tail < sizeof(ws_buf_marker) + WS_MAX_NO_MASK_HEADER_LEN) {
-                    if (ret = (size_t) sub_task_yield(WS_T_YIELD_REASON_WAIT_FOR_ACK, ws_con->con->task)) {
-                        return ret;
-                    }
-                    ws_con->con->notify_ack = false;
-                }
+        if (full || ws_con->head >= ws_con->buf_len - sizeof(ws_buf_marker)
+            || ws_con->current_payload_len >= send_at) {
 
-                // >>> ADVANCE HEAD >>>
-                ws_con->current_marker = 0;
-                ws_con->head = sizeof(ws_buf_marker) + WS_MAX_NO_MASK_HEADER_LEN;
-                // TODO: Low priority. Maybe we don't need to initialize it to zero as we will enter the values
-                // when ready to advance ws_con->head/send the packet anyway.
-                ((ws_buf_marker*) (ws_con->buf + ws_con->current_marker))->flags_and_len = 0x00000000;
-                // >>>              >>>
+            if ((ret = websocket_send_frame_and_advance(ws_con))) {
+                return ret;
+            }
+        }
+    }
 
-            } else if (ws_con->head >= ws_con->tail) {
-                // tail behind head
+    // A small frame is left over. Nothing in flight means nothing to wait for, send it now.
+    // (A streamed message is going to get more, don't chop it up.)
+    if (ws_con->current_payload_len > 0 && !ws_con->corked && !ws_con->msg_streaming
+        && websocket_in_flight(ws_con) == 0) {
+        return websocket_send_frame_and_advance(ws_con);
+    }
+    return ERR_OK;
+}
 
-                // got handled above: if (space < WS_JUST_WRAP_ANYWAY_ITS_NOT_WORTH_IT_PAYLOAD_LEN)
+/**
+ * @brief Buffers len bytes, sent as part of a frame of the write opcode (websocket_set_write_opcode()).
+ *
+ * @return err_t ERR_INPROGRESS while a streamed message is open, use websocket_message_append() or end it first
+ */
+err_t websocket_write(ws_framinator* ws_con, const char* buf, size_t len) {
+    if (ws_con->msg_streaming) {
+        return ERR_INPROGRESS;
+    }
+    return websocket_write_ring(ws_con, buf, len);
+}
 
-                // We have enough space for a frame right after this one.
+/**
+ * @brief Sends whatever is buffered. Does not wait for it to be ack'ed.
+ */
+err_t websocket_flush(ws_framinator* ws_con) {
+    if (ws_con->current_payload_len > 0) {
+        return websocket_send_frame_and_advance(ws_con);
+    }
+    return ERR_OK;
+}
 
-                // >>> ADVANCE HEAD >>>
-                // Pad head forward a bit if needed
-                uint8_t padding = (alignof(ws_buf_marker) - ws_con->head % alignof(ws_buf_marker)) % alignof(ws_buf_marker);
-                ws_con->head += padding;
+/**
+ * @brief Starts a message that is streamed through the ring with websocket_message_append().
+ * It is sent as several frames as the ring fills, so it can be much larger than the ring.
+ * Anything buffered by websocket_write() before is sent first, as its own message.
+ *
+ * @param ws_con
+ * @param opcode WS_HEADER_OPCODE_TEXT or WS_HEADER_OPCODE_DATA
+ * @return err_t
+ */
+err_t websocket_message_begin(ws_framinator* ws_con, uint8_t opcode) {
+    err_t ret;
+    if (ws_con->msg_streaming) {
+        return ERR_INPROGRESS;
+    }
+    if ((ret = websocket_flush(ws_con))) {
+        return ret;
+    }
+    if (!ws_con->buf && (ret = websocket_resize_ring(ws_con, WS_BUF_STARTING_LEN))) {
+        return ret;
+    }
 
-                websocket_complete_and_send_frame(ws_con);
+    ws_con->msg_streaming = true;
+    ws_con->msg_fin = false;
+    ws_con->msg_opcode = opcode;
+    ws_con->msg_frames_sent = 0;
+    return ERR_OK;
+}
 
-                ws_con->current_marker = ws_con->head;
-                ws_con->head += sizeof(ws_buf_marker) + WS_MAX_NO_MASK_HEADER_LEN;
-                // TODO: Low priority. Maybe we don't need to initialize it to zero as we will enter the values
-                // when ready to advance ws_con->head/send the packet anyway.
-                ((ws_buf_marker*) (ws_con->buf + ws_con->current_marker))->flags_and_len = 0x00000000;
-                // >>>              >>>
+err_t websocket_send_close(ws_framinator* ws_con, uint16_t status);
 
-            } else {
-                // Snake about to eat it's own tail
-
-                // empty space at the end of the buffer:
-                space = ws_con->tail - ws_con->head
-                    - (sizeof(ws_buf_marker)); // save room for a wrap marker.
-
-                if (space < sizeof(ws_buf_marker) + WS_MAX_NO_MASK_HEADER_LEN) {
-                    // not enough space
-
-                    // >>> ADVANCE HEAD >>>
-                    // Pad head forward a bit if needed
-                    uint8_t padding = (alignof(ws_buf_marker) - ws_con->head % alignof(ws_buf_marker)) % alignof(ws_buf_marker);
-                    ws_con->head += padding;
-
-                    websocket_complete_and_send_frame(ws_con);
-
-                    // Ensure that there is enough space at the start of the buffer.
-                    while (ws_con->tail > ws_con->head && ws_con->tail - ws_con->head < sizeof(ws_buf_marker) + WS_MAX_NO_MASK_HEADER_LEN) {
-                        if (ret = (size_t) sub_task_yield(WS_T_YIELD_REASON_WAIT_FOR_ACK, ws_con->con->task)) {
-                            return ret;
-                        }
-                        ws_con->con->notify_ack = false;
-                    }
-
-                    // >>> ADVANCE HEAD >>>
-                    ws_con->current_marker = ws_con->head;
-                    ws_con->head += sizeof(ws_buf_marker) + WS_MAX_NO_MASK_HEADER_LEN;
-                    // TODO: Low priority. Maybe we don't need to initialize it to zero as we will enter the values
-                    // when ready to advance ws_con->head/send the packet anyway.
-                    ((ws_buf_marker*) (ws_con->buf + ws_con->current_marker))->flags_and_len = 0x00000000;
-                    // >>>              >>>
-                } else {
-                    // We have enough space for a frame right after this one.
-
-                    // >>> ADVANCE HEAD >>>
-                    // Pad head forward a bit if needed
-                    uint8_t padding = (alignof(ws_buf_marker) - ws_con->head % alignof(ws_buf_marker)) % alignof(ws_buf_marker);
-                    ws_con->head += padding;
-
-                    websocket_complete_and_send_frame(ws_con);
-
-                    ws_con->current_marker = ws_con->head;
-                    ws_con->head += sizeof(ws_buf_marker) + WS_MAX_NO_MASK_HEADER_LEN;
-                    // TODO: Low priority. Maybe we don't need to initialize it to zero as we will enter the values
-                    // when ready to advance ws_con->head/send the packet anyway.
-                    ((ws_buf_marker*) (ws_con->buf + ws_con->current_marker))->flags_and_len = 0x00000000;
-                    // >>>              >>>
-                }
-            }
-        }
+/**
+ * @brief Gives up on the streamed message after an error, so the next one can begin. The part that was not
+ * handed to TCP yet is dropped. If some of it went out already, the client would take whatever comes
+ * next for the rest of it, so the connection is closed (1011). If the frame being built was handed to
+ * TCP when it failed, who knows what made it out. That connection is dropped.
+ */
+void websocket_message_abort(ws_framinator* ws_con) {
+    if (!ws_con->msg_streaming) {
+        return;
+    }
+    ws_con->msg_streaming = false;
+
+    if (((ws_buf_marker*) (ws_con->buf + ws_con->current_marker))->flags_and_len) {
+        ws_cli_con_abort(ws_con->con);
+        return;
+    }
+    ws_con->current_payload_len = 0;
+    ws_con->current_header_room = WS_SHORT_HEADER_LEN;
+    ws_con->head = ws_con->current_marker + sizeof(ws_buf_marker) + WS_SHORT_HEADER_LEN;
+    ws_con->frame_compressed = false;
+
+    if (ws_con->msg_frames_sent) {
+        websocket_send_close(ws_con, WS_CLOSE_INTERNAL_ERROR);
+    }
+}
+
+/**
+ * @brief Adds to the streamed message. On an error the message is aborted (websocket_message_abort()).
+ */
+err_t websocket_message_append(ws_framinator* ws_con, const char* buf, size_t len) {
+    err_t ret;
+    if (!ws_con->msg_streaming) {
+        return ERR_ARG;
     }
+    if ((ret = websocket_write_ring(ws_con, buf, len))) {
+        websocket_message_abort(ws_con);
+    }
+    return ret;
+}
+
+/**
+ * @brief Sends the rest of the streamed message with FIN set. If everything was sent already,
+ * an empty continuation frame ends it.
+ */
+err_t websocket_message_end(ws_framinator* ws_con) {
+    err_t ret;
+    if (!ws_con->msg_streaming) {
+        return ERR_ARG;
+    }
+
+    ws_con->msg_fin = true;
+    if ((ret = websocket_send_frame_and_advance(ws_con))) {
+        websocket_message_abort(ws_con);
+        return ret;
+    }
+    ws_con->msg_streaming = false;
     return ERR_OK;
 }
 
-err_t websocket_flush(ws_framinator* ws_con) {
+/**
+ * @brief Sends one message gathered from several buffers, copied straight into the ring.
+ *
+ * @param ws_con
+ * @param opcode WS_HEADER_OPCODE_TEXT or WS_HEADER_OPCODE_DATA
+ * @param iov
+ * @param iovcnt
+ * @return err_t
+ */
+err_t websocket_writev(ws_framinator* ws_con, uint8_t opcode, const ws_iovec* iov, int iovcnt) {
+    err_t ret;
+    if ((ret = websocket_message_begin(ws_con, opcode))) {
+        return ret;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        if ((ret = websocket_message_append(ws_con, iov[i].iov_base, iov[i].iov_len))) {
+            return ret;
+        }
+    }
+    return websocket_message_end(ws_con);
+}
+
+/**
+ * @brief Sets the opcode of frames sent by websocket_write(). Whatever was buffered
+ * with the old opcode is sent first.
+ */
+err_t websocket_set_write_opcode(ws_framinator* ws_con, uint8_t opcode) {
+    err_t ret = ERR_OK;
+    if (opcode != ws_con->write_opcode) {
+        ret = websocket_flush(ws_con);
+        ws_con->write_opcode = opcode;
+    }
+    return ret;
+}
+
+/**
+ * @brief Flushes and waits until everything has been ack'ed.
+ */
+err_t websocket_drain(ws_framinator* ws_con) {
     err_t ret;
 
     if (ws_con->current_payload_len > 0) {
-        websocket_complete_and_send_frame(ws_con);
+        websocket_deflate_frame(ws_con);
+        if ((ret = websocket_complete_and_send_frame(ws_con))) {
+            return ret;
+        }
     }
 
     // Wait for ACK until the entire buffer is flushed.
-    while (ws_con->tail != ws_con->head) {
-        if (ret = (size_t) sub_task_yield(WS_T_YIELD_REASON_WAIT_FOR_ACK, ws_con->con->task)) {
+    while (ws_con->ring_in_flight) {
+        if (ret = (size_t) ws_t_yield(ws_con->con, WS_T_YIELD_REASON_WAIT_FOR_ACK)) {
             return ret;
         }
-        ws_con->con->notify_ack = false;
+    }
+
+    if (!ws_con->buf) {
+        return ERR_OK;
     }
 
     // reset the buffer
     ws_con->tail = 0;
+    ws_con->tail_acked = 0;
     ws_con->current_marker = 0;
-    ws_con->head = sizeof(ws_buf_marker) + WS_MAX_NO_MASK_HEADER_LEN;
+    ws_con->current_header_room = WS_SHORT_HEADER_LEN;
+    ws_con->head = sizeof(ws_buf_marker) + WS_SHORT_HEADER_LEN;
     // TODO: Low priority. Maybe we don't need to initialize it to zero as we will enter the values
     // when ready to advance ws_con->head/send the packet anyway.
     ((ws_buf_marker*) (ws_con->buf + ws_con->current_marker))->flags_and_len = 0x00000000;
@@ -424,59 +1057,278 @@ err_t websocket_flush(ws_framinator* ws_con) {
     return ERR_OK;
 }
 
-void websocket_apply_mask(ws_framinator* ws_con, char* buf, size_t size) {
+/**
+ * @brief Limits the payload of a single incomming message (all of its frames).
+ *
+ * @param ws_con
+ * @param max_message_len
+ * @param close_oversized true to close the connection on an oversized message, false to skip it
+ */
+static inline void websocket_set_max_message_len(ws_framinator* ws_con, uint64_t max_message_len, bool close_oversized) {
+    ws_con->max_message_len = max_message_len;
+    ws_con->close_oversized = close_oversized;
+}
 
-    size_t mod = MIN(4 - ((size_t) buf % 4), size);
-    if (mod) {
-        // buf is not lined up on a 4 byte boundry. Handle the un-aligned bytes explicitly.
-        for (int i = 0; i < mod; i++) {
-            buf[i] = buf[i] ^ (ws_con->read_mask >> (i * 8));
-        }
+/**
+ * @brief Holds small frames back until websocket_uncork(). Use it around a burst of small writes.
+ */
+static inline void websocket_cork(ws_framinator* ws_con) {
+    ws_con->corked = true;
+}
 
-        // Rotate the read mask so that it lines up
-        ws_con->read_mask = ws_con->read_mask << (32 - mod * 8) | ws_con->read_mask >> (mod * 8);
-        size -= mod;
-        buf  += mod;
-        // Now we know buf is aligned, or we hit size and the rest of this function should short out.
+static inline err_t websocket_uncork(ws_framinator* ws_con) {
+    ws_con->corked = false;
+    return websocket_flush(ws_con);
+}
+
+/**
+ * @brief When websocket_poll() needs to be called to send a small frame that is waiting for more data.
+ *
+ * @return absolute_time_t or at_the_end_of_time if nothing is waiting.
+ */
+static inline absolute_time_t websocket_send_deadline(ws_framinator* ws_con) {
+    if (ws_con->current_payload_len == 0 || ws_con->corked) {
+        return at_the_end_of_time;
     }
+    return ws_con->send_deadline;
+}
 
-    // Note: Our mask is backwards from not converting it to little-endian,
-    // but so is our buf when read as uint32_t's, so we are ok for now.
-    for (int i = 0; i < size / 4; i++) {
-        ((uint32_t*) buf)[i] = ((uint32_t*) buf)[i] ^ ws_con->read_mask;
+/**
+ * @brief Sends the waiting small frame if its deadline passed (or nothing is in flight anymore).
+ * With nothing waiting, frees the ring once nothing is in flight either (websocket_idle_ring()).
+ */
+err_t websocket_poll(ws_framinator* ws_con) {
+    if (ws_con->con->printed_circuit_board == NULL) {
+        return ERR_OK;
+    }
+    if (ws_con->current_payload_len == 0) {
+        websocket_idle_ring(ws_con);
+        return ERR_OK;
+    }
+    if (ws_con->corked) {
+        return ERR_OK;
+    }
+    if (time_reached(ws_con->send_deadline) || websocket_in_flight(ws_con) == 0) {
+        return websocket_send_frame_and_advance(ws_con);
     }
+    return ERR_OK;
+}
 
-    mod = size % 4;
-    if (mod) {
-        for (int i = 1; i <= mod; i++) {
-            buf[size - i] = buf[size - i] ^ (ws_con->read_mask >> ((mod - i) * 8));
+/**
+ * @brief Sends a control frame right away through the priority lane. It goes out ahead of the frame
+ * being built in the ring (but after whatever was already handed to TCP, at most WS_RING_MAX_IN_TCP).
+ *
+ * @param ws_con
+ * @param opcode WS_HEADER_OPCODE_CLOSE, _PING or _PONG
+ * @param payload
+ * @param len At most WS_CONTROL_MAX_PAYLOAD_LEN
+ * @return err_t
+ */
+err_t websocket_send_control(ws_framinator* ws_con, uint8_t opcode, const char* payload, size_t len) {
+    err_t ret;
+    char frame[2 + WS_CONTROL_MAX_PAYLOAD_LEN];
+
+    if (len > WS_CONTROL_MAX_PAYLOAD_LEN) {
+        return ERR_ARG;
+    }
+    if (ws_con->close_sent) {
+        return ERR_CLSD; // Nothing may follow a close frame
+    }
+
+    while (ws_con->ctrl_len >= WS_CTRL_QUEUE_LEN) {
+        if (ret = (size_t) ws_t_yield(ws_con->con, WS_T_YIELD_REASON_WAIT_FOR_ACK)) {
+            return ret;
         }
+    }
+
+    frame[0] = WS_HEADER_FIN | opcode; // Server frames are not masked
+    frame[1] = len;
+    memcpy(frame + 2, payload, len);
+
+    // Queue it up before writing, ACKs can come in while ws_t_write yields.
+    ws_ctrl_in_flight* ctrl = &ws_con->ctrl[ws_con->ctrl_len++];
+    ctrl->ring_before = ws_con->ring_since_ctrl;
+    ctrl->len = len + 2;
+    ws_con->ring_since_ctrl = 0;
+    WS_STAT(ws_con->con->stats.frames_out++);
 
-        // Rotate the read mask so that it lines up
-        ws_con->read_mask = ws_con->read_mask << (32 - mod * 8) | ws_con->read_mask >> (mod * 8);
+    if ((ret = ws_t_write(ws_con->con, frame, len + 2, TCP_WRITE_FLAG_COPY))) {
+        return ret;
     }
+    if (ws_con->con->printed_circuit_board == NULL) {
+        return ERR_CLSD;
+    }
+    return tcp_output(ws_con->con->printed_circuit_board);
+}
 
+static inline err_t websocket_ping(ws_framinator* ws_con, const char* payload, size_t len) {
+    return websocket_send_control(ws_con, WS_HEADER_OPCODE_PING, payload, len);
 }
 
-err_t websocket_read(ws_framinator* ws_con, char* buf, size_t size) {
+/**
+ * @brief Sends a close frame with the status code (if we have not already).
+ */
+err_t websocket_send_close(ws_framinator* ws_con, uint16_t status) {
     err_t ret;
+    if (ws_con->close_sent) {
+        return ERR_OK;
+    }
 
-    while (size > 0) {
-        // Use up existing payload first
-        if (ws_con->read_length > 0) {
-            size_t canReadLen = MIN(ws_con->read_length, size);
-            if ((ret = ws_t_read(ws_con->con, buf, canReadLen)) < 0) {
-                return ret;
+    // Whatever is buffered goes out before the close.
+    if ((ret = websocket_flush(ws_con))) {
+        return ret;
+    }
+
+    char payload[2] = { status >> 8, status & 0xFF };
+    ret = websocket_send_control(ws_con, WS_HEADER_OPCODE_CLOSE, payload, sizeof(payload));
+    ws_con->close_sent = true;
+    return ret;
+}
+
+/**
+ * @brief Unmasks payload bytes in place. Keeps read_mask lined up with the next byte.
+ */
+static inline void websocket_apply_mask(ws_framinator* ws_con, char* buf, size_t size) {
+    ws_con->read_mask = ws_mask_copy(buf, buf, size, ws_con->read_mask);
+}
+
+/**
+ * @brief Reads the payload of a control frame and answers it. Pings get a pong,
+ * a close gets a close back (if we did not send one first) and ERR_CLSD.
+ */
+err_t websocket_handle_control_frame(ws_framinator* ws_con, uint8_t opcode, bool fin) {
+    err_t ret;
+    char payload[WS_CONTROL_MAX_PAYLOAD_LEN];
+    size_t len = ws_con->read_length;
+
+    if (len > WS_CONTROL_MAX_PAYLOAD_LEN || !fin) {
+        DEBUG_printf("Bad websocket control frame\n");
+        websocket_send_close(ws_con, WS_CLOSE_PROTOCOL_ERROR);
+        return ERR_VAL;
+    }
+
+    if ((ret = ws_t_read_masked(ws_con->con, payload, len, &ws_con->read_mask)) < 0) {
+        return ret;
+    }
+    ws_con->read_length = 0;
+
+    switch (opcode) {
+        case WS_HEADER_OPCODE_PING:
+            return websocket_send_control(ws_con, WS_HEADER_OPCODE_PONG, payload, len);
+
+        case WS_HEADER_OPCODE_PONG:
+            return ERR_OK; // Unsolicited pongs are allowed. Nothing to do.
+
+        case WS_HEADER_OPCODE_CLOSE:
+            ws_con->close_received = true;
+            if (!ws_con->close_sent) {
+                // Echo the status code back to finish the close handshake.
+                uint16_t status = len >= 2 ? ((uint8_t) payload[0] << 8) | (uint8_t) payload[1] : WS_CLOSE_NORMAL;
+                websocket_send_close(ws_con, status);
             }
-            websocket_apply_mask(ws_con, buf, canReadLen);
+            return ERR_CLSD;
+
+        default:
+            DEBUG_printf("Unhandled websocket control frame: %hhd\n", opcode);
+            return ERR_OK;
+    }
+}
+
+/**
+ * @brief Adds the frame's payload to the compressed message being gathered. After the last frame,
+ * the message is inflated and the reader pointed at it.
+ */
+err_t websocket_gather_compressed(ws_framinator* ws_con, bool fin) {
+    int ret;
+    size_t len = ws_con->read_length;
 
-            buf                 += canReadLen;
-            size                -= canReadLen;
-            ws_con->read_length -= canReadLen;
+    // Room for the tail too
+    uint8_t* in = realloc(ws_con->inflate_in, ws_con->inflate_in_len + len + WS_DEFLATE_TAIL_LEN);
+    if (!in) {
+        return ERR_MEM;
+    }
+    ws_con->inflate_in = in;
+    if ((ret = ws_t_read_masked(ws_con->con, (char*) in + ws_con->inflate_in_len, len, &ws_con->read_mask)) < 0) {
+        return ret;
+    }
+    ws_con->inflate_in_len += len;
+    ws_con->read_length = 0;
+    if (!fin) {
+        return ERR_OK;
+    }
 
-            if (size == 0) {
-                return ERR_OK; // The last payload had enough left to complete the read
+    size_t in_len = ws_con->inflate_in_len;
+    memcpy(in + in_len, ws_deflate_tail, WS_DEFLATE_TAIL_LEN);
+
+    // Guess, and double until it fits (or gets too large)
+    size_t out_len = MIN(ws_con->max_message_len, MAX(WS_INFLATE_STARTING_LEN, 4 * in_len));
+    ws_inflate* inf = malloc(sizeof(ws_inflate));
+    uint8_t* out = NULL;
+    bool no_memory = !inf;
+    int inflated = WS_INFLATE_ERR_FULL;
+    while (inf) {
+        if (!(out = malloc(out_len))) {
+            no_memory = true;
+            break;
+        }
+        inflated = ws_inflate_message(inf, out, out_len, in, in_len + WS_DEFLATE_TAIL_LEN);
+        if (inflated != WS_INFLATE_ERR_FULL || out_len >= ws_con->max_message_len) {
+            break;
+        }
+        free(out);
+        out = NULL;
+        out_len = MIN(ws_con->max_message_len, out_len * 2);
+    }
+    free(inf);
+    free(in);
+    ws_con->inflate_in = NULL;
+    ws_con->inflate_in_len = 0;
+
+    if (no_memory) {
+        return ERR_MEM; // Not the message's fault, whatever the last try said.
+    }
+    if (inflated < 0) {
+        free(out);
+        if (inflated == WS_INFLATE_ERR_FULL) {
+            DEBUG_printf("Websocket message too large once inflated\n");
+            if (ws_con->close_oversized) {
+                websocket_send_close(ws_con, WS_CLOSE_TOO_BIG);
+                return ERR_VAL;
             }
+            return ERR_OK; // Skipped
+        }
+        DEBUG_printf("Bad compressed websocket message\n");
+        websocket_send_close(ws_con, WS_CLOSE_PROTOCOL_ERROR);
+        return ERR_VAL;
+    }
+
+    ws_con->inflated = out;
+    ws_con->inflated_pos = 0;
+    ws_con->read_length = inflated;
+    return ERR_OK;
+}
+
+/**
+ * @brief Reads frame headers until we are in a data frame with payload left to read.
+ * Frames we don't handle are skipped.
+ *
+ * @param wait false: once a frame has been handled (a ping say), return ERR_WOULDBLOCK instead of waiting
+ *             for the next header when nothing more is buffered
+ */
+err_t websocket_next_data_frame(ws_framinator* ws_con, bool wait) {
+    err_t ret;
+    bool handled = false;
+
+    while (ws_con->read_length == 0) {
+        if (handled && !wait && !ws_con->con->p_current) {
+            return ERR_WOULDBLOCK;
+        }
+        handled = true;
+
+        if (ws_con->inflated) {
+            // Done with the last inflated message
+            free(ws_con->inflated);
+            ws_con->inflated = NULL;
         }
 
         // Read a new frame/payload
@@ -502,6 +1354,8 @@ err_t websocket_read(ws_framinator* ws_con, char* buf, size_t size) {
                      ((uint64_t) lwip_ntohl((uint32_t) (length >> 32))      );
         }
         ws_con->read_length = length; // all frame types have a length field.
+        ws_con->read_unmasked = 0;
+        WS_STAT(ws_con->con->stats.frames_in++);
 
         if (header & WS_HEADER_MASK) {
             if ((ret = ws_t_read(ws_con->con, (char*) &ws_con->read_mask, sizeof(ws_con->read_mask))) < 0) {
@@ -511,8 +1365,28 @@ err_t websocket_read(ws_framinator* ws_con, char* buf, size_t size) {
             ws_con->read_mask = 0; // basically a no-op when XOR happens.
         }
 
-        // Handle continuation frames of the previous opcode.
+        // Control frames can show up between the frames of a message. They don't touch
+        // the message state (lastOp, message length).
         uint8_t opcode = WS_HEADER_GET_OPCODE(header);
+
+        // RSV1 is the only reserved bit with a meaning (permessage-deflate), and only on the first frame
+        // of a data message.
+        bool rsv1 = header & WS_HEADER_RSV1;
+        if ((header & (WS_HEADER_RSV2 | WS_HEADER_RSV3)) || (rsv1 && (!ws_con->deflate
+                || WS_HEADER_OPCODE_IS_CONTROL(opcode) || opcode == WS_HEADER_OPCODE_CONTINUATION))) {
+            DEBUG_printf("Unexpected reserved bits in websocket frame\n");
+            websocket_send_close(ws_con, WS_CLOSE_PROTOCOL_ERROR);
+            return ERR_VAL;
+        }
+
+        if (WS_HEADER_OPCODE_IS_CONTROL(opcode)) {
+            if ((ret = websocket_handle_control_frame(ws_con, opcode, header & WS_HEADER_FIN))) {
+                return ret;
+            }
+            continue;
+        }
+
+        // Handle continuation frames of the previous opcode.
         if (opcode == WS_HEADER_OPCODE_CONTINUATION && ws_con->read_lastOp != WS_HEADER_OPCODE_CONTINUATION) {
             // We are a continuation and the lastOp is valid
             opcode = ws_con->read_lastOp;
@@ -532,21 +1406,162 @@ err_t websocket_read(ws_framinator* ws_con, char* buf, size_t size) {
             // Continuation frames will need it!
             ws_con->read_lastOp = opcode;
         }
+        ws_con->read_opcode = opcode;
 
-        // TODO: Handle more packet types. (pings and stuff)
-        if (opcode != WS_HEADER_OPCODE_DATA && opcode != WS_HEADER_OPCODE_TEXT) {
+        if (WS_HEADER_GET_OPCODE(header) != WS_HEADER_OPCODE_CONTINUATION) {
+            // First frame of a new message
+            ws_con->read_message_len = 0;
+            ws_con->read_skip_message = false;
+            ws_con->read_compressed = rsv1;
+        }
+        ws_con->read_message_len += length;
 
+        bool skip = ws_con->read_skip_message;
+
+        if (!skip && ws_con->read_message_len > ws_con->max_message_len) {
+            DEBUG_printf("Websocket message too large: %llu\n", ws_con->read_message_len);
+            if (ws_con->close_oversized) {
+                websocket_send_close(ws_con, WS_CLOSE_TOO_BIG);
+                return ERR_VAL;
+            }
+            // Continuation frames of this message will be skipped too.
+            ws_con->read_skip_message = skip = true;
+        }
+
+        if (opcode != WS_HEADER_OPCODE_DATA && opcode != WS_HEADER_OPCODE_TEXT) {
             DEBUG_printf("Unhandled websocket frame: %hhd\n", opcode);
-            // TODO: add ws_t_skip function and remove this lag maker!
-            char sloooooow;
-            while (ws_con->read_length) {
-                if ((ret = ws_t_read(ws_con->con, &sloooooow, 1)) < 0) {
-                    return ret;
-                }
-                ws_con->read_length--;
+            skip = true;
+        }
+
+        if (skip) {
+            if (ws_con->read_length > WS_MAX_SKIP_LEN) {
+                DEBUG_printf("Not going to skip that much\n");
+                return ERR_VAL;
+            }
+            if ((ret = ws_t_skip(ws_con->con, ws_con->read_length)) < 0) {
+                return ret;
+            }
+            ws_con->read_length = 0;
+
+            // Whatever was gathered of a compressed one
+            free(ws_con->inflate_in);
+            ws_con->inflate_in = NULL;
+            ws_con->inflate_in_len = 0;
+        } else if (ws_con->read_compressed) {
+            if ((ret = websocket_gather_compressed(ws_con, header & WS_HEADER_FIN))) {
+                return ret;
             }
         }
     }
 
     return ERR_OK;
 }
+
+err_t websocket_read(ws_framinator* ws_con, char* buf, size_t size) {
+    err_t ret;
+
+    if (!ws_con->con->p_current && !ws_con->corked && (ret = websocket_flush(ws_con))) {
+        // Nobody is going to write more while we wait for data. Don't leave a small frame hanging.
+        return ret;
+    }
+
+    while (size > 0) {
+        if ((ret = websocket_next_data_frame(ws_con, true))) {
+            return ret;
+        }
+
+        size_t canReadLen = MIN(ws_con->read_length, size);
+        if (ws_con->inflated) {
+            memcpy(buf, ws_con->inflated + ws_con->inflated_pos, canReadLen);
+            ws_con->inflated_pos += canReadLen;
+        } else if (ws_con->read_unmasked) {
+            // websocket_peek() already unmasked these in place.
+            canReadLen = MIN(canReadLen, ws_con->read_unmasked);
+            if ((ret = ws_t_read(ws_con->con, buf, canReadLen)) < 0) {
+                return ret;
+            }
+            ws_con->read_unmasked -= canReadLen;
+        } else {
+            // Unmask on the way out of the pbufs
+            if ((ret = ws_t_read_masked(ws_con->con, buf, canReadLen, &ws_con->read_mask)) < 0) {
+                return ret;
+            }
+        }
+
+        buf                 += canReadLen;
+        size                -= canReadLen;
+        ws_con->read_length -= canReadLen;
+    }
+
+    return ERR_OK;
+}
+
+/**
+ * @brief Zero-copy read. Points slice at the next bytes of payload right inside the pbuf, unmasked in place.
+ * The slice stays put until websocket_consume() is called, even if the task yields in the mean time.
+ * Peeking again without consuming returns the same bytes (plus any that arrived in the same pbuf).
+ *
+ * @param ws_con
+ * @param slice Set to the payload bytes
+ * @return int Number of bytes in the slice (at most the rest of the frame), 0 if all that was buffered
+ *             were control frames, or a negative error code
+ */
+int websocket_peek(ws_framinator* ws_con, char** slice) {
+    int ret;
+
+    if (!ws_con->con->p_current && !ws_con->corked && (ret = websocket_flush(ws_con))) {
+        return ret;
+    }
+
+    if ((ret = websocket_next_data_frame(ws_con, false)) == ERR_WOULDBLOCK) {
+        // Only control frames came in. Don't sit on the next header, the caller may have other things to do.
+        return 0;
+    } else if (ret) {
+        return ret;
+    }
+
+    if (ws_con->inflated) {
+        // Already out of the pbufs
+        *slice = (char*) ws_con->inflated + ws_con->inflated_pos;
+        return ws_con->read_length;
+    }
+
+    if ((ret = ws_t_peak(ws_con->con, slice)) < 0) {
+        return ret;
+    }
+
+    size_t len = MIN((uint64_t) ret, ws_con->read_length);
+    if (len > ws_con->read_unmasked) {
+        websocket_apply_mask(ws_con, *slice + ws_con->read_unmasked, len - ws_con->read_unmasked);
+        ws_con->read_unmasked = len;
+    }
+
+    // Don't let tcp_cli_con_recv coalesce this pbuf out from under the slice.
+    ws_con->con->p_pinned = true;
+    return len;
+}
+
+/**
+ * @brief Releases the first len bytes of the last websocket_peek() slice.
+ */
+err_t websocket_consume(ws_framinator* ws_con, size_t len) {
+    if (ws_con->inflated) {
+        if (len > ws_con->read_length) {
+            return ERR_ARG;
+        }
+        ws_con->inflated_pos += len;
+        ws_con->read_length  -= len;
+        return ERR_OK;
+    }
+
+    if (len > ws_con->read_unmasked) {
+        DEBUG_printf("ERROR: Can't consume more than was peeked! %u\n", (unsigned) len);
+        return ERR_ARG;
+    }
+
+    ws_con->read_unmasked -= len;
+    ws_con->read_length   -= len;
+    ws_con->con->p_pinned = false;
+
+    return ws_consume(ws_con->con, len);
+}
@@ -0,0 +1,416 @@
+#include "ws_deflate.h"
+
+#include <string.h>
+
+const uint8_t ws_deflate_tail[WS_DEFLATE_TAIL_LEN] = { 0x00, 0x00, 0xFF, 0xFF };
+
+// Length codes 257 to 285
+static const uint16_t ws_deflate_len_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t ws_deflate_len_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+// Distance codes 0 to 29
+static const uint16_t ws_deflate_dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t ws_deflate_dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+#define WS_DEFLATE_MIN_MATCH 3
+#define WS_DEFLATE_MAX_MATCH 258
+#define WS_DEFLATE_END_OF_BLOCK 256
+
+// ================ deflate ================
+
+// DEFLATE packs bits starting from the least significant one.
+typedef struct ws_bit_writer_ {
+    uint8_t* out;
+    size_t len;
+    size_t pos;
+    uint32_t bits;
+    int count;
+    bool full;
+} ws_bit_writer;
+
+static inline void ws_put_bits(ws_bit_writer* w, uint32_t value, int n) {
+    w->bits |= value << w->count;
+    w->count += n;
+    while (w->count >= 8) {
+        if (w->pos < w->len) {
+            w->out[w->pos++] = w->bits;
+        } else {
+            w->full = true;
+        }
+        w->bits >>= 8;
+        w->count -= 8;
+    }
+}
+
+/**
+ * @brief Huffman codes go out most significant bit first, so they are flipped around.
+ */
+static inline void ws_put_code(ws_bit_writer* w, uint32_t code, int n) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < n; i++) {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+    }
+    ws_put_bits(w, reversed, n);
+}
+
+/**
+ * @brief Fixed Huffman code of a literal/length symbol (RFC 1951 3.2.6).
+ */
+static inline void ws_put_fixed_symbol(ws_bit_writer* w, int symbol) {
+    if (symbol < 144) {
+        ws_put_code(w, 0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        ws_put_code(w, 0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        ws_put_code(w, symbol - 256, 7);
+    } else {
+        ws_put_code(w, 0xC0 + symbol - 280, 8);
+    }
+}
+
+static void ws_put_match(ws_bit_writer* w, int len, int dist) {
+    int code = 28;
+    while (ws_deflate_len_base[code] > len) {
+        code--;
+    }
+    ws_put_fixed_symbol(w, 257 + code);
+    ws_put_bits(w, len - ws_deflate_len_base[code], ws_deflate_len_extra[code]);
+
+    code = 29;
+    while (ws_deflate_dist_base[code] > dist) {
+        code--;
+    }
+    ws_put_code(w, code, 5);
+    ws_put_bits(w, dist - ws_deflate_dist_base[code], ws_deflate_dist_extra[code]);
+}
+
+static inline uint32_t ws_deflate_hash(const uint8_t* p) {
+    return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - WS_DEFLATE_HASH_BITS);
+}
+
+void ws_deflate_init(ws_deflate* def, uint8_t window_bits) {
+    def->window_bits = window_bits;
+}
+
+int ws_deflate_compress(ws_deflate* def, uint8_t* out, size_t out_len, const uint8_t* in, size_t in_len) {
+    if (in_len > WS_DEFLATE_MAX_IN_LEN) {
+        return -1;
+    }
+
+    ws_bit_writer w = { .out = out, .len = out_len };
+    size_t window = (size_t) 1 << def->window_bits;
+
+    // No context takeover, forget the last message.
+    memset(def->head, 0, sizeof(def->head));
+
+    // One fixed Huffman block, not the last one (BFINAL 0, BTYPE 01)
+    ws_put_bits(&w, 0x2, 3);
+
+    // Greedy, one candidate per hash. Good enough for what we send and it costs nothing to keep.
+    size_t i = 0;
+    while (i < in_len && !w.full) {
+        size_t match_len = 0;
+        size_t match_dist = 0;
+
+        if (i + WS_DEFLATE_MIN_MATCH <= in_len) {
+            uint32_t h = ws_deflate_hash(in + i);
+            size_t candidate = def->head[h];
+            def->head[h] = i + 1;
+
+            if (candidate && i - (candidate - 1) <= window) {
+                candidate--;
+                size_t max = in_len - i < WS_DEFLATE_MAX_MATCH ? in_len - i : WS_DEFLATE_MAX_MATCH;
+                while (match_len < max && in[candidate + match_len] == in[i + match_len]) {
+                    match_len++;
+                }
+                match_dist = i - candidate;
+            }
+        }
+
+        if (match_len >= WS_DEFLATE_MIN_MATCH) {
+            ws_put_match(&w, match_len, match_dist);
+            // Remember what was skipped over too, later matches can start in there.
+            for (size_t j = i + 1; j < i + match_len && j + WS_DEFLATE_MIN_MATCH <= in_len; j++) {
+                def->head[ws_deflate_hash(in + j)] = j + 1;
+            }
+            i += match_len;
+        } else {
+            ws_put_fixed_symbol(&w, in[i]);
+            i++;
+        }
+    }
+
+    ws_put_fixed_symbol(&w, WS_DEFLATE_END_OF_BLOCK);
+    // Sync flush: an empty stored block. Only its header (BFINAL 0, BTYPE 00) and the padding to the next byte
+    // are sent, the receiver adds the LEN/NLEN (ws_deflate_tail) back.
+    ws_put_bits(&w, 0, 3);
+    if (w.count) {
+        ws_put_bits(&w, 0, 8 - w.count);
+    }
+
+    return w.full ? -1 : (int) w.pos;
+}
+
+// ================ inflate ================
+
+static int ws_inflate_bits(ws_inflate* inf, int n) {
+    while (inf->bit_count < n) {
+        if (inf->in_pos >= inf->in_len) {
+            return -1; // Ran out
+        }
+        inf->bits |= (uint32_t) inf->in[inf->in_pos++] << inf->bit_count;
+        inf->bit_count += 8;
+    }
+    int value = inf->bits & ((1u << n) - 1);
+    inf->bits >>= n;
+    inf->bit_count -= n;
+    return value;
+}
+
+/**
+ * @brief Sets up canonical Huffman decoding for n symbols with the given code lengths (0 = not used).
+ *
+ * @return int 0 or -1 if there are more codes than fit in their lengths
+ */
+static int ws_inflate_build(uint16_t* count, uint16_t* symbol, const uint8_t* lengths, int n) {
+    uint16_t offset[16];
+
+    memset(count, 0, 16 * sizeof(uint16_t));
+    for (int i = 0; i < n; i++) {
+        count[lengths[i]]++;
+    }
+    count[0] = 0;
+
+    int left = 1;
+    for (int len = 1; len < 16; len++) {
+        left = (left << 1) - count[len];
+        if (left < 0) {
+            return -1;
+        }
+    }
+    // (Incomplete codes are fine as long as the missing ones are not used.)
+
+    offset[1] = 0;
+    for (int len = 1; len < 15; len++) {
+        offset[len + 1] = offset[len] + count[len];
+    }
+    for (int i = 0; i < n; i++) {
+        if (lengths[i]) {
+            symbol[offset[lengths[i]]++] = i;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads one Huffman coded symbol, a bit at a time.
+ */
+static int ws_inflate_decode(ws_inflate* inf, const uint16_t* count, const uint16_t* symbol) {
+    int code = 0;
+    int first = 0;
+    int index = 0;
+
+    for (int len = 1; len < 16; len++) {
+        int bit = ws_inflate_bits(inf, 1);
+        if (bit < 0) {
+            return -1;
+        }
+        code |= bit;
+        if (code - first < count[len]) {
+            return symbol[index + (code - first)];
+        }
+        index += count[len];
+        first = (first + count[len]) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static void ws_inflate_fixed_tables(ws_inflate* inf) {
+    int i = 0;
+    for (; i < 144; i++) inf->lengths[i] = 8;
+    for (; i < 256; i++) inf->lengths[i] = 9;
+    for (; i < 280; i++) inf->lengths[i] = 7;
+    for (; i < 288; i++) inf->lengths[i] = 8;
+    ws_inflate_build(inf->lit_count, inf->lit_symbol, inf->lengths, 288);
+
+    memset(inf->lengths, 5, 30);
+    ws_inflate_build(inf->dist_count, inf->dist_symbol, inf->lengths, 30);
+}
+
+static int ws_inflate_dynamic_tables(ws_inflate* inf) {
+    static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+    int hlit  = ws_inflate_bits(inf, 5);
+    int hdist = ws_inflate_bits(inf, 5);
+    int hclen = ws_inflate_bits(inf, 4);
+    if (hclen < 0) {
+        return WS_INFLATE_ERR_DATA;
+    }
+    hlit += 257;
+    hdist += 1;
+    hclen += 4;
+    if (hlit > 286 || hdist > 30) {
+        return WS_INFLATE_ERR_DATA;
+    }
+
+    // The code lengths are Huffman coded too. Borrow the literal tables for that code.
+    memset(inf->lengths, 0, 19);
+    for (int i = 0; i < hclen; i++) {
+        int len = ws_inflate_bits(inf, 3);
+        if (len < 0) {
+            return WS_INFLATE_ERR_DATA;
+        }
+        inf->lengths[order[i]] = len;
+    }
+    if (ws_inflate_build(inf->lit_count, inf->lit_symbol, inf->lengths, 19)) {
+        return WS_INFLATE_ERR_DATA;
+    }
+
+    int i = 0;
+    while (i < hlit + hdist) {
+        int symbol = ws_inflate_decode(inf, inf->lit_count, inf->lit_symbol);
+        if (symbol < 0) {
+            return WS_INFLATE_ERR_DATA;
+        }
+        if (symbol < 16) {
+            inf->lengths[i++] = symbol;
+            continue;
+        }
+
+        int len = 0;
+        int repeat;
+        if (symbol == 16) {
+            if (i == 0) {
+                return WS_INFLATE_ERR_DATA; // Nothing to repeat
+            }
+            len = inf->lengths[i - 1];
+            repeat = 3 + ws_inflate_bits(inf, 2);
+        } else if (symbol == 17) {
+            repeat = 3 + ws_inflate_bits(inf, 3);
+        } else {
+            repeat = 11 + ws_inflate_bits(inf, 7);
+        }
+        if (repeat < 3 || i + repeat > hlit + hdist) {
+            return WS_INFLATE_ERR_DATA;
+        }
+        memset(inf->lengths + i, len, repeat);
+        i += repeat;
+    }
+
+    if (!inf->lengths[WS_DEFLATE_END_OF_BLOCK]
+        || ws_inflate_build(inf->lit_count, inf->lit_symbol, inf->lengths, hlit)
+        || ws_inflate_build(inf->dist_count, inf->dist_symbol, inf->lengths + hlit, hdist)) {
+        return WS_INFLATE_ERR_DATA;
+    }
+    return 0;
+}
+
+int ws_inflate_message(ws_inflate* inf, uint8_t* out, size_t out_len, const uint8_t* in, size_t in_len) {
+    inf->in = in;
+    inf->in_len = in_len;
+    inf->in_pos = 0;
+    inf->bits = 0;
+    inf->bit_count = 0;
+
+    size_t pos = 0;
+    bool last = false;
+
+    // The tail's empty stored block lines the end up on a byte, after that there is nothing left.
+    while (!last && (inf->in_pos < inf->in_len || inf->bit_count >= 8)) {
+        last = ws_inflate_bits(inf, 1);
+        int type = ws_inflate_bits(inf, 2);
+
+        if (type == 0) {
+            // Stored. Starts on the next byte.
+            inf->bits >>= inf->bit_count & 7;
+            inf->bit_count &= ~7;
+            int len = ws_inflate_bits(inf, 16);
+            int nlen = ws_inflate_bits(inf, 16);
+            if (len < 0 || nlen < 0 || len != (~nlen & 0xFFFF)) {
+                return WS_INFLATE_ERR_DATA;
+            }
+            if (out_len - pos < (size_t) len) {
+                return WS_INFLATE_ERR_FULL;
+            }
+            while (len--) {
+                int byte = ws_inflate_bits(inf, 8);
+                if (byte < 0) {
+                    return WS_INFLATE_ERR_DATA;
+                }
+                out[pos++] = byte;
+            }
+            continue;
+        }
+
+        if (type == 1) {
+            ws_inflate_fixed_tables(inf);
+        } else if (type == 2) {
+            if (ws_inflate_dynamic_tables(inf)) {
+                return WS_INFLATE_ERR_DATA;
+            }
+        } else {
+            return WS_INFLATE_ERR_DATA; // Reserved, or ran out
+        }
+
+        while (true) {
+            int symbol = ws_inflate_decode(inf, inf->lit_count, inf->lit_symbol);
+            if (symbol < 0) {
+                return WS_INFLATE_ERR_DATA;
+            }
+            if (symbol < 256) {
+                if (pos == out_len) {
+                    return WS_INFLATE_ERR_FULL;
+                }
+                out[pos++] = symbol;
+                continue;
+            }
+            if (symbol == WS_DEFLATE_END_OF_BLOCK) {
+                break;
+            }
+
+            symbol -= 257;
+            if (symbol >= 29) {
+                return WS_INFLATE_ERR_DATA;
+            }
+            int len = ws_inflate_bits(inf, ws_deflate_len_extra[symbol]);
+            int dist_symbol = ws_inflate_decode(inf, inf->dist_count, inf->dist_symbol);
+            if (len < 0 || dist_symbol < 0 || dist_symbol >= 30) {
+                return WS_INFLATE_ERR_DATA;
+            }
+            len += ws_deflate_len_base[symbol];
+            int dist = ws_inflate_bits(inf, ws_deflate_dist_extra[dist_symbol]);
+            if (dist < 0) {
+                return WS_INFLATE_ERR_DATA;
+            }
+            dist += ws_deflate_dist_base[dist_symbol];
+
+            // No context takeover, so nothing before the message can be referenced.
+            if ((size_t) dist > pos) {
+                return WS_INFLATE_ERR_DATA;
+            }
+            if (out_len - pos < (size_t) len) {
+                return WS_INFLATE_ERR_FULL;
+            }
+            // Byte by byte, the match may overlap what it is writing.
+            for (int i = 0; i < len; i++, pos++) {
+                out[pos] = out[pos - dist];
+            }
+        }
+    }
+
+    return pos;
+}
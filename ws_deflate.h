@@ -0,0 +1,112 @@
+#ifndef WS_DEFLATE_H
+#define WS_DEFLATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Raw DEFLATE (RFC 1951) for permessage-deflate (RFC 7692), sized for the RP2040.
+// There is no context takeover in either direction: every message starts from scratch, so nothing
+// but the hash table has to be kept per connection.
+
+// Furthest back a match may look (server_max_window_bits). 8 to 15.
+#ifndef WS_DEFLATE_WINDOW_BITS
+#define WS_DEFLATE_WINDOW_BITS 10
+#endif
+// What we ask clients to stick to (client_max_window_bits), when they let us. 8 to 15.
+#ifndef WS_DEFLATE_CLIENT_WINDOW_BITS
+#define WS_DEFLATE_CLIENT_WINDOW_BITS 10
+#endif
+// The compressor's hash table is 2 << WS_DEFLATE_HASH_BITS bytes
+#ifndef WS_DEFLATE_HASH_BITS
+#define WS_DEFLATE_HASH_BITS 8
+#endif
+
+#define WS_DEFLATE_MIN_WINDOW_BITS 8
+#define WS_DEFLATE_MAX_WINDOW_BITS 15
+
+// The compressor only does fixed Huffman blocks. Worst case that is 9 bits a byte, plus the block header,
+// end of block and sync flush. (Input that does not shrink is sent as is anyway.)
+#define WS_DEFLATE_BOUND(len) ((len) + (len) / 8 + 4)
+
+// The max input to ws_deflate_compress(), positions in the hash table are 16 bit.
+#define WS_DEFLATE_MAX_IN_LEN 0xFFFE
+
+// Appended to a message before inflating it (RFC 7692 7.2.2). The sender strips it off.
+#define WS_DEFLATE_TAIL_LEN 4
+extern const uint8_t ws_deflate_tail[WS_DEFLATE_TAIL_LEN];
+
+// Well below lwIP's err_t (-1 to -16), so they can't be mistaken for one.
+#define WS_INFLATE_ERR_DATA -100 // Not valid DEFLATE, or a match reaching back before the message
+#define WS_INFLATE_ERR_FULL -101 // The output buffer is too small
+
+/**
+ * @brief What was agreed on in the handshake.
+ */
+typedef struct ws_deflate_params_ {
+    bool enabled;
+    // Window we compress with (server_max_window_bits)
+    uint8_t server_window_bits;
+    // Window the client compresses with (client_max_window_bits). 15 if the client did not offer to limit it.
+    uint8_t client_window_bits;
+    // Only allowed to say these in the response if they were in the offer
+    bool server_window_bits_offered;
+    bool client_window_bits_offered;
+} ws_deflate_params;
+
+/**
+ * @brief Compressor state. Nothing in it lives from one message to the next.
+ */
+typedef struct ws_deflate_ {
+    // Position + 1 of the last 3 bytes that hashed here, 0 for none.
+    uint16_t head[1 << WS_DEFLATE_HASH_BITS];
+    uint8_t window_bits;
+} ws_deflate;
+
+void ws_deflate_init(ws_deflate* def, uint8_t window_bits);
+
+/**
+ * @brief Compresses a whole message (or the whole first and only frame of one).
+ * The output ends with a sync flush with its 00 00 ff ff taken off, as RFC 7692 wants it.
+ *
+ * @param def
+ * @param out
+ * @param out_len Give up if it does not fit. WS_DEFLATE_BOUND(in_len) always fits.
+ * @param in
+ * @param in_len At most WS_DEFLATE_MAX_IN_LEN
+ * @return int Compressed length, or -1 if it did not fit
+ */
+int ws_deflate_compress(ws_deflate* def, uint8_t* out, size_t out_len, const uint8_t* in, size_t in_len);
+
+/**
+ * @brief Decompressor state. Big-ish (~1.2K), it only has to be around while a message is inflated.
+ */
+typedef struct ws_inflate_ {
+    // Canonical Huffman codes of the current block: how many codes of each length and the symbols in code order.
+    uint16_t lit_count[16];
+    uint16_t lit_symbol[288];
+    uint16_t dist_count[16];
+    uint16_t dist_symbol[30];
+    // Code lengths of a dynamic block while it's header is read
+    uint8_t lengths[288 + 32];
+
+    const uint8_t* in;
+    size_t in_len;
+    size_t in_pos;
+    uint32_t bits;
+    int bit_count;
+} ws_inflate;
+
+/**
+ * @brief Inflates a whole message. in has to end with ws_deflate_tail (it's where the sender's sync flush ends).
+ *
+ * @param inf Scratch space
+ * @param out
+ * @param out_len
+ * @param in
+ * @param in_len
+ * @return int Inflated length or WS_INFLATE_ERR_*
+ */
+int ws_inflate_message(ws_inflate* inf, uint8_t* out, size_t out_len, const uint8_t* in, size_t in_len);
+
+#endif
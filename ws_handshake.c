@@ -0,0 +1,298 @@
+#include "ws_handshake.h"
+
+#include <string.h>
+#include <stdio.h>
+#include "mbedtls/version.h"
+
+// mbedtls 3 dropped the _ret suffix (the plain names return int now)
+#if MBEDTLS_VERSION_MAJOR >= 3
+#define mbedtls_sha1_starts_ret mbedtls_sha1_starts
+#define mbedtls_sha1_update_ret mbedtls_sha1_update
+#define mbedtls_sha1_finish_ret mbedtls_sha1_finish
+#endif
+
+static const char ws_handshake_uuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+void ws_handshake_init(ws_handshake* hs) {
+    mbedtls_sha1_init(&hs->sha1);
+    mbedtls_sha1_starts_ret(&hs->sha1);
+    hs->key_decode.partial = 0;
+    hs->key_len = 0;
+    hs->key_bytes = 0;
+}
+
+int ws_handshake_key_update(ws_handshake* hs, const char* key, int len) {
+    if (hs->key_len + len > WS_HANDSHAKE_KEY_LEN) {
+        hs->key_len = WS_HANDSHAKE_KEY_LEN + 1; // Stays too long
+        return WS_HANDSHAKE_ERR_KEY;
+    }
+
+    // Decoding it is the easy way to know it's really base64 of the right length.
+    // Junk is skipped by the decoder so it shows up as too few bytes.
+    char bytes[WS_HANDSHAKE_KEY_LEN * 3 / 4 + 3];
+    hs->key_bytes += decode_base64(&hs->key_decode, (char*) key, bytes, len, 0);
+
+    hs->key_len += len;
+    mbedtls_sha1_update_ret(&hs->sha1, (const unsigned char*) key, len);
+    return 0;
+}
+
+int ws_handshake_key_finish(ws_handshake* hs) {
+    char bytes[3];
+    hs->key_bytes += decode_base64(&hs->key_decode, NULL, bytes, 0, 1);
+    if (hs->key_len != WS_HANDSHAKE_KEY_LEN || hs->key_bytes != WS_HANDSHAKE_KEY_BYTES) {
+        return WS_HANDSHAKE_ERR_KEY;
+    }
+
+    unsigned char hash[20];
+    mbedtls_sha1_update_ret(&hs->sha1, (const unsigned char*) ws_handshake_uuid, sizeof(ws_handshake_uuid) - 1);
+    mbedtls_sha1_finish_ret(&hs->sha1, hash);
+    encode_base64(hs->accept, (const char*) hash, sizeof(hash));
+    return 0;
+}
+
+void ws_handshake_free(ws_handshake* hs) {
+    mbedtls_sha1_free(&hs->sha1);
+}
+
+static char ws_handshake_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+bool ws_handshake_has_token(const char* list, const char* token) {
+    size_t token_len = strlen(token);
+
+    while (*list) {
+        // Skip to the start of the next item
+        while (*list == ' ' || *list == '\t' || *list == ',') {
+            list++;
+        }
+
+        size_t i = 0;
+        while (i < token_len && list[i] && ws_handshake_lower(list[i]) == ws_handshake_lower(token[i])) {
+            i++;
+        }
+        list += i;
+        if (i == token_len && (*list == '\0' || *list == ',' || *list == ';' || *list == ' ' || *list == '\t')) {
+            return true;
+        }
+
+        // Not it, on to the next one
+        while (*list && *list != ',') {
+            list++;
+        }
+    }
+    return false;
+}
+
+static const char* ws_handshake_skip_space(const char* p) {
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    return p;
+}
+
+/**
+ * @brief Length of the word (extension or parameter name) at p.
+ */
+static size_t ws_handshake_word_len(const char* p) {
+    size_t len = 0;
+    while (p[len] && !strchr(" \t,;=\"", p[len])) {
+        len++;
+    }
+    return len;
+}
+
+static bool ws_handshake_word_is(const char* p, size_t len, const char* word) {
+    if (strlen(word) != len) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (ws_handshake_lower(p[i]) != ws_handshake_lower(word[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Checks the parameters of a list item (p is right after its name) for a q of 0.
+ * A q that can't be read counts as not 0.
+ */
+static bool ws_handshake_q_zero(const char* p) {
+    while (*p && *p != ',') {
+        if (*p != ';') {
+            p++;
+            continue;
+        }
+        p = ws_handshake_skip_space(p + 1);
+        size_t len = ws_handshake_word_len(p);
+        bool q = ws_handshake_word_is(p, len, "q");
+        p = ws_handshake_skip_space(p + len);
+        if (!q || *p != '=') {
+            continue;
+        }
+        // qvalue = "0" [ "." 0*3DIGIT ] / "1" [ "." 0*3("0") ]
+        p = ws_handshake_skip_space(p + 1);
+        if (*p++ != '0') {
+            return false;
+        }
+        if (*p == '.') {
+            for (p++; *p == '0'; p++);
+        }
+        return *p < '1' || *p > '9';
+    }
+    return false;
+}
+
+bool ws_handshake_accepts(const char* list, const char* coding) {
+    // -1 while there is no item for it
+    int named = -1;
+    int any = -1;
+
+    while (*list) {
+        while (*list == ' ' || *list == '\t' || *list == ',') {
+            list++;
+        }
+        size_t len = ws_handshake_word_len(list);
+        bool ok = !ws_handshake_q_zero(list + len);
+        if (ws_handshake_word_is(list, len, coding)) {
+            named = ok;
+        } else if (ws_handshake_word_is(list, len, "*")) {
+            any = ok;
+        }
+
+        while (*list && *list != ',') {
+            list++;
+        }
+    }
+    return named >= 0 ? named : any > 0;
+}
+
+bool ws_handshake_etag_match(const char* list, const char* etag) {
+    size_t etag_len = strlen(etag);
+
+    while (*list) {
+        while (*list == ' ' || *list == '\t' || *list == ',') {
+            list++;
+        }
+        if (*list == '*') {
+            return true;
+        }
+        // If-None-Match compares weakly, W/ does not matter
+        if (list[0] == 'W' && list[1] == '/') {
+            list += 2;
+        }
+        if (!strncmp(list, etag, etag_len)
+                && (list[etag_len] == '\0' || strchr(" \t,", list[etag_len]))) {
+            return true;
+        }
+
+        // A quoted tag can have a ',' in it
+        if (*list == '"') {
+            for (list++; *list && *list != '"'; list++);
+            list += *list == '"';
+        }
+        while (*list && *list != ',') {
+            list++;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Window bits parameter value (quotes are allowed around it).
+ *
+ * @return int 8 to 15, 0 for no value or -1 if it's bad
+ */
+static int ws_handshake_window_bits(const char** p) {
+    const char* s = ws_handshake_skip_space(*p);
+    if (*s != '=') {
+        return 0;
+    }
+    s = ws_handshake_skip_space(s + 1);
+
+    bool quoted = *s == '"';
+    s += quoted;
+    int bits = 0;
+    int digits = 0;
+    for (; *s >= '0' && *s <= '9' && digits < 3; s++, digits++) {
+        bits = bits * 10 + (*s - '0');
+    }
+    if (quoted && *s++ != '"') {
+        return -1;
+    }
+    *p = s;
+    return digits && bits >= WS_DEFLATE_MIN_WINDOW_BITS && bits <= WS_DEFLATE_MAX_WINDOW_BITS ? bits : -1;
+}
+
+bool ws_handshake_deflate_offer(const char* extensions, ws_deflate_params* params) {
+    const char* p = extensions;
+
+    while (*p) {
+        // An offer: name *(";" param ["=" value])
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        size_t len = ws_handshake_word_len(p);
+        bool ok = ws_handshake_word_is(p, len, "permessage-deflate");
+        p += len;
+
+        ws_deflate_params offer = {
+            .enabled = true,
+            .server_window_bits = WS_DEFLATE_WINDOW_BITS,
+            .client_window_bits = WS_DEFLATE_MAX_WINDOW_BITS,
+        };
+
+        while (*p && *p != ',') {
+            if (*p != ';') {
+                p++;
+                continue;
+            }
+            p = ws_handshake_skip_space(p + 1);
+            len = ws_handshake_word_len(p);
+            const char* name = p;
+            p += len;
+
+            if (ws_handshake_word_is(name, len, "server_no_context_takeover")
+                || ws_handshake_word_is(name, len, "client_no_context_takeover")) {
+                // We do that anyway
+            } else if (ws_handshake_word_is(name, len, "server_max_window_bits")) {
+                int bits = ws_handshake_window_bits(&p);
+                if (bits <= 0) {
+                    ok = false; // Needs a value
+                } else if (bits < offer.server_window_bits) {
+                    offer.server_window_bits = bits;
+                }
+                offer.server_window_bits_offered = true;
+            } else if (ws_handshake_word_is(name, len, "client_max_window_bits")) {
+                // No value just means the client can take a limit
+                int bits = ws_handshake_window_bits(&p);
+                if (bits < 0) {
+                    ok = false;
+                }
+                offer.client_window_bits = (bits && bits < WS_DEFLATE_CLIENT_WINDOW_BITS) ? bits : WS_DEFLATE_CLIENT_WINDOW_BITS;
+                offer.client_window_bits_offered = true;
+            } else {
+                ok = false;
+            }
+        }
+
+        if (ok) {
+            *params = offer;
+            return true;
+        }
+    }
+    return false;
+}
+
+int ws_handshake_deflate_response(const ws_deflate_params* params, char* buf, size_t size) {
+    int len = snprintf(buf, size, "permessage-deflate; server_no_context_takeover; client_no_context_takeover");
+    if (params->server_window_bits_offered && len >= 0 && (size_t) len < size) {
+        len += snprintf(buf + len, size - len, "; server_max_window_bits=%d", params->server_window_bits);
+    }
+    if (params->client_window_bits_offered && len >= 0 && (size_t) len < size) {
+        len += snprintf(buf + len, size - len, "; client_max_window_bits=%d", params->client_window_bits);
+    }
+    return len;
+}
@@ -0,0 +1,94 @@
+#ifndef WS_HANDSHAKE_H
+#define WS_HANDSHAKE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "mbedtls/sha1.h"
+
+#include "bufferless_str.h"
+#include "ws_deflate.h"
+
+// Sec-WebSocket-Key is 16 random bytes in base64
+#define WS_HANDSHAKE_KEY_LEN 24
+#define WS_HANDSHAKE_KEY_BYTES 16
+// base64 of a SHA-1
+#define WS_HANDSHAKE_ACCEPT_LEN 28
+
+// The only Sec-WebSocket-Version there is (RFC 6455)
+#define WS_HANDSHAKE_VERSION "13"
+
+// Something is wrong with Sec-WebSocket-Key (or it's missing)
+#define WS_HANDSHAKE_ERR_KEY -1
+
+/**
+ * @brief Sec-WebSocket-Accept worked out as the key comes in, no copy of the key needed.
+ */
+typedef struct ws_handshake_ {
+    mbedtls_sha1_context sha1;
+    base64_ctx key_decode;
+    int key_len;       // chars hashed so far
+    int key_bytes;     // what they decode to, has to come out as 16
+    char accept[WS_HANDSHAKE_ACCEPT_LEN];
+} ws_handshake;
+
+/**
+ * @brief Gets ready for a new key. ws_handshake_free() when done.
+ */
+void ws_handshake_init(ws_handshake* hs);
+
+/**
+ * @brief Hashes the next part of Sec-WebSocket-Key. Call it with each piece as it comes out of the pbufs.
+ * Too long keys are noticed here, the rest in ws_handshake_key_finish().
+ *
+ * @param hs
+ * @param key
+ * @param len
+ * @return int 0 or WS_HANDSHAKE_ERR_KEY
+ */
+int ws_handshake_key_update(ws_handshake* hs, const char* key, int len);
+
+/**
+ * @brief Checks the key is a full 16 bytes of base64 and fills in hs->accept (not null terminated).
+ *
+ * @return int 0 or WS_HANDSHAKE_ERR_KEY
+ */
+int ws_handshake_key_finish(ws_handshake* hs);
+
+void ws_handshake_free(ws_handshake* hs);
+
+/**
+ * @brief Looks for token in a comma separated header value (like "keep-alive, Upgrade"). Ignores case.
+ * Parameters after a ';' are not looked at.
+ */
+bool ws_handshake_has_token(const char* list, const char* token);
+
+/**
+ * @brief Whether an Accept-Encoding value (like "gzip, deflate;q=0.5") takes coding. Ignores case.
+ * An item with q=0 turns the coding down, "*" stands for any coding that is not named.
+ */
+bool ws_handshake_accepts(const char* list, const char* coding);
+
+/**
+ * @brief Whether an If-None-Match value has etag (quoted) in it, or is "*". Weak tags (W/"...") match too.
+ */
+bool ws_handshake_etag_match(const char* list, const char* etag);
+
+/**
+ * @brief Picks the first permessage-deflate offer in Sec-WebSocket-Extensions that we can take.
+ * Offers with parameters we don't know (or bad values) are passed over, like RFC 7692 asks.
+ *
+ * @param extensions The header value
+ * @param params Filled in if one was found
+ * @return true if permessage-deflate can be used
+ */
+bool ws_handshake_deflate_offer(const char* extensions, ws_deflate_params* params);
+
+/**
+ * @brief Writes the Sec-WebSocket-Extensions value that accepts params. We never keep context
+ * between messages, so both no_context_takeover parameters are always in there.
+ *
+ * @return int Length written (snprintf style)
+ */
+int ws_handshake_deflate_response(const ws_deflate_params* params, char* buf, size_t size);
+
+#endif
@@ -0,0 +1,139 @@
+#include "ws_mask.h"
+
+#if WS_MASK_HAVE_SSE2
+#include <immintrin.h>
+#endif
+
+// Below this the byte/word loops win over setting up a vector.
+#define WS_MASK_VECTOR_MIN 32
+
+uint32_t ws_mask_copy_bytes(void* dst, const void* src, size_t len, uint32_t mask) {
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+
+    for (size_t i = 0; i < len; i++) {
+        d[i] = s[i] ^ (uint8_t) (mask >> ((i % 4) * 8));
+    }
+    return ws_mask_rotate(mask, len);
+}
+
+uint32_t ws_mask_copy_words(void* dst, const void* src, size_t len, uint32_t mask) {
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+
+    // Bytes until dst is aligned. 0 when it already is.
+    size_t head = (-(uintptr_t) d) & 3;
+    if (head > len) {
+        head = len;
+    }
+    for (size_t i = 0; i < head; i++) {
+        d[i] = s[i] ^ (uint8_t) (mask >> (i * 8));
+    }
+    mask = ws_mask_rotate(mask, head);
+    d   += head;
+    s   += head;
+    len -= head;
+
+    size_t words = len / 4;
+    uint32_t* dw = (uint32_t*) d;
+    size_t s_off = (uintptr_t) s & 3;
+
+    if (s_off == 0) {
+        const uint32_t* sw = (const uint32_t*) s;
+        size_t i = 0;
+        // Unrolled a bit, the M0+ has no branch prediction to hide the loop overhead.
+        for (; i + 4 <= words; i += 4) {
+            uint32_t a = sw[i], b = sw[i + 1], c = sw[i + 2], e = sw[i + 3];
+            dw[i]     = a ^ mask;
+            dw[i + 1] = b ^ mask;
+            dw[i + 2] = c ^ mask;
+            dw[i + 3] = e ^ mask;
+        }
+        for (; i < words; i++) {
+            dw[i] = sw[i] ^ mask;
+        }
+    } else if (words) {
+        // src does not line up with dst. Read aligned words and shift them together (little-endian).
+        // The last word read still holds a byte of src, so nothing past the end is touched.
+        const uint32_t* sw = (const uint32_t*) (s - s_off);
+        unsigned lo = s_off * 8;
+        unsigned hi = 32 - lo;
+        uint32_t prev = *sw++;
+        for (size_t i = 0; i < words; i++) {
+            uint32_t next = *sw++;
+            dw[i] = ((prev >> lo) | (next << hi)) ^ mask;
+            prev = next;
+        }
+    }
+    d += words * 4;
+    s += words * 4;
+
+    // Whole words leave the mask where it was.
+    for (size_t i = 0; i < len % 4; i++) {
+        d[i] = s[i] ^ (uint8_t) (mask >> (i * 8));
+    }
+    return ws_mask_rotate(mask, len);
+}
+
+#if WS_MASK_HAVE_SSE2
+uint32_t ws_mask_copy_sse2(void* dst, const void* src, size_t len, uint32_t mask) {
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+    size_t i = 0;
+
+    __m128i m = _mm_set1_epi32((int) mask);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        _mm_storeu_si128((__m128i*) (d + i), _mm_xor_si128(v, m));
+    }
+    // 16 is a multiple of 4, the mask is still lined up.
+    ws_mask_copy_words(d + i, s + i, len - i, mask);
+    return ws_mask_rotate(mask, len);
+}
+
+#if WS_MASK_HAVE_AVX2
+__attribute__((target("avx2")))
+uint32_t ws_mask_copy_avx2(void* dst, const void* src, size_t len, uint32_t mask) {
+    uint8_t* d = dst;
+    const uint8_t* s = src;
+    size_t i = 0;
+
+    __m256i m = _mm256_set1_epi32((int) mask);
+    for (; i + 64 <= len; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i*) (s + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (s + i + 32));
+        _mm256_storeu_si256((__m256i*) (d + i), _mm256_xor_si256(a, m));
+        _mm256_storeu_si256((__m256i*) (d + i + 32), _mm256_xor_si256(b, m));
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (s + i));
+        _mm256_storeu_si256((__m256i*) (d + i), _mm256_xor_si256(v, m));
+    }
+    ws_mask_copy_sse2(d + i, s + i, len - i, mask);
+    return ws_mask_rotate(mask, len);
+}
+
+int ws_mask_cpu_has_avx2() {
+    static int has_avx2 = -1;
+    if (has_avx2 < 0) {
+        __builtin_cpu_init();
+        has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return has_avx2;
+}
+#endif
+#endif
+
+uint32_t ws_mask_copy(void* dst, const void* src, size_t len, uint32_t mask) {
+#if WS_MASK_HAVE_SSE2
+    if (len >= WS_MASK_VECTOR_MIN) {
+#if WS_MASK_HAVE_AVX2
+        if (ws_mask_cpu_has_avx2()) {
+            return ws_mask_copy_avx2(dst, src, len, mask);
+        }
+#endif
+        return ws_mask_copy_sse2(dst, src, len, mask);
+    }
+#endif
+    return ws_mask_copy_words(dst, src, len, mask);
+}
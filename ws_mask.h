@@ -0,0 +1,51 @@
+#ifndef WS_MASK_H
+#define WS_MASK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Masks are kept the way they come off the wire, read as a little-endian uint32_t.
+// Byte i of the payload is XOR'ed with (mask >> ((i % 4) * 8)).
+
+/**
+ * @brief Lines the mask up with the byte after len bytes were (un)masked.
+ */
+static inline uint32_t ws_mask_rotate(uint32_t mask, size_t len) {
+    size_t shift = (len % 4) * 8;
+    return shift ? (mask >> shift) | (mask << (32 - shift)) : mask;
+}
+
+/**
+ * @brief Copies len bytes from src to dst and (un)masks them in the same pass.
+ * dst may equal src to unmask in place. Other overlaps are not allowed.
+ * Picks the fastest variant this build (and cpu) has.
+ *
+ * @param dst
+ * @param src
+ * @param len
+ * @param mask Mask lined up with src[0]
+ * @return uint32_t The mask lined up with the byte after the last one. Pass it to the next call
+ *                  to continue the same payload (eg. in the next pbuf).
+ */
+uint32_t ws_mask_copy(void* dst, const void* src, size_t len, uint32_t mask);
+
+// The variants. Exposed for the benchmark, use ws_mask_copy().
+
+// One byte at a time. The reference.
+uint32_t ws_mask_copy_bytes(void* dst, const void* src, size_t len, uint32_t mask);
+// 32-bit words. Lines dst up on a word boundary, src is shifted into place if it does not line up too
+// (no unaligned loads, the M0+ faults on those).
+uint32_t ws_mask_copy_words(void* dst, const void* src, size_t len, uint32_t mask);
+
+#if defined(__x86_64__) || defined(__i386__)
+#define WS_MASK_HAVE_SSE2 1
+uint32_t ws_mask_copy_sse2(void* dst, const void* src, size_t len, uint32_t mask);
+#if defined(__GNUC__)
+// Compiled for AVX2 regardless of the build flags, only used when the cpu has it.
+#define WS_MASK_HAVE_AVX2 1
+uint32_t ws_mask_copy_avx2(void* dst, const void* src, size_t len, uint32_t mask);
+int ws_mask_cpu_has_avx2();
+#endif
+#endif
+
+#endif
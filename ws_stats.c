@@ -0,0 +1,197 @@
+#include "ws_stats.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+void ws_con_stats_add(ws_con_stats* sum, const ws_con_stats* con) {
+    sum->bytes_in       += con->bytes_in;
+    sum->bytes_out      += con->bytes_out;
+    sum->frames_in      += con->frames_in;
+    sum->frames_out     += con->frames_out;
+    sum->yields_read    += con->yields_read;
+    sum->yields_flush   += con->yields_flush;
+    sum->yields_ack     += con->yields_ack;
+    sum->ack_wait_us    += con->ack_wait_us;
+    sum->ring_stalls    += con->ring_stalls;
+    sum->wrap_stalls    += con->wrap_stalls;
+    sum->ring_grows     += con->ring_grows;
+    sum->pbuf_coalesces += con->pbuf_coalesces;
+    if (con->ring_peak > sum->ring_peak) {
+        sum->ring_peak = con->ring_peak;
+    }
+}
+
+void ws_stats_buf_init(ws_stats_buf* out, char* buf, size_t size, bool json) {
+    out->buf = buf;
+    out->len = 0;
+    out->size = size;
+    out->json = json;
+    out->truncated = false;
+    out->first = true;
+    out->closing = 0;
+    out->dropped = 0;
+    if (size) {
+        buf[0] = '\0';
+    }
+}
+
+/**
+ * @brief Adds a piece if it fits next to the closing brackets and extra more bytes.
+ *
+ * @return true if it was added
+ */
+static bool ws_stats_printf(ws_stats_buf* out, size_t extra, const char* format, ...) {
+    if (out->truncated) {
+        return false;
+    }
+    size_t keep = out->closing + extra;
+    size_t room = out->size - out->len > keep ? out->size - out->len - keep : 0;
+    int n = -1;
+    if (room) {
+        va_list args;
+        va_start(args, format);
+        n = vsnprintf(out->buf + out->len, room, format, args);
+        va_end(args);
+    }
+
+    if (n < 0 || (size_t) n >= room) {
+        // Drop the piece that didn't fit, everything before it stays whole
+        out->truncated = true;
+        if (out->size) {
+            out->buf[out->len] = '\0';
+        }
+        return false;
+    }
+    out->len += n;
+    return true;
+}
+
+/**
+ * @brief The ',' in front of everything but the first thing in a JSON object or array.
+ * Goes out with the piece, so a piece that is dropped does not leave one dangling.
+ */
+static const char* ws_stats_separator(ws_stats_buf* out) {
+    return out->first ? "" : ",";
+}
+
+/**
+ * @brief Opens an object or array. Its closer is kept room for until ws_stats_close().
+ */
+static void ws_stats_open(ws_stats_buf* out, const char* name, char bracket) {
+    bool opened = name
+        ? ws_stats_printf(out, 1, "%s\"%s\":%c", ws_stats_separator(out), name, bracket)
+        : ws_stats_printf(out, 1, "%s%c", ws_stats_separator(out), bracket);
+    if (opened) {
+        out->closing++;
+    } else {
+        out->dropped++;
+    }
+    out->first = true;
+}
+
+static void ws_stats_close(ws_stats_buf* out, char bracket) {
+    out->first = false;
+    if (out->dropped) {
+        out->dropped--;
+        return;
+    }
+    // The room was kept when it was opened
+    out->buf[out->len++] = bracket;
+    out->buf[out->len] = '\0';
+    out->closing--;
+}
+
+void ws_stats_begin(ws_stats_buf* out) {
+    if (out->json) {
+        // "}\n" at the end
+        if (ws_stats_printf(out, 2, "{")) {
+            out->closing += 2;
+        } else {
+            out->dropped++;
+        }
+        out->first = true;
+    }
+}
+
+void ws_stats_end(ws_stats_buf* out) {
+    if (out->json) {
+        ws_stats_close(out, '}');
+        if (out->closing) {
+            out->buf[out->len++] = '\n';
+            out->buf[out->len] = '\0';
+            out->closing--;
+        }
+    }
+}
+
+void ws_stats_begin_object(ws_stats_buf* out, const char* name) {
+    if (out->json) {
+        ws_stats_open(out, name, '{');
+    }
+}
+
+void ws_stats_end_object(ws_stats_buf* out) {
+    if (out->json) {
+        ws_stats_close(out, '}');
+    }
+}
+
+void ws_stats_begin_array(ws_stats_buf* out, const char* name) {
+    if (out->json) {
+        ws_stats_open(out, name, '[');
+    }
+}
+
+void ws_stats_end_array(ws_stats_buf* out) {
+    if (out->json) {
+        ws_stats_close(out, ']');
+    }
+}
+
+void ws_stats_u32(ws_stats_buf* out, const char* prefix, const char* name, uint32_t value) {
+    if (out->json) {
+        if (ws_stats_printf(out, 0, "%s\"%s\":%lu", ws_stats_separator(out), name, (unsigned long) value)) {
+            out->first = false;
+        }
+    } else {
+        ws_stats_printf(out, 0, "%s%s %lu\n", prefix ? prefix : "", name, (unsigned long) value);
+    }
+}
+
+void ws_stats_bool(ws_stats_buf* out, const char* prefix, const char* name, bool value) {
+    if (out->json) {
+        if (ws_stats_printf(out, 0, "%s\"%s\":%s", ws_stats_separator(out), name, value ? "true" : "false")) {
+            out->first = false;
+        }
+    } else {
+        ws_stats_printf(out, 0, "%s%s %d\n", prefix ? prefix : "", name, value);
+    }
+}
+
+// Every field is a uint32_t, so one table does them all.
+static const struct {
+    const char* name;
+    size_t offset;
+} ws_con_stats_fields[] = {
+    { "bytes_in",       offsetof(ws_con_stats, bytes_in) },
+    { "bytes_out",      offsetof(ws_con_stats, bytes_out) },
+    { "frames_in",      offsetof(ws_con_stats, frames_in) },
+    { "frames_out",     offsetof(ws_con_stats, frames_out) },
+    { "yields_read",    offsetof(ws_con_stats, yields_read) },
+    { "yields_flush",   offsetof(ws_con_stats, yields_flush) },
+    { "yields_ack",     offsetof(ws_con_stats, yields_ack) },
+    { "ack_wait_us",    offsetof(ws_con_stats, ack_wait_us) },
+    { "ring_peak",      offsetof(ws_con_stats, ring_peak) },
+    { "ring_stalls",    offsetof(ws_con_stats, ring_stalls) },
+    { "wrap_stalls",    offsetof(ws_con_stats, wrap_stalls) },
+    { "ring_grows",     offsetof(ws_con_stats, ring_grows) },
+    { "pbuf_coalesces", offsetof(ws_con_stats, pbuf_coalesces) },
+};
+
+void ws_stats_con(ws_stats_buf* out, const char* prefix, const ws_con_stats* con) {
+    for (size_t i = 0; i < sizeof(ws_con_stats_fields) / sizeof(ws_con_stats_fields[0]); i++) {
+        ws_stats_u32(out, prefix, ws_con_stats_fields[i].name,
+            *(const uint32_t*) ((const char*) con + ws_con_stats_fields[i].offset));
+    }
+}
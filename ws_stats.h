@@ -0,0 +1,107 @@
+#ifndef WS_STATS_H
+#define WS_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Counters are plain uint32_t increments, cheap enough to leave on. -DWS_STATS=0 compiles them out.
+// They are bumped from the lwIP callbacks and from the tasks without a lock, a reader can see
+// one field a bit ahead of another. Good enough for watching a device.
+#ifndef WS_STATS
+#define WS_STATS 1
+#endif
+
+#if WS_STATS
+#define WS_STAT(expr) ((void) (expr))
+#else
+#define WS_STAT(expr) ((void) 0)
+#endif
+
+/**
+ * @brief Counters of one connection. Zeroed when the slot is claimed, added to
+ * ws_server_stats.closed when the connection ends.
+ */
+typedef struct ws_con_stats_ {
+    // TCP payload, ciphertext on TLS connections. Out is counted when it's ack'ed.
+    uint32_t bytes_in;
+    uint32_t bytes_out;
+    // Websocket frames, control frames included
+    uint32_t frames_in;
+    uint32_t frames_out;
+
+    // Times the task yielded for each WS_T_YIELD_REASON_*. A yield for several counts for each.
+    uint32_t yields_read;
+    uint32_t yields_flush;
+    uint32_t yields_ack;
+    // Time spent in yields for WAIT_FOR_ACK. Wraps after about 71 minutes of waiting.
+    uint32_t ack_wait_us;
+
+    // Most framinator ring bytes in flight at once
+    uint32_t ring_peak;
+    // Waits for an ACK because the ring was full, of those the ones while wrapping around
+    uint32_t ring_stalls;
+    uint32_t wrap_stalls;
+    uint32_t ring_grows;
+
+    // tcp_cli_con_recv() squashed the pbuf chain to give the pool back
+    uint32_t pbuf_coalesces;
+} ws_con_stats;
+
+/**
+ * @brief Counters of the whole server.
+ */
+typedef struct ws_server_stats_ {
+    uint32_t accepted;
+    // No free slot (or no stack for it)
+    uint32_t rejected;
+    uint32_t accept_errors;
+    // Every connection that ended. ring_peak is the highest of them.
+    ws_con_stats closed;
+} ws_server_stats;
+
+void ws_con_stats_add(ws_con_stats* sum, const ws_con_stats* con);
+
+/**
+ * @brief Where the /stats body is formatted. Text is "name value" lines, JSON one object.
+ * Once it's full, the rest is dropped and truncated is set. JSON keeps room for the brackets
+ * that close what is open, so it stays valid, just shorter.
+ */
+typedef struct ws_stats_buf_ {
+    char* buf;
+    size_t len;
+    size_t size;
+    bool json;
+    bool truncated;
+    // JSON: nothing in the current object yet, no ',' needed
+    bool first;
+    // JSON: bytes kept free for the closing brackets (and the last '\n')
+    size_t closing;
+    // JSON: objects and arrays begun after the buffer was full. Their ends are dropped too.
+    int dropped;
+} ws_stats_buf;
+
+void ws_stats_buf_init(ws_stats_buf* out, char* buf, size_t size, bool json);
+
+// The building blocks. Objects and arrays only exist in JSON, text has no structure
+// but the prefix put in front of each name (eg. "con.3.").
+void ws_stats_begin(ws_stats_buf* out);
+void ws_stats_end(ws_stats_buf* out);
+// name is NULL for the elements of an array
+void ws_stats_begin_object(ws_stats_buf* out, const char* name);
+void ws_stats_end_object(ws_stats_buf* out);
+void ws_stats_begin_array(ws_stats_buf* out, const char* name);
+void ws_stats_end_array(ws_stats_buf* out);
+void ws_stats_u32(ws_stats_buf* out, const char* prefix, const char* name, uint32_t value);
+void ws_stats_bool(ws_stats_buf* out, const char* prefix, const char* name, bool value);
+
+/**
+ * @brief All the fields of a ws_con_stats.
+ *
+ * @param out
+ * @param prefix Put in front of the names in text (eg. "con.3."), ignored in JSON
+ * @param con
+ */
+void ws_stats_con(ws_stats_buf* out, const char* prefix, const ws_con_stats* con);
+
+#endif
@@ -0,0 +1,89 @@
+#include "ws_tls.h"
+
+#include <string.h>
+
+#include "mbedtls/version.h"
+
+// mbedtls 3 wants an RNG to parse keys (blinding)
+#if MBEDTLS_VERSION_MAJOR >= 3
+#define ws_tls_parse_key(server, key, key_len) \
+    mbedtls_pk_parse_key(&(server)->key, key, key_len, NULL, 0, mbedtls_ctr_drbg_random, &(server)->ctr_drbg)
+#else
+#define ws_tls_parse_key(server, key, key_len) \
+    mbedtls_pk_parse_key(&(server)->key, key, key_len, NULL, 0)
+#endif
+
+static const char ws_tls_personalization[] = "ws_tls";
+
+// Cheapest first. mbedtls leaves out the ones the key or the build can't do.
+// The RSA ones are only there for people who bring an RSA certificate, ECDSA is a lot faster on the pico.
+static const int ws_tls_ciphersuites[] = {
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA256,
+    0
+};
+
+int ws_tls_server_init(ws_tls_server* server,
+        const unsigned char* cert, size_t cert_len,
+        const unsigned char* key, size_t key_len) {
+    int ret;
+
+    mbedtls_ssl_config_init(&server->conf);
+    mbedtls_x509_crt_init(&server->cert);
+    mbedtls_pk_init(&server->key);
+    mbedtls_entropy_init(&server->entropy);
+    mbedtls_ctr_drbg_init(&server->ctr_drbg);
+    mbedtls_ssl_cache_init(&server->cache);
+
+    if ((ret = mbedtls_ctr_drbg_seed(&server->ctr_drbg, mbedtls_entropy_func, &server->entropy,
+            (const unsigned char*) ws_tls_personalization, sizeof(ws_tls_personalization) - 1))) {
+        return ret;
+    }
+    if ((ret = mbedtls_x509_crt_parse(&server->cert, cert, cert_len))) {
+        return ret;
+    }
+    if ((ret = ws_tls_parse_key(server, key, key_len))) {
+        return ret;
+    }
+
+    if ((ret = mbedtls_ssl_config_defaults(&server->conf, MBEDTLS_SSL_IS_SERVER,
+            MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT))) {
+        return ret;
+    }
+    mbedtls_ssl_conf_rng(&server->conf, mbedtls_ctr_drbg_random, &server->ctr_drbg);
+    mbedtls_ssl_conf_ciphersuites(&server->conf, ws_tls_ciphersuites);
+    if ((ret = mbedtls_ssl_conf_own_cert(&server->conf, &server->cert, &server->key))) {
+        return ret;
+    }
+
+    // Returning clients present their session id and get the abbreviated handshake.
+    mbedtls_ssl_cache_set_max_entries(&server->cache, WS_TLS_SESSION_CACHE_LEN);
+    mbedtls_ssl_cache_set_timeout(&server->cache, WS_TLS_SESSION_TIMEOUT_S);
+    mbedtls_ssl_conf_session_cache(&server->conf, &server->cache,
+        mbedtls_ssl_cache_get, mbedtls_ssl_cache_set);
+
+    return 0;
+}
+
+void ws_tls_server_free(ws_tls_server* server) {
+    mbedtls_ssl_cache_free(&server->cache);
+    mbedtls_ssl_config_free(&server->conf);
+    mbedtls_ctr_drbg_free(&server->ctr_drbg);
+    mbedtls_entropy_free(&server->entropy);
+    mbedtls_pk_free(&server->key);
+    mbedtls_x509_crt_free(&server->cert);
+}
+
+int ws_tls_setup(ws_tls_server* server, mbedtls_ssl_context* ssl,
+        void* bio, mbedtls_ssl_send_t* send, mbedtls_ssl_recv_t* recv) {
+    int ret;
+
+    mbedtls_ssl_init(ssl);
+    if ((ret = mbedtls_ssl_setup(ssl, &server->conf))) {
+        return ret;
+    }
+    mbedtls_ssl_set_bio(ssl, bio, send, recv, NULL);
+    return 0;
+}
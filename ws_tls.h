@@ -0,0 +1,68 @@
+#ifndef WS_TLS_H
+#define WS_TLS_H
+
+#include <stddef.h>
+
+#include "mbedtls/ssl.h"
+#include "mbedtls/ssl_cache.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+
+// TLS for wss://, on top of mbedtls. Nothing in here knows about lwIP, the caller moves
+// the ciphertext with the send/recv callbacks given to ws_tls_setup().
+
+// Sessions kept around so a returning client can skip the ECDHE + signature (abbreviated handshake).
+// Each one is ~100 bytes of heap.
+#ifndef WS_TLS_SESSION_CACHE_LEN
+#define WS_TLS_SESSION_CACHE_LEN 4
+#endif
+#ifndef WS_TLS_SESSION_TIMEOUT_S
+#define WS_TLS_SESSION_TIMEOUT_S (60 * 60)
+#endif
+
+/**
+ * @brief Everything the connections share: certificate, key, RNG and the session cache.
+ */
+typedef struct ws_tls_server_ {
+    mbedtls_ssl_config conf;
+    mbedtls_x509_crt cert;
+    mbedtls_pk_context key;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+    mbedtls_ssl_cache_context cache;
+} ws_tls_server;
+
+/**
+ * @brief Loads the certificate (chain) and it's key and gets the config ready.
+ * ws_tls_server_free() even if it fails.
+ *
+ * @param server
+ * @param cert PEM (including the null terminator, cert_len counts it) or DER
+ * @param cert_len
+ * @param key Same
+ * @param key_len
+ * @return int 0 or an mbedtls error code
+ */
+int ws_tls_server_init(ws_tls_server* server,
+        const unsigned char* cert, size_t cert_len,
+        const unsigned char* key, size_t key_len);
+
+void ws_tls_server_free(ws_tls_server* server);
+
+/**
+ * @brief Gets a connection's context ready for mbedtls_ssl_handshake(). mbedtls_ssl_free() it when done.
+ * Allocates mbedtls' record buffers.
+ *
+ * @param server Has to outlive the connection
+ * @param ssl
+ * @param bio Passed to send and recv
+ * @param send Returns MBEDTLS_ERR_SSL_WANT_WRITE when the transport is full
+ * @param recv Returns MBEDTLS_ERR_SSL_WANT_READ when there is nothing yet, 0 on EOF
+ * @return int 0 or an mbedtls error code
+ */
+int ws_tls_setup(ws_tls_server* server, mbedtls_ssl_context* ssl,
+        void* bio, mbedtls_ssl_send_t* send, mbedtls_ssl_recv_t* recv);
+
+#endif
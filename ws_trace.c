@@ -0,0 +1,91 @@
+#include "ws_trace.h"
+
+#if WS_TRACE_LEVEL
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+
+static_assert((WS_TRACE_LEN & (WS_TRACE_LEN - 1)) == 0, "WS_TRACE_LEN must be a power of two");
+
+static ws_trace_record ws_trace_ring[WS_TRACE_LEN];
+// Records handed out so far. The next one goes at ws_trace_head % WS_TRACE_LEN.
+static volatile uint32_t ws_trace_head;
+// Records printed by ws_trace_drain(). Main loop only.
+static uint32_t ws_trace_drained;
+
+static const char* const ws_trace_formats[WS_TRACE_EVENT_COUNT] = {
+    [WS_TRACE_RECV]         = "con %u recv %ld",
+    [WS_TRACE_ACKED]        = "con %u acked %ld",
+    [WS_TRACE_POLL]         = "con %u poll",
+    [WS_TRACE_COMMAND]      = "con %u command %c",
+    [WS_TRACE_ACCEPT]       = "con %u accepted, secure %ld",
+    [WS_TRACE_REJECT]       = "no free slot, rejected (secure %u)",
+    [WS_TRACE_ACCEPT_ERROR] = "accept failed (secure %u) err %ld",
+    [WS_TRACE_ERROR]        = "con %u tcp error %ld",
+    [WS_TRACE_CLOSE_FAILED] = "con %u close failed %ld, aborted",
+};
+
+void ws_trace_write(ws_trace_event event, uint16_t a, int32_t b) {
+    // The M0+ has no exclusive load/store, so taking an index is the only part done with
+    // interrupts off. An interrupt that writes a record in between just gets the next one.
+    uint32_t save = save_and_disable_interrupts();
+    uint32_t i = ws_trace_head++;
+    restore_interrupts(save);
+
+    ws_trace_record* rec = &ws_trace_ring[i & (WS_TRACE_LEN - 1)];
+    rec->seq = 0;
+    __compiler_memory_barrier();
+    rec->time_us = time_us_32();
+    rec->event = event;
+    rec->a = a;
+    rec->b = b;
+    __compiler_memory_barrier();
+    rec->seq = i + 1;
+}
+
+/**
+ * @brief Prints record i, or that it's gone if it was overwritten (while we were reading it even).
+ */
+static void ws_trace_print(uint32_t i) {
+    ws_trace_record* slot = &ws_trace_ring[i & (WS_TRACE_LEN - 1)];
+    __compiler_memory_barrier();
+    ws_trace_record rec = *slot;
+    __compiler_memory_barrier();
+
+    if (rec.seq != i + 1 || slot->seq != i + 1 || rec.event >= WS_TRACE_EVENT_COUNT) {
+        printf("%10s trace record lost\n", "");
+        return;
+    }
+    printf("%10lu ", (unsigned long) rec.time_us);
+    printf(ws_trace_formats[rec.event], rec.a, (long) rec.b);
+    printf("\n");
+}
+
+void ws_trace_drain(size_t max) {
+    uint32_t head = ws_trace_head;
+
+    if (head - ws_trace_drained > WS_TRACE_LEN) {
+        printf("%10s %lu trace records lost\n", "", (unsigned long) (head - ws_trace_drained - WS_TRACE_LEN));
+        ws_trace_drained = head - WS_TRACE_LEN;
+    }
+    for (; ws_trace_drained != head && max; ws_trace_drained++, max--) {
+        ws_trace_print(ws_trace_drained);
+    }
+}
+
+void ws_trace_dump() {
+    uint32_t head = ws_trace_head;
+    uint32_t i = head > WS_TRACE_LEN ? head - WS_TRACE_LEN : 0;
+
+    printf("Trace, %lu records since boot:\n", (unsigned long) head);
+    for (; i != head; i++) {
+        ws_trace_print(i);
+    }
+    ws_trace_drained = head;
+}
+
+#endif
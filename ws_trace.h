@@ -0,0 +1,82 @@
+#ifndef WS_TRACE_H
+#define WS_TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A ring of small binary records for the places that can't printf (lwIP callbacks, per byte loops).
+// Writing one is a timer read and a few stores, formatting waits for ws_trace_drain()/ws_trace_dump()
+// in the main loop.
+
+// Levels. Everything above WS_TRACE_LEVEL is compiled out, arguments and all. 0 drops the ring too.
+#define WS_TRACE_OFF     0
+// Connections coming, going and failing
+#define WS_TRACE_INFO    1
+// Every recv, ACK, poll and command byte
+#define WS_TRACE_VERBOSE 2
+
+#ifndef WS_TRACE_LEVEL
+#define WS_TRACE_LEVEL WS_TRACE_VERBOSE
+#endif
+
+// Records kept, a power of two. The oldest get overwritten.
+#ifndef WS_TRACE_LEN
+#define WS_TRACE_LEN 256
+#endif
+
+// What happened. The format for each is in ws_trace.c, it gets a then b.
+typedef enum {
+    WS_TRACE_RECV,          // a: slot, b: bytes
+    WS_TRACE_ACKED,         // a: slot, b: bytes
+    WS_TRACE_POLL,          // a: slot
+    WS_TRACE_COMMAND,       // a: slot, b: the command byte
+    WS_TRACE_ACCEPT,        // a: slot, b: secure
+    WS_TRACE_REJECT,        // a: secure
+    WS_TRACE_ACCEPT_ERROR,  // a: secure, b: err_t
+    WS_TRACE_ERROR,         // a: slot, b: err_t (tcp_err)
+    WS_TRACE_CLOSE_FAILED,  // a: slot, b: err_t (tcp_close), the pcb was aborted instead
+    WS_TRACE_EVENT_COUNT
+} ws_trace_event;
+
+typedef struct ws_trace_record_ {
+    uint32_t time_us;
+    // Index + 1 once the record is whole, 0 while it's being written
+    uint32_t seq;
+    uint16_t event;
+    uint16_t a;
+    int32_t b;
+} ws_trace_record;
+
+#if WS_TRACE_LEVEL
+/**
+ * @brief Adds a record. Safe from interrupts, it never blocks.
+ */
+void ws_trace_write(ws_trace_event event, uint16_t a, int32_t b);
+
+/**
+ * @brief Prints up to max records that came in since the last drain.
+ */
+void ws_trace_drain(size_t max);
+
+/**
+ * @brief Prints every record still in the ring, drained or not.
+ */
+void ws_trace_dump();
+#else
+#define ws_trace_drain(max) ((void) 0)
+#define ws_trace_dump() ((void) 0)
+#endif
+
+#if WS_TRACE_LEVEL >= WS_TRACE_INFO
+#define WS_TRACE_I(event, a, b) ws_trace_write(event, a, b)
+#else
+#define WS_TRACE_I(event, a, b) ((void) 0)
+#endif
+
+#if WS_TRACE_LEVEL >= WS_TRACE_VERBOSE
+#define WS_TRACE_V(event, a, b) ws_trace_write(event, a, b)
+#else
+#define WS_TRACE_V(event, a, b) ((void) 0)
+#endif
+
+#endif